@@ -4,27 +4,131 @@
 #include <unordered_map>
 #include <time.h>
 #include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <algorithm>
 #include "SpaceFS.h"
+#include <intrin.h>
+#if defined(_M_X64) || defined(_M_IX86)
+#include <tmmintrin.h>
+#endif
 
-unsigned long Sectorsize = 512;
-struct SectorSize
-{
-	unsigned long unused = Sectorsize;
-};
-
-std::unordered_map<unsigned, unsigned> emap;
-std::unordered_map<unsigned, unsigned> dmap;
-std::unordered_map<std::string, unsigned long long> partlist;
-std::unordered_map<std::string, SectorSize> list;
+unsigned char encodetable[65536] = { 0 };
+char decodetable[512] = { 0 };
+char codecchars[16] = { 0 };
+char codecindex[2][16] = { 0 };
+char codechigh[2] = { 16, 16 };
+bool codecsimd = false;
+std::vector<unsigned long long> sectormap; // Bit per sector, set once any of its bytes is used
+std::vector<unsigned long long> sectormapfull; // Bit per sectormap word, set when all 64 sectors are used
+std::unordered_map<unsigned long long, Part> partmap; // Partly used sectors
+std::vector<std::vector<unsigned long long>> partclass; // Partly used sectors by longest free run / 64
+unsigned long long sectorhint = 0;
 bool redetect = true;
-std::unordered_map<std::wstring, unsigned long long>* filenameindexlist_;
-std::unordered_map<std::wstring, unsigned long long> filenamestrindexlist;
+std::unordered_map<std::string, unsigned long long> filenamehash; // Case folded name to serial
+std::vector<unsigned long long> filenameserials; // Serial of every name in filenames order
+std::vector<unsigned long long> filenameindexlist; // filenameindex of every name
+std::vector<unsigned long long> filenamestrindexlist; // Terminator of every name
+std::unordered_map<std::string, std::map<std::string, std::string>> dirindex; // Folded directory to its children, folded name to name
+std::unordered_map<std::string, std::map<std::string, std::string>> streamindex; // Folded file to its streams, folded stream to stream
+std::map<unsigned long long, std::set<unsigned long long>> freeslots; // Tombstone length to serials, lowest reused first
+unsigned long long tombstones = 0;
+unsigned long long filenameserial = 0;
+bool filenamedups = false;
+bool reindex = true;
+Inodes inodes; // Times and attributes by filenameindex
+bool filetimes = false; // Table keeps FILETIME integers instead of doubles since 1970
+bool extrecords = false; // Table format v3, the attributes of each file carry its descriptor id and reparse tag
+unsigned long attrsize = 11; // Attribute bytes per file in the table, 19 with extended records
+std::vector<std::string> descriptors = { "" }; // Self-relative security descriptors by id, 0 for none
+std::vector<bool> descriptorstored = { true }; // Whether each is in the store, those of security files are only kept in memory
+std::unordered_map<std::string, unsigned long> descriptorids; // Descriptor to its id in the store
+unsigned atimemode = 0; // 0 every read, 1 relatime, 2 noatime
+unsigned long long atimeinterval = 864000000000; // Relatime, a day
+std::set<unsigned long long> atimelist; // Access times set but not yet marked dirty
+std::unordered_map<unsigned long long, std::vector<Extent>> extentlist;
+std::unordered_map<unsigned long long, std::string> inlinelist; // Whole contents of small files
+unsigned long long inlinesize = 60; // Largest file kept in inlinelist, or in its table entry with extended records
+unsigned long long inlinemax = 256; // Largest file ever kept in its table entry
+unsigned long long inlinelimit = 65536; // Most files kept in inlinelist
+std::unordered_map<unsigned long long, std::string> reparselist; // Reparse buffers by filenameindex
+unsigned long long reparselimit = 65536; // Most buffers kept in reparselist
+std::unordered_map<unsigned long long, Eas> ealist; // Parsed EA blocks by filenameindex of their stream
+unsigned long long ealimit = 65536; // Most blocks kept in ealist
+unsigned long long drivecalls = 0; // ReadFile and WriteFile calls made by readwritedrive
+unsigned long long maxtransfer = 1 << 24; // Largest single transfer readwriteextents merges sectors into
+std::vector<unsigned long long> tablestrindexlist;
+std::vector<unsigned long long> binindexlist;
+unsigned long long dirtystart[4] = { 0, 0, 0, 0 };
+unsigned long long dirtyend[4] = { 0, 0, 0, 0 };
+unsigned long long regionlen[3] = { 0, 0, 0 };
+bool dirtyall = true;
+std::vector<bool> tableunits;
+std::string journal = "";
+std::unordered_map<unsigned long long, bool> journalinfolist;
+bool journaling = false;
+unsigned long long journalgen = 0;
+unsigned long long journaltail = 512;
 
-void handmaps(std::unordered_map<unsigned, unsigned> Emap, std::unordered_map<unsigned, unsigned> Dmap, std::unordered_map<std::wstring, unsigned long long>& filenameindexlist)
-{
-	emap = Emap;
-	dmap = Dmap;
-	filenameindexlist_ = &filenameindexlist;
+void handmaps(std::unordered_map<unsigned, unsigned> Emap, std::unordered_map<unsigned, unsigned> Dmap)
+{ // Flat tables instead of hashing every table byte, pairs not in the map stay 0 like before.
+	memset(encodetable, 0, sizeof(encodetable));
+	memset(decodetable, 0, sizeof(decodetable));
+	for (auto& e : Emap)
+	{
+		if (e.first < 65536)
+		{
+			encodetable[e.first] = e.second & 0xff;
+		}
+	}
+	for (auto& d : Dmap)
+	{
+		if (d.first < 256)
+		{
+			decodetable[d.first * 2] = d.second >> 8;
+			decodetable[d.first * 2 + 1] = d.second & 0xff;
+		}
+	}
+	codecsimd = Emap.size() == 225 && Dmap.size() == 225;
+	for (unsigned i = 0; i < 15; i++)
+	{
+		codecchars[i] = decodetable[i * 30];
+	}
+	codecchars[15] = 0;
+	for (unsigned p = 0; p < 225 && codecsimd; p++)
+	{ // The vector path computes pairs as 15 * first + second.
+		codecsimd = decodetable[p * 2] == codecchars[p / 15] && decodetable[p * 2 + 1] == codecchars[p % 15] && encodetable[(unsigned)(unsigned char)codecchars[p / 15] << 8 | (unsigned char)codecchars[p % 15]] == p && (codecchars[p / 15] & 0x80) == 0;
+	}
+	memset(codecindex, 0, sizeof(codecindex));
+	codechigh[0] = 16;
+	codechigh[1] = 16;
+	for (unsigned i = 0; i < 15 && codecsimd; i++)
+	{ // Index + 1 by low nibble, one table for each of at most two high nibbles.
+		unsigned k = codechigh[0] == codecchars[i] >> 4 || codechigh[0] == 16 ? 0 : 1;
+		codecsimd = codechigh[k] == codecchars[i] >> 4 || codechigh[k] == 16;
+		codechigh[k] = codecchars[i] >> 4;
+		codecindex[k][codecchars[i] & 15] = i + 1;
+	}
+#if defined(_M_X64) || defined(_M_IX86)
+	int cpuinfo[4] = { 0 };
+	__cpuid(cpuinfo, 1);
+	codecsimd = codecsimd && (cpuinfo[2] & (1 << 9)); // SSSE3
+#else
+	codecsimd = false;
+#endif
+}
+
+void markdirty(unsigned region, unsigned long long start, unsigned long long end)
+{ // 0 tablestr, 1 filenames, 2 times and 3 attributes by filenameindex; end of ULLONG_MAX when the rest of the region moved.
+	if (dirtystart[region] >= dirtyend[region])
+	{
+		dirtystart[region] = start;
+		dirtyend[region] = end;
+		return;
+	}
+	dirtystart[region] = min(dirtystart[region], start);
+	dirtyend[region] = max(dirtyend[region], end);
 }
 
 void encode(char*& str, unsigned long long& len)
@@ -42,470 +146,1058 @@ void encode(char*& str, unsigned long long& len)
 		str[len - 1] = 32;
 		str[len - 2] = 46;
 	}
-	char* bytes = (char*)calloc(len / 2 + 1, 1);
-	if (!bytes)
-	{
-		return;
-	}
-	for (unsigned long long i = 0; i < len; i += 2)
-	{
-		bytes[i / 2] = emap[str[i] << 8 | str[i + 1]];
+	unsigned long long i = 0;
+#if defined(_M_X64) || defined(_M_IX86)
+	if (codecsimd)
+	{ // 32 chars to 16 bytes, each block is loaded before anything below it is written.
+		__m128i weights = _mm_set1_epi16(0x010f);
+		__m128i low = _mm_set1_epi8(15);
+		__m128i one = _mm_set1_epi8(1);
+		__m128i t0 = _mm_loadu_si128((__m128i*)codecindex[0]);
+		__m128i t1 = _mm_loadu_si128((__m128i*)codecindex[1]);
+		__m128i h0 = _mm_set1_epi8(codechigh[0]);
+		__m128i h1 = _mm_set1_epi8(codechigh[1]);
+		for (; i + 32 <= len; i += 32)
+		{
+			__m128i x[2] = { _mm_loadu_si128((__m128i*)(str + i)), _mm_loadu_si128((__m128i*)(str + i + 16)) };
+			__m128i missing = _mm_setzero_si128();
+			for (unsigned h = 0; h < 2; h++)
+			{
+				__m128i lo = _mm_and_si128(x[h], low);
+				__m128i hi = _mm_and_si128(_mm_srli_epi16(x[h], 4), low);
+				x[h] = _mm_or_si128(_mm_and_si128(_mm_shuffle_epi8(t0, lo), _mm_cmpeq_epi8(hi, h0)), _mm_and_si128(_mm_shuffle_epi8(t1, lo), _mm_cmpeq_epi8(hi, h1)));
+				missing = _mm_or_si128(missing, _mm_cmpeq_epi8(x[h], _mm_setzero_si128()));
+				x[h] = _mm_sub_epi8(x[h], one);
+			}
+			if (_mm_movemask_epi8(missing))
+			{ // Something outside the map, let the table handle this block.
+				for (unsigned long long o = i; o < i + 32; o += 2)
+				{
+					str[o / 2] = encodetable[(unsigned)(unsigned char)str[o] << 8 | (unsigned char)str[o + 1]];
+				}
+				continue;
+			}
+			_mm_storeu_si128((__m128i*)(str + i / 2), _mm_packus_epi16(_mm_maddubs_epi16(x[0], weights), _mm_maddubs_epi16(x[1], weights)));
+		}
 	}
-	char* alc = (char*)realloc(str, len / 2 + 1);
-	if (!alc)
+#endif
+	for (; i < len; i += 2)
 	{
-		free(bytes);
-		return;
+		str[i / 2] = encodetable[(unsigned)(unsigned char)str[i] << 8 | (unsigned char)str[i + 1]];
 	}
-	str = alc;
-	alc = NULL;
-	memcpy(str, bytes, len / 2);
 	str[len / 2] = 0;
-	free(bytes);
 }
 
 void decode(char*& bytes, unsigned long long len)
 {
-	char* str = (char*)calloc(len + 1, 2);
-	if (!str)
-	{
-		return;
-	}
-	unsigned d;
-	for (unsigned long long i = 0; i < len; i++)
-	{
-		d = dmap[bytes[i] & 0xff];
-		str[i * 2] = d >> 8;
-		str[i * 2 + 1] = d & 0xff;
-	}
 	char* alc = (char*)realloc(bytes, (len + 1) * 2);
 	if (!alc)
 	{
-		free(str);
 		return;
 	}
 	bytes = alc;
 	alc = NULL;
-	memcpy(bytes, str, len * 2 + 1);
-	free(str);
-}
-
-int settablesize(unsigned long sectorsize, unsigned long& tablesize, unsigned long long& extratablesize, char*& table)
-{
-	extratablesize = (tablesize * static_cast<unsigned long long>(sectorsize));
-	char* alc = NULL;
-	alc = (char*)realloc(table, extratablesize);
-	if (!alc)
+	bytes[len * 2] = 0;
+	unsigned long long i = len;
+#if defined(_M_X64) || defined(_M_IX86)
+	if (codecsimd)
+	{ // Back to front so every byte is read before its pair lands on it.
+		__m128i chars = _mm_loadu_si128((__m128i*)codecchars);
+		__m128i zero = _mm_setzero_si128();
+		__m128i fifteen = _mm_set1_epi16(15);
+		__m128i recip = _mm_set1_epi16(4370); // v * 4370 >> 16 == v / 15 for v < 256
+		__m128i last = _mm_set1_epi16(224);
+		__m128i unmapped = _mm_set1_epi16((short)0x8080);
+		while (i >= 16)
+		{
+			i -= 16;
+			__m128i v = _mm_loadu_si128((__m128i*)(bytes + i));
+			__m128i w[2] = { _mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero) };
+			for (unsigned h = 0; h < 2; h++)
+			{
+				__m128i q = _mm_mulhi_epu16(w[h], recip);
+				__m128i r = _mm_sub_epi16(w[h], _mm_mullo_epi16(q, fifteen));
+				__m128i p = _mm_or_si128(q, _mm_slli_epi16(r, 8));
+				p = _mm_or_si128(p, _mm_and_si128(_mm_cmpgt_epi16(w[h], last), unmapped));
+				w[h] = _mm_shuffle_epi8(chars, p);
+			}
+			_mm_storeu_si128((__m128i*)(bytes + i * 2 + 16), w[1]);
+			_mm_storeu_si128((__m128i*)(bytes + i * 2), w[0]);
+		}
+	}
+#endif
+	while (i)
 	{
-		tablesize = 1 + table[4] + (table[3] << 8) + (table[2] << 16) + (table[1] << 24);
-		extratablesize = (tablesize * static_cast<unsigned long long>(sectorsize));
-		return 1;
+		i--;
+		unsigned d = bytes[i] & 0xff;
+		bytes[i * 2] = decodetable[d * 2];
+		bytes[i * 2 + 1] = decodetable[d * 2 + 1];
 	}
-	table = alc;
-	alc = NULL;
-	tablesize--;
-	table[1] = (tablesize & 0xff000000) >> 24;
-	table[2] = (tablesize & 0x00ff0000) >> 16;
-	table[3] = (tablesize & 0x0000ff00) >> 8;
-	table[4] = (tablesize & 0x000000ff);
-	tablesize++;
-	return 0;
 }
 
-void resetcloc(unsigned long long& cloc, std::string& cblock, std::string& str0, std::string& str1, std::string& str2, unsigned step)
+void putvarint(char* buf, unsigned long long& pos, unsigned long long val)
 {
-	switch (step)
+	while (val > 127)
 	{
-	case 0:
-		str0 = cblock;
-		break;
-	case 1:
-		str1 = cblock;
-		break;
-	case 2:
-		str2 = cblock;
-		break;
+		buf[pos] = (val & 127) | 128;
+		val >>= 7;
+		pos++;
 	}
-	cloc = 0;
-	cblock.resize(cloc);
+	buf[pos] = val & 127;
+	pos++;
 }
 
-unsigned long long getpindex(unsigned long long index, char* tablestr)
+unsigned long long getvarint(char* buf, unsigned long long& pos, unsigned long long len)
 {
-	unsigned long long pindex = 0;
-	if (!index)
-	{
-		return pindex;
-	}
-	while ((tablestr[index - pindex - 1] & 0xff) != 46)
+	unsigned long long val = 0;
+	unsigned shift = 0;
+	while (pos < len && shift < 64)
 	{
-		pindex++;
-		if (!(index - pindex))
+		val |= static_cast<unsigned long long>(buf[pos] & 127) << shift;
+		shift += 7;
+		pos++;
+		if (!(buf[pos - 1] & 128))
 		{
 			break;
 		}
 	}
-	return pindex;
+	return val;
 }
 
-int getfilesize(unsigned long sectorsize, unsigned long long index, char* tablestr, unsigned long long& filesize)
-{
-	unsigned long long pindex = getpindex(index, tablestr);
-	if (!index || !pindex)
-	{
-		filesize = 0;
-		return 0;
-	}
-	unsigned long long o = 0;
-	std::string cblock;
-	cblock.reserve(21);
-	unsigned long long cloc = 0;
-	std::string str0;
-	std::string str1;
-	std::string str2;
-	std::string rstr;
-	unsigned step = 0;
-	unsigned range = 0;
-	for (unsigned long long i = 0; i < pindex + 1; i++)
+std::string inlinetext(char* bytes, unsigned long long len)
+{ // Entry of a file kept in the table, ';' then three digits a byte.
+	std::string str(1 + len * 3, 59);
+	for (unsigned long long i = 0; i < len; i++)
 	{
-		switch (tablestr[index - pindex + i] & 0xff)
-		{
-		case 59: //;
-			resetcloc(cloc, cblock, str0, str1, str2, step);
-			step++;
-			break;
-		case 46: //.
-			resetcloc(cloc, cblock, str0, str1, str2, step);
-			if (step)
-			{
-				o += std::stoull(str2, 0, 10) - std::stoull(str1, 0, 10);
-			}
-			else if (!range)
-			{
-				o += sectorsize;
-			}
-			if (range)
-			{
-				o += (sectorsize * (std::stoull(str0, 0, 10) - std::stoull(rstr, 0, 10) + 1));
-			}
-			step = 0;
-			range = 0;
-			break;
-		case 45: //-
-			resetcloc(cloc, cblock, str0, str1, str2, step);
-			step = 0;
-			range++;
-			rstr = str0;
-			break;
-		case 44: //,
-			resetcloc(cloc, cblock, str0, str1, str2, step);
-			if (step)
-			{
-				o += std::stoull(str2, 0, 10) - std::stoull(str1, 0, 10);
-			}
-			else if (!range)
-			{
-				o += sectorsize;
-			}
-			if (range)
-			{
-				o += (sectorsize * (std::stoull(str0, 0, 10) - std::stoull(rstr, 0, 10) + 1));
-			}
-			step = 0;
-			range = 0;
-			break;
-		default: //0-9
-			cblock.resize(cloc + 1);
-			cblock[cloc] = tablestr[index - pindex + i];
-			cblock[cloc + 1] = 0;
-			cloc++;
-			break;
-		}
+		unsigned char c = bytes[i] & 0xff;
+		str[1 + i * 3] = 48 + c / 100;
+		str[2 + i * 3] = 48 + c / 10 % 10;
+		str[3 + i * 3] = 48 + c % 10;
 	}
-	filesize = o;
-	return 0;
+	return str;
 }
 
-void addtopartlist(unsigned long sectorsize, unsigned range, unsigned step, std::string str0, std::string str1, std::string str2, std::string rstr, unsigned long long& usedblocks)
+char getinlinebyte(char* digits)
 {
-	if (str0 == "")
-	{
-		return;
-	}
-	if (!range)
+	return (char)(((digits[0] & 0xff) - 48) * 100 + ((digits[1] & 0xff) - 48) * 10 + (digits[2] & 0xff) - 48);
+}
+
+void encodeentry(char* tablestr, unsigned long long entry, unsigned long long end, char* bin, unsigned long long& pos)
+{ // Table format v2, per file: item count, then per item: start, (run << 1 | partial) and if partial: start and end byte.
+  // With extended records the count is shifted up one, a set low bit is instead the length of the bytes that follow.
+	if (extrecords && end > entry && (tablestr[entry] & 0xff) == 59)
 	{
-		if (!step)
+		unsigned long long len = (end - entry - 1) / 3;
+		putvarint(bin, pos, len << 1 | 1);
+		for (unsigned long long i = 0; i < len; i++)
 		{
-			list[str0].unused = 0;
-			usedblocks++;
-			//std::cout << str0 << std::endl;
+			bin[pos + i] = getinlinebyte(tablestr + entry + 1 + i * 3);
 		}
+		pos += len;
+		return;
 	}
-	else
+	unsigned long long count = 0;
+	if (end > entry)
 	{
-		for (unsigned long long i = std::strtoull(rstr.c_str(), 0, 10); i < std::strtoull(str0.c_str(), 0, 10) + 1; i++)
+		count = 1;
+		for (unsigned long long o = entry; o < end; o++)
 		{
-			list[std::to_string(i)].unused = 0;
-			usedblocks++;
+			if ((tablestr[o] & 0xff) == 44)
+			{
+				count++;
+			}
 		}
-		//std::cout << rstr << "-" << str0 << ",";
 	}
-	if (step)
+	putvarint(bin, pos, extrecords ? count << 1 : count);
+	unsigned long long num[4] = { 0 };
+	unsigned range = 0;
+	unsigned step = 0;
+	for (unsigned long long o = entry; o <= end && count; o++)
 	{
-		unsigned long o = std::strtoul(str2.c_str(), 0, 10);
-		bool start = true;
-		std::string str;
-		for (unsigned long i = std::strtoul(str1.c_str(), 0, 10); i < o; i++)
+		switch (tablestr[o] & 0xff)
 		{
-			if (!(i % 64) || start)
-			{
-				str = str0 + ":" + std::to_string(i / 64);
-				start = false;
-			}
-			if (i / 64 < o / 64)
-			{
-				partlist[str] |= 0xffffffffffffffff << i % 64;
-				list[str0].unused -= 64 - i % 64;
-				i += 63 - i % 64;
-			}
-			else
+		case 45:
+			range = 1;
+			break;
+		case 59:
+			step++;
+			break;
+		case 44:
+		case 46:
+			putvarint(bin, pos, num[0]);
+			putvarint(bin, pos, (range ? num[1] - num[0] : 0) << 1 | (step ? 1 : 0));
+			if (step)
 			{
-				partlist[str] |= static_cast<unsigned long long>(1) << i % 64;
-				list[str0].unused--;
+				putvarint(bin, pos, num[2]);
+				putvarint(bin, pos, num[3]);
 			}
-		}
-		if (!list[str0].unused)
-		{
-			usedblocks++;
-			for (unsigned long long i = 0; i < sectorsize / 64; i++)
+			num[0] = 0;
+			num[1] = 0;
+			num[2] = 0;
+			num[3] = 0;
+			range = 0;
+			step = 0;
+			break;
+		default:
+			if ((tablestr[o] & 0xff) >= 48 && (tablestr[o] & 0xff) <= 57)
 			{
-				partlist.erase(str0 + ":" + std::to_string(i));
+				unsigned n = step ? 1 + step : range;
+				num[n] = num[n] * 10 + (tablestr[o] & 0xff) - 48;
 			}
+			break;
 		}
-		//std::cout << str0 << ";" << str1 << ";" << str2 << std::endl;
 	}
 }
 
-int findblock(unsigned long sectorsize, unsigned long long disksize, unsigned long tablesize, char* tablestr, char*& block, unsigned long long& blockstrlen, unsigned long blocksize, unsigned long long& usedblocks)
+int decodeextents(char* bin, unsigned long long& binlen, char*& tablestr)
 {
-	if (redetect)
+	unsigned long long pos = 0;
+	unsigned long long len = getvarint(bin, pos, 10);
+	len += pos;
+	std::string str = "";
+	while (pos < len)
 	{
-		usedblocks = 0;
-		unsigned long long tablelen = 0;
-		unsigned long long tablestrlen = strlen(tablestr);
-		for (unsigned long long i = 0; i < tablestrlen; i++)
+		unsigned long long count = getvarint(bin, pos, len);
+		if (extrecords && count & 1)
 		{
-			if ((tablestr[i] & 0xff) == 46)
+			if ((count >> 1) > len - pos)
 			{
-				tablelen = i + 1;
-			}
-		}
-		std::string cblock;
-		cblock.reserve(21);
-		unsigned long long cloc = 0;
-		std::string str0;
-		std::string str1;
-		std::string str2;
-		std::string rstr;
-		unsigned step = 0;
-		unsigned range = 0;
-		Sectorsize = sectorsize;
-		partlist.clear();
-		list.clear();
-		for (unsigned long long i = 0; i < tablelen; i++)
-		{
-			switch (tablestr[i] & 0xff)
-			{
-			case 59: //;
-				resetcloc(cloc, cblock, str0, str1, str2, step);
-				step++;
-				break;
-			case 46: //.
-				resetcloc(cloc, cblock, str0, str1, str2, step);
-				addtopartlist(sectorsize, range, step, str0, str1, str2, rstr, usedblocks);
-				step = 0;
-				range = 0;
-				break;
-			case 45: //-
-				resetcloc(cloc, cblock, str0, str1, str2, step);
-				step = 0;
-				range++;
-				rstr = str0;
-				break;
-			case 44: //,
-				resetcloc(cloc, cblock, str0, str1, str2, step);
-				addtopartlist(sectorsize, range, step, str0, str1, str2, rstr, usedblocks);
-				step = 0;
-				range = 0;
-				break;
-			default: //0-9
-				cblock.resize(cloc + 1);
-				cblock[cloc] = tablestr[i];
-				cblock[cloc + 1] = 0;
-				cloc++;
-				break;
+				return 1;
 			}
+			str += inlinetext(bin + pos, count >> 1) + ".";
+			pos += count >> 1;
+			continue;
 		}
-	}
-	redetect = false;
-	unsigned long long plist = 0;
-	unsigned long bytecount = 0;
-	unsigned long o = 0;
-	std::string s;
-	std::string t;
-	for (unsigned long long i = 0; i < disksize / sectorsize - tablesize; i++)
-	{
-		t = std::to_string(i);
-		if (list[t].unused >= blocksize)
+		if (extrecords)
+		{
+			count >>= 1;
+		}
+		for (unsigned long long i = 0; i < count; i++)
 		{
-			o = 0;
-			if (list[t].unused == sectorsize)
+			unsigned long long start = getvarint(bin, pos, len);
+			unsigned long long run = getvarint(bin, pos, len);
+			if (i)
 			{
-				o = bytecount = blocksize;
+				str += ",";
 			}
-			while (bytecount < blocksize)
+			str += std::to_string(start);
+			if (run >> 1)
 			{
-				if (!(o % 64))
-				{
-					plist = partlist[t + ":" + std::to_string(o / 64)];
-				}
-				if (!plist)
-				{
-					o += min(blocksize - bytecount, 64);
-					bytecount += min(blocksize - bytecount, 64);
-				}
-				else if (!(plist & static_cast<unsigned long long>(1) << o % 64))
-				{
-					bytecount++;
-					o++;
-				}
-				else
-				{
-					bytecount = 0;
-					o++;
-				}
-				if (blocksize > sectorsize - (o - bytecount))
-				{
-					break;
-				}
+				str += "-" + std::to_string(start + (run >> 1));
 			}
-			if (bytecount == blocksize)
+			if (run & 1)
 			{
-				if (blocksize % sectorsize)
-				{
-					s = t + ";" + std::to_string(o - bytecount) + ";" + std::to_string(o);
-					addtopartlist(sectorsize, 0, 2, t, std::to_string(o - bytecount), std::to_string(o), "", usedblocks);
-				}
-				else
-				{
-					s = t;
-					addtopartlist(sectorsize, 0, 0, t, "", "", "", usedblocks);
-				}
-				break;
+				str += ";" + std::to_string(getvarint(bin, pos, len));
+				str += ";" + std::to_string(getvarint(bin, pos, len));
 			}
 		}
+		str += ".";
 	}
-	if (s == "")
+	char* alc = (char*)realloc(tablestr, str.length() + 1);
+	if (!alc)
 	{
 		return 1;
 	}
-	blockstrlen = strlen(s.c_str());
-	char* alc = (char*)realloc(block, blockstrlen + 1);
+	tablestr = alc;
+	alc = NULL;
+	memcpy(tablestr, str.c_str(), str.length() + 1);
+	binlen = len;
+	return 0;
+}
+
+int settablesize(unsigned long sectorsize, unsigned long& tablesize, unsigned long long& extratablesize, char*& table)
+{
+	extratablesize = (tablesize * static_cast<unsigned long long>(sectorsize));
+	char* alc = NULL;
+	alc = (char*)realloc(table, extratablesize);
 	if (!alc)
 	{
+		tablesize = 1 + table[4] + (table[3] << 8) + (table[2] << 16) + (table[1] << 24);
+		extratablesize = (tablesize * static_cast<unsigned long long>(sectorsize));
 		return 1;
 	}
-	block = alc;
+	table = alc;
 	alc = NULL;
-	memcpy(block, s.c_str(), blockstrlen);
+	tablesize--;
+	table[1] = (tablesize & 0xff000000) >> 24;
+	table[2] = (tablesize & 0x00ff0000) >> 16;
+	table[3] = (tablesize & 0x0000ff00) >> 8;
+	table[4] = (tablesize & 0x000000ff);
+	tablesize++;
 	return 0;
 }
 
-int alloc(unsigned long sectorsize, unsigned long long disksize, unsigned long tablesize, char* charmap, char*& tablestr, unsigned long long& index, unsigned long long size, unsigned long long& usedblocks)
+int readtable(HANDLE hDisk, unsigned long& sectorsize, unsigned long& tablesize, unsigned long long& extratablesize, char*& table)
 {
-	char* block = (char*)calloc(256, 1);
-	unsigned long long tablestrlen = strlen(tablestr);
-	unsigned long long blockstrlen = 0;
-	unsigned long long o = 0;
-	if ((tablestr[index - 1] & 0xff) != 46 && index)
+	_LARGE_INTEGER seek = { 0 };
+	SetFilePointerEx(hDisk, seek, &seek, 0);
+	char bytes[512] = { 0 };
+	DWORD r;
+	if (!ReadFile(hDisk, bytes, 512, &r, NULL))
 	{
-		o++;
+		return 1;
 	}
-	char* alc1 = (char*)calloc(tablestrlen - index + 1, 1);
-	for (unsigned long long i = 0; i < tablestrlen - index; i++)
+	if (r != 512)
 	{
-		alc1[i] = tablestr[index + i];
+		return 1;
 	}
-	unsigned long long alc1len = strlen(alc1);
-	for (unsigned long long p = 0; p < size / sectorsize; p++)
+	sectorsize = 1 << (9 + (bytes[0] & 31));
+	tablesize = 1 + (bytes[4] & 0xff) + ((bytes[3] & 0xff) << 8) + ((bytes[2] & 0xff) << 16) + ((bytes[1] & 0xff) << 24);
+	extratablesize = (static_cast<unsigned long long>(tablesize) * sectorsize) - 512;
+	char* ttable = (char*)calloc(extratablesize, 1);
+	if (!ttable)
 	{
-		if (findblock(sectorsize, disksize, tablesize, tablestr, block, blockstrlen, sectorsize, usedblocks))
-		{
-			free(alc1);
+		return 2;
+	}
+	if (!ReadFile(hDisk, ttable, extratablesize, &r, NULL))
+	{
+		free(ttable);
+		return 2;
+	}
+	if (r != extratablesize)
+	{
+		free(ttable);
+		return 2;
+	}
+	table = (char*)calloc(512 + static_cast<size_t>(extratablesize), 1);
+	if (!table)
+	{
+		free(ttable);
+		return 2;
+	}
+	memcpy(table, bytes, 512);
+	memcpy(table + 512, ttable, extratablesize);
+	free(ttable);
+	return 0;
+}
+
+void nativetimes(char* table)
+{ // The next packtable writes every time out again as FILETIME.
+	table[0] |= 64;
+	filetimes = true;
+	markdirty(2, 0, ULLONG_MAX);
+}
+
+void extendedrecords(char* table)
+{ // The next packtable writes the whole table out again in format v3.
+	table[0] |= 32;
+	extrecords = true;
+	attrsize = 19;
+	dirtyall = true;
+}
+
+void resizeinodes(unsigned long long filenamecount)
+{
+	for (unsigned i = 0; i < 3; i++)
+	{
+		inodes.times[i].resize(filenamecount);
+	}
+	inodes.gid.resize(filenamecount);
+	inodes.uid.resize(filenamecount);
+	inodes.mode.resize(filenamecount);
+	inodes.winattrs.resize(filenamecount);
+	inodes.security.resize(filenamecount);
+	inodes.reparse.resize(filenamecount);
+	inodes.descriptor.resize(filenamecount);
+}
+
+void moveinode(unsigned long long from, unsigned long long to)
+{
+	for (unsigned i = 0; i < 3; i++)
+	{
+		inodes.times[i][to] = inodes.times[i][from];
+	}
+	inodes.gid[to] = inodes.gid[from];
+	inodes.uid[to] = inodes.uid[from];
+	inodes.mode[to] = inodes.mode[from];
+	inodes.winattrs[to] = inodes.winattrs[from];
+	inodes.security[to] = inodes.security[from];
+	inodes.reparse[to] = inodes.reparse[from];
+	inodes.descriptor[to] = inodes.descriptor[from];
+}
+
+void encodeinode(unsigned long long filenameindex, char* times, char* attrs)
+{ // Table layout, big endian times then 3 bytes of gid, 2 of uid, 2 of mode, 4 of winattrs and with extended records 4 of descriptor id and 4 of reparse tag. Either may be NULL.
+	for (unsigned i = 0; i < 3 && times; i++)
+	{
+		unsigned long long time = inodes.times[i][filenameindex];
+		if (!filetimes)
+		{ // Seconds since 1970 as a double
+			double dtime = (double)(static_cast<LONGLONG>(time) - 116444736000000000) / 10000000;
+			memcpy(&time, &dtime, 8);
+		}
+		for (unsigned o = 0; o < 8; o++)
+		{
+			times[i * 8 + o] = (time >> (56 - o * 8)) & 0xff;
+		}
+	}
+	if (!attrs)
+	{
+		return;
+	}
+	unsigned long gid = inodes.gid[filenameindex];
+	unsigned long uid = inodes.uid[filenameindex];
+	unsigned long mode = inodes.mode[filenameindex];
+	unsigned long winattrs = inodes.winattrs[filenameindex];
+	attrs[0] = (gid >> 16) & 0xff;
+	attrs[1] = (gid >> 8) & 0xff;
+	attrs[2] = gid & 0xff;
+	attrs[3] = (uid >> 8) & 0xff;
+	attrs[4] = uid & 0xff;
+	attrs[5] = (mode >> 8) & 0xff;
+	attrs[6] = mode & 0xff;
+	attrs[7] = (winattrs >> 24) & 0xff;
+	attrs[8] = (winattrs >> 16) & 0xff;
+	attrs[9] = (winattrs >> 8) & 0xff;
+	attrs[10] = winattrs & 0xff;
+	if (extrecords)
+	{
+		unsigned long descriptor = inodes.descriptor[filenameindex];
+		unsigned long tag = inodes.reparse[filenameindex];
+		for (unsigned i = 0; i < 4; i++)
+		{
+			attrs[11 + i] = (descriptor >> (24 - i * 8)) & 0xff;
+			attrs[15 + i] = (tag >> (24 - i * 8)) & 0xff;
+		}
+	}
+}
+
+void decodeinode(unsigned long long filenameindex, char* times, char* attrs)
+{
+	for (unsigned i = 0; i < 3; i++)
+	{
+		unsigned long long time = 0;
+		for (unsigned o = 0; o < 8; o++)
+		{
+			time = time << 8 | (times[i * 8 + o] & 0xff);
+		}
+		if (!filetimes)
+		{ // Same rounding fixups as before, so times read back as they were set.
+			double dtime = 0;
+			memcpy(&dtime, &time, 8);
+			time = dtime * 10000000 + 116444736000000000;
+			time += (static_cast<unsigned long long>(2) * (time > 116444736000000000)) + (time == 279172874304) + (static_cast<unsigned long long>(3) * (time == 287762808896));
+		}
+		inodes.times[i][filenameindex] = time;
+	}
+	inodes.gid[filenameindex] = (attrs[0] & 0xff) << 16 | (attrs[1] & 0xff) << 8 | attrs[2] & 0xff;
+	inodes.uid[filenameindex] = (attrs[3] & 0xff) << 8 | attrs[4] & 0xff;
+	inodes.mode[filenameindex] = (attrs[5] & 0xff) << 8 | attrs[6] & 0xff;
+	inodes.winattrs[filenameindex] = (unsigned long)(attrs[7] & 0xff) << 24 | (attrs[8] & 0xff) << 16 | (attrs[9] & 0xff) << 8 | attrs[10] & 0xff;
+	inodes.descriptor[filenameindex] = 0;
+	inodes.reparse[filenameindex] = 0;
+	for (unsigned i = 0; i < 4 && extrecords; i++)
+	{
+		inodes.descriptor[filenameindex] = inodes.descriptor[filenameindex] << 8 | (attrs[11 + i] & 0xff);
+		inodes.reparse[filenameindex] = inodes.reparse[filenameindex] << 8 | (attrs[15 + i] & 0xff);
+	}
+}
+
+int loadtable(char* table, char*& tablestr, char*& filenames, unsigned long long& filenamecount)
+{
+	unsigned long long pos = 0;
+	tablestrindexlist.clear();
+	binindexlist.clear();
+	extentlist.clear();
+	inlinelist.clear();
+	reparselist.clear();
+	ealist.clear();
+	dirtyall = true;
+	reindex = true;
+	extrecords = table[0] & 32;
+	attrsize = extrecords ? 19 : 11;
+	if (table[0] & 128)
+	{ // Table format v2
+		unsigned long long binlen = 0;
+		if (decodeextents(table + 5, binlen, tablestr))
+		{
 			return 1;
 		}
-		char* alc2 = (char*)realloc(tablestr, tablestrlen + blockstrlen + o + 1);
-		if (!alc2)
+		pos = 5 + binlen;
+	}
+	else
+	{
+		while (((unsigned)table[pos] & 0xff) != 255)
+		{
+			pos++;
+		}
+		tablestr = (char*)calloc(pos - 5 + 1, 1);
+		if (!tablestr)
 		{
-			free(alc1);
 			return 1;
 		}
-		if (o)
+		memcpy(tablestr, table + 5, pos - 5);
+		decode(tablestr, pos - 5);
+	}
+
+	unsigned long long filenamepos = pos;
+	while (((unsigned)table[filenamepos] & 0xff) != 254)
+	{
+		filenamepos++;
+	}
+	if (filenamepos <= pos)
+	{
+		return 1;
+	}
+	unsigned long long filenameslen = filenamepos - pos - 1;
+	filenames = (char*)calloc(filenameslen + 2, 1);
+	if (!filenames)
+	{
+		return 1;
+	}
+	memcpy(filenames, table + pos + 1, filenameslen);
+	filenamecount = 0;
+	for (unsigned long long i = 0; i < filenameslen; i++)
+	{
+		if (((unsigned)filenames[i] & 0xff) == 255)
+		{
+			filenamecount++;
+		}
+	}
+	filenames[filenameslen] = 254;
+
+	filetimes = table[0] & 64;
+	inodes.security.clear();
+	inodes.reparse.clear();
+	resizeinodes(filenamecount);
+	for (unsigned long long i = 0; i < filenamecount; i++)
+	{
+		decodeinode(i, table + filenamepos + 1 + i * 24, table + filenamepos + 1 + filenamecount * 24 + i * attrsize);
+	}
+	return 0;
+}
+
+void resetcloc(unsigned long long& cloc, std::string& cblock, std::string& str0, std::string& str1, std::string& str2, unsigned step)
+{
+	switch (step)
+	{
+	case 0:
+		str0 = cblock;
+		break;
+	case 1:
+		str1 = cblock;
+		break;
+	case 2:
+		str2 = cblock;
+		break;
+	}
+	cloc = 0;
+	cblock.resize(cloc);
+}
+
+unsigned long long getpindex(unsigned long long index, char* tablestr)
+{
+	unsigned long long pindex = 0;
+	if (!index)
+	{
+		return pindex;
+	}
+	while ((tablestr[index - pindex - 1] & 0xff) != 46)
+	{
+		pindex++;
+		if (!(index - pindex))
+		{
+			break;
+		}
+	}
+	return pindex;
+}
+
+unsigned long lowestbit(unsigned long long word)
+{ // word must not be 0
+	unsigned long bit = 0;
+	if (!_BitScanForward(&bit, (unsigned long)word))
+	{
+		_BitScanForward(&bit, (unsigned long)(word >> 32));
+		bit += 32;
+	}
+	return bit;
+}
+
+void setsector(unsigned long long sector)
+{
+	sectormap[sector / 64] |= 1ULL << sector % 64;
+	if (!~sectormap[sector / 64])
+	{
+		sectormapfull[sector / 4096] |= 1ULL << sector / 64 % 64;
+	}
+}
+
+unsigned long long findsector(unsigned long long limit)
+{ // First sector without used bytes, limit when there is none below it.
+	for (; sectorhint < sectormapfull.size() && sectorhint * 4096 < limit; sectorhint++)
+	{
+		if (~sectormapfull[sectorhint])
+		{
+			unsigned long long word = sectorhint * 64 + lowestbit(~sectormapfull[sectorhint]);
+			return min(word * 64 + lowestbit(~sectormap[word]), limit);
+		}
+	}
+	return limit;
+}
+
+void setsectors(unsigned long long start, unsigned long long end)
+{ // Whole words at a time where the range covers them.
+	while (start < end)
+	{
+		unsigned long long n = min(end - start, 64 - start % 64);
+		sectormap[start / 64] |= (n == 64 ? ~0ULL : ((1ULL << n) - 1) << start % 64);
+		if (!~sectormap[start / 64])
+		{
+			sectormapfull[start / 4096] |= 1ULL << start / 64 % 64;
+		}
+		start += n;
+	}
+}
+
+unsigned long long findsectorend(unsigned long long start, unsigned long long end)
+{ // First used sector at or after start, end when there is none before it.
+	unsigned long long i = start / 64;
+	unsigned long long word = sectormap[i] & (~0ULL << start % 64);
+	while (!word)
+	{
+		i++;
+		if (i * 64 >= end)
+		{
+			return end;
+		}
+		word = sectormap[i];
+	}
+	return min(i * 64 + lowestbit(word), end);
+}
+
+unsigned long nextbit(std::vector<unsigned long long>& words, unsigned long o, unsigned long end, bool set)
+{ // First bit at or after o that is set (or clear), end when there is none.
+	unsigned long long i = o / 64;
+	if (i >= words.size())
+	{
+		return end;
+	}
+	unsigned long long word = (set ? words[i] : ~words[i]) & (~0ULL << o % 64);
+	while (!word)
+	{
+		i++;
+		if (i >= words.size())
+		{
+			return end;
+		}
+		word = set ? words[i] : ~words[i];
+	}
+	return min(i * 64 + lowestbit(word), end);
+}
+
+int findrun(std::vector<unsigned long long>& words, unsigned long sectorsize, unsigned long blocksize, unsigned long& offset)
+{ // Best fit of blocksize free bytes in a partly used sector.
+	unsigned long best = ULONG_MAX;
+	unsigned long o = nextbit(words, 0, sectorsize, false);
+	while (o < sectorsize)
+	{
+		unsigned long used = nextbit(words, o, sectorsize, true);
+		if (used - o >= blocksize && used - o < best)
+		{
+			best = used - o;
+			offset = o;
+		}
+		o = nextbit(words, used, sectorsize, false);
+	}
+	return best == ULONG_MAX;
+}
+
+unsigned long longestrun(std::vector<unsigned long long>& words, unsigned long sectorsize)
+{
+	unsigned long longest = 0;
+	unsigned long o = nextbit(words, 0, sectorsize, false);
+	while (o < sectorsize)
+	{
+		unsigned long used = nextbit(words, o, sectorsize, true);
+		longest = max(longest, used - o);
+		o = nextbit(words, used, sectorsize, false);
+	}
+	return longest;
+}
+
+void classifypart(unsigned long long sector, Part& part, unsigned long long cls)
+{ // Moves a sector between partclass lists, ULLONG_MAX takes it out.
+	if (part.cls == cls)
+	{
+		return;
+	}
+	if (part.cls != ULLONG_MAX)
+	{
+		std::vector<unsigned long long>& from = partclass[part.cls];
+		from[part.slot] = from.back();
+		partmap[from.back()].slot = part.slot;
+		from.pop_back();
+	}
+	part.cls = cls;
+	if (cls != ULLONG_MAX)
+	{
+		part.slot = partclass[cls].size();
+		partclass[cls].push_back(sector);
+	}
+}
+
+void markused(unsigned long sectorsize, unsigned long long sector, unsigned long start, unsigned long end, unsigned long long& usedblocks)
+{ // Whole sectors only go in sectormap, parts keep a bit per byte until the sector fills up.
+	if (sector >= sectormap.size() * 64)
+	{
+		return;
+	}
+	if (!start && end == sectorsize && !partmap.count(sector))
+	{
+		setsector(sector);
+		usedblocks++;
+		return;
+	}
+	Part& part = partmap[sector];
+	if (part.used.empty())
+	{
+		part.used.resize(sectorsize / 64);
+	}
+	for (unsigned long i = start; i < end;)
+	{
+		unsigned long n = min(end - i, 64 - i % 64);
+		part.used[i / 64] |= (n == 64 ? ~0ULL : ((1ULL << n) - 1) << i % 64);
+		i += n;
+	}
+	setsector(sector);
+	unsigned long longest = longestrun(part.used, sectorsize);
+	if (longest)
+	{
+		classifypart(sector, part, longest / 64);
+		return;
+	}
+	classifypart(sector, part, ULLONG_MAX);
+	partmap.erase(sector);
+	usedblocks++;
+}
+
+void clearsector(unsigned long long sector)
+{
+	sectormap[sector / 64] &= ~(1ULL << sector % 64);
+	sectormapfull[sector / 4096] &= ~(1ULL << sector / 64 % 64);
+	sectorhint = min(sectorhint, sector / 4096);
+}
+
+void markfree(unsigned long sectorsize, unsigned long long sector, unsigned long start, unsigned long end, unsigned long long& usedblocks)
+{ // Inverse of markused, a full sector that loses some bytes becomes a part again.
+	if (sector >= sectormap.size() * 64 || start >= end)
+	{
+		return;
+	}
+	if (!partmap.count(sector))
+	{
+		if (!(sectormap[sector / 64] & 1ULL << sector % 64))
+		{
+			return;
+		}
+		usedblocks--;
+		if (!start && end == sectorsize)
+		{
+			clearsector(sector);
+			return;
+		}
+		partmap[sector].used.assign(sectorsize / 64, ~0ULL);
+	}
+	Part& part = partmap[sector];
+	for (unsigned long i = start; i < end;)
+	{
+		unsigned long n = min(end - i, 64 - i % 64);
+		part.used[i / 64] &= ~(n == 64 ? ~0ULL : ((1ULL << n) - 1) << i % 64);
+		i += n;
+	}
+	unsigned long longest = longestrun(part.used, sectorsize);
+	if (longest < sectorsize)
+	{
+		classifypart(sector, part, longest / 64);
+		return;
+	}
+	classifypart(sector, part, ULLONG_MAX);
+	partmap.erase(sector);
+	clearsector(sector);
+}
+
+void freeitem(unsigned long sectorsize, char* item, unsigned long long& usedblocks)
+{ // One "sector", "first-last" or "sector;start;end" item. A file kept in the table has none.
+	if ((*item & 0xff) == 59)
+	{
+		return;
+	}
+	char* end = NULL;
+	unsigned long long sector = std::strtoull(item, &end, 10);
+	if ((*end & 0xff) == 59)
+	{
+		unsigned long start = std::strtoul(end + 1, &end, 10);
+		markfree(sectorsize, sector, start, std::strtoul(end + 1, 0, 10), usedblocks);
+		return;
+	}
+	unsigned long long last = (*end & 0xff) == 45 ? std::strtoull(end + 1, 0, 10) : sector;
+	for (; sector <= last; sector++)
+	{
+		markfree(sectorsize, sector, 0, sectorsize, usedblocks);
+	}
+}
+
+void addtopartlist(unsigned long sectorsize, unsigned range, unsigned step, std::string str0, std::string str1, std::string str2, std::string rstr, unsigned long long& usedblocks)
+{
+	if (str0 == "")
+	{
+		return;
+	}
+	if (!range)
+	{
+		if (!step)
+		{
+			markused(sectorsize, std::strtoull(str0.c_str(), 0, 10), 0, sectorsize, usedblocks);
+		}
+	}
+	else
+	{
+		unsigned long long start = std::strtoull(rstr.c_str(), 0, 10);
+		unsigned long long end = min(std::strtoull(str0.c_str(), 0, 10) + 1, sectormap.size() * 64);
+		if (start < end)
+		{
+			setsectors(start, end);
+			usedblocks += end - start;
+		}
+	}
+	if (step)
+	{
+		markused(sectorsize, std::strtoull(str0.c_str(), 0, 10), std::strtoul(str1.c_str(), 0, 10), std::strtoul(str2.c_str(), 0, 10), usedblocks);
+	}
+}
+
+void detectblocks(unsigned long sectorsize, unsigned long long disksize, char* tablestr, unsigned long long& usedblocks)
+{ // Rebuild the bitmaps from the table.
+	usedblocks = 0;
+	unsigned long long tablelen = 0;
+	unsigned long long tablestrlen = strlen(tablestr);
+	for (unsigned long long i = 0; i < tablestrlen; i++)
+	{
+		if ((tablestr[i] & 0xff) == 46)
+		{
+			tablelen = i + 1;
+		}
+	}
+	std::string cblock;
+	cblock.reserve(21);
+	unsigned long long cloc = 0;
+	std::string str0;
+	std::string str1;
+	std::string str2;
+	std::string rstr;
+	unsigned step = 0;
+	unsigned range = 0;
+	unsigned long long sectors = disksize / sectorsize;
+	sectormap.assign((sectors + 63) / 64, 0);
+	sectormapfull.assign((sectormap.size() + 63) / 64, 0);
+	partmap.clear();
+	partclass.assign(sectorsize / 64, std::vector<unsigned long long>());
+	sectorhint = 0;
+	for (unsigned long long i = sectors; i < sectormap.size() * 64; i++)
+	{ // Past the end of the disk counts as used.
+		setsector(i);
+	}
+	for (unsigned long long i = sectormap.size(); i < sectormapfull.size() * 64; i++)
+	{
+		sectormapfull[i / 64] |= 1ULL << i % 64;
+	}
+	for (unsigned long long i = 0; i < tablelen; i++)
+	{
+		if ((tablestr[i] & 0xff) == 59 && (!i || (tablestr[i - 1] & 0xff) == 46))
+		{
+			while ((tablestr[i] & 0xff) != 46)
+			{
+				i++;
+			}
+			continue;
+		}
+		switch (tablestr[i] & 0xff)
+		{
+		case 59: //;
+			resetcloc(cloc, cblock, str0, str1, str2, step);
+			step++;
+			break;
+		case 46: //.
+			resetcloc(cloc, cblock, str0, str1, str2, step);
+			addtopartlist(sectorsize, range, step, str0, str1, str2, rstr, usedblocks);
+			step = 0;
+			range = 0;
+			break;
+		case 45: //-
+			resetcloc(cloc, cblock, str0, str1, str2, step);
+			step = 0;
+			range++;
+			rstr = str0;
+			break;
+		case 44: //,
+			resetcloc(cloc, cblock, str0, str1, str2, step);
+			addtopartlist(sectorsize, range, step, str0, str1, str2, rstr, usedblocks);
+			step = 0;
+			range = 0;
+			break;
+		default: //0-9
+			cblock.resize(cloc + 1);
+			cblock[cloc] = tablestr[i];
+			cblock[cloc + 1] = 0;
+			cloc++;
+			break;
+		}
+	}
+	redetect = false;
+}
+
+int findblock(unsigned long sectorsize, unsigned long long disksize, unsigned long tablesize, char* tablestr, char*& block, unsigned long long& blockstrlen, unsigned long blocksize, unsigned long long& usedblocks)
+{
+	if (redetect)
+	{
+		detectblocks(sectorsize, disksize, tablestr, usedblocks);
+	}
+	unsigned long long limit = disksize / sectorsize - tablesize;
+	unsigned long long sector = limit;
+	unsigned long offset = 0;
+	if (blocksize < sectorsize)
+	{ // The class below can still have a fit, every class from the rounded up one has.
+		for (unsigned long long c = blocksize / 64; c < partclass.size() && sector == limit; c++)
+		{
+			if (partclass[c].size() && partclass[c].back() < limit && !findrun(partmap[partclass[c].back()].used, sectorsize, blocksize, offset))
+			{
+				sector = partclass[c].back();
+			}
+		}
+	}
+	if (sector == limit)
+	{
+		offset = 0;
+		sector = findsector(limit);
+	}
+	if (sector >= limit)
+	{
+		return 1;
+	}
+	std::string s;
+	if (blocksize % sectorsize)
+	{
+		s = std::to_string(sector) + ";" + std::to_string(offset) + ";" + std::to_string(offset + blocksize);
+		markused(sectorsize, sector, offset, offset + blocksize, usedblocks);
+	}
+	else
+	{
+		s = std::to_string(sector);
+		markused(sectorsize, sector, 0, sectorsize, usedblocks);
+	}
+	blockstrlen = strlen(s.c_str());
+	char* alc = (char*)realloc(block, blockstrlen + 1);
+	if (!alc)
+	{
+		return 1;
+	}
+	block = alc;
+	alc = NULL;
+	memcpy(block, s.c_str(), blockstrlen);
+	return 0;
+}
+
+int findblocks(unsigned long sectorsize, unsigned long long disksize, unsigned long tablesize, char* tablestr, unsigned long long count, unsigned long long& start, unsigned long long& end, unsigned long long& usedblocks)
+{ // First free run of up to count whole sectors.
+	if (redetect)
+	{
+		detectblocks(sectorsize, disksize, tablestr, usedblocks);
+	}
+	unsigned long long limit = disksize / sectorsize - tablesize;
+	start = findsector(limit);
+	if (start >= limit)
+	{
+		return 1;
+	}
+	end = findsectorend(start, min(limit, start + count));
+	setsectors(start, end);
+	usedblocks += end - start;
+	return 0;
+}
+
+int alloc(unsigned long sectorsize, unsigned long long disksize, unsigned long tablesize, char* charmap, char*& tablestr, unsigned long long& index, unsigned long long size, unsigned long long& usedblocks)
+{ // Whole sectors go in as ranges a run at a time, the entry stays simplified.
+	unsigned long long tablestrlen = strlen(tablestr);
+	unsigned long long itemstart = index;
+	while (itemstart && (tablestr[itemstart - 1] & 0xff) != 46 && (tablestr[itemstart - 1] & 0xff) != 44)
+	{
+		itemstart--;
+	}
+	std::string item(tablestr + itemstart, index - itemstart);
+	std::string str = item;
+	unsigned long long laststart = 0;
+	unsigned long long first = 0;
+	unsigned long long last = 0;
+	bool merge = item != "" && item.find(';') == std::string::npos;
+	if (merge)
+	{
+		first = std::strtoull(item.c_str(), 0, 10);
+		last = item.find('-') == std::string::npos ? first : std::strtoull(item.c_str() + item.find('-') + 1, 0, 10);
+	}
+	unsigned long long count = size / sectorsize;
+	int err = 0;
+	while (count)
+	{
+		unsigned long long start = 0;
+		unsigned long long end = 0;
+		if (findblocks(sectorsize, disksize, tablesize, tablestr, count, start, end, usedblocks))
 		{
-			alc2[index] = 44;
+			err = 1;
+			break;
 		}
-		for (unsigned long long i = 0; i < blockstrlen; i++)
-		{
-			alc2[index + o + i] = block[i];
+		count -= end - start;
+		if (merge && last + 1 == start)
+		{ // Carries on the last range.
+			str.resize(laststart);
+			start = first;
 		}
-		for (unsigned long long i = 0; i < alc1len; i++)
+		else if (str != "")
 		{
-			alc2[index + o + blockstrlen + i] = alc1[i];
+			str += ",";
+			laststart = str.size();
 		}
-		tablestr = alc2;
-		alc2 = NULL;
-		index += blockstrlen + o;
-		tablestrlen += blockstrlen + o;
-		tablestr[index + alc1len] = 0;
-		o = 1;
+		str += end - start == 1 ? std::to_string(start) : std::to_string(start) + "-" + std::to_string(end - 1);
+		first = start;
+		last = end - 1;
+		merge = true;
 	}
-	if (size % sectorsize)
+	if (!err && size % sectorsize)
 	{
-		if (findblock(sectorsize, disksize, tablesize, tablestr, block, blockstrlen, size % sectorsize, usedblocks))
-		{
-			free(alc1);
-			return 1;
-		}
-		char* alc2 = (char*)realloc(tablestr, tablestrlen + blockstrlen + o + 1);
-		if (!alc2)
-		{
-			free(alc1);
-			return 1;
-		}
-		if (o)
+		char* block = (char*)calloc(256, 1);
+		unsigned long long blockstrlen = 0;
+		if (!block || findblock(sectorsize, disksize, tablesize, tablestr, block, blockstrlen, size % sectorsize, usedblocks))
 		{
-			alc2[index] = 44;
+			err = 1;
 		}
-		for (unsigned long long i = 0; i < blockstrlen; i++)
+		else
 		{
-			alc2[index + o + i] = block[i];
+			if (str != "")
+			{
+				str += ",";
+			}
+			str += std::string(block, blockstrlen);
 		}
-		for (unsigned long long i = 0; i < alc1len; i++)
+		free(block);
+	}
+	if (str.size() > item.size())
+	{
+		char* alc = (char*)realloc(tablestr, tablestrlen + str.size() - item.size() + 1);
+		if (!alc)
 		{
-			alc2[index + blockstrlen + o + i] = alc1[i];
+			return 1;
 		}
-		tablestr = alc2;
-		alc2 = NULL;
-		index += blockstrlen + o;
-		tablestr[index + alc1len] = 0;
+		tablestr = alc;
+		alc = NULL;
+		memmove(tablestr + itemstart + str.size(), tablestr + index, tablestrlen - index + 1);
+		memcpy(tablestr + itemstart, str.c_str(), str.size());
+		index = itemstart + str.size();
 	}
-	free(block);
-	free(alc1);
-	return 0;
+	return err;
 }
 
-int dealloc(unsigned long sectorsize, char* charmap, char*& tablestr, unsigned long long& index, unsigned long long filesize, unsigned long long size)
-{
+int dealloc(unsigned long sectorsize, char* charmap, char*& tablestr, unsigned long long& index, unsigned long long filesize, unsigned long long size, unsigned long long& usedblocks)
+{ // Freed sectors and bytes go straight back to the bitmaps.
 	unsigned long long tablestrlen = strlen(tablestr);
 	unsigned long long blockstrlen = 0;
 	unsigned long long alc2len = 0;
@@ -521,11 +1213,60 @@ int dealloc(unsigned long sectorsize, char* charmap, char*& tablestr, unsigned l
 		alc1[i] = tablestr[index + i];
 	}
 	unsigned long long alc1len = strlen(alc1) + 1;
+	for (unsigned long long p = 0; p < size / sectorsize; p++)
+	{ // Dealloc entire block out of alc2
+		tablestrlen = strlen(tablestr);
+		unsigned long long pindex = getpindex(index, tablestr);
+		alc = (char*)realloc(alc2, pindex + 1);
+		if (!alc)
+		{
+			free(alc1);
+			free(alc2);
+			return 1;
+		}
+		alc2 = alc;
+		alc = NULL;
+		for (unsigned long long i = 0; i < tablestrlen - index; i++)
+		{
+			alc1[i] = tablestr[index + i];
+		}
+		for (unsigned long long i = 0; i < pindex; i++)
+		{
+			alc2[i] = tablestr[index - pindex + i];
+		}
+		alc2[pindex] = 0;
+		for (unsigned long long i = 0; i < pindex + 1; i++)
+		{
+			if ((alc2[pindex - i] & 0xff) == 44)
+			{
+				alc2[pindex - i] = 0;
+				break;
+			}
+			alc2[pindex - i] = 0;
+		}
+		unsigned long long off = 0;
+		alc2len = strlen(alc2);
+		freeitem(sectorsize, tablestr + index - pindex + alc2len + (alc2len ? 1 : 0), usedblocks);
+		for (; off < alc2len; off++)
+		{
+			if (!(alc2[off] & 0xff))
+			{
+				break;
+			}
+			tablestr[index - pindex + off] = alc2[off];
+		}
+		for (unsigned long long i = 0; i < alc1len; i++)
+		{
+			tablestr[index - pindex + off + i] = alc1[i];
+		}
+		index = index - pindex + off;
+		filesize -= sectorsize;
+	}
 	if (size % sectorsize)
 	{
 		tablestrlen = strlen(tablestr);
 		unsigned long long pindex = getpindex(index, tablestr);
-		alc = (char*)realloc(alc2, pindex + 1);
+		alc = (char*)realloc(alc2, pindex + 25);
 		if (!alc)
 		{
 			free(alc1);
@@ -534,6 +1275,7 @@ int dealloc(unsigned long sectorsize, char* charmap, char*& tablestr, unsigned l
 		}
 		alc2 = alc;
 		alc = NULL;
+		alc2[0] = 0;
 		for (unsigned long long i = 0; i < pindex; i++)
 		{
 			alc2[i] = tablestr[index - pindex + i];
@@ -550,10 +1292,14 @@ int dealloc(unsigned long sectorsize, char* charmap, char*& tablestr, unsigned l
 				}
 				alc2[pindex - i] = 0;
 			}
+			alc2len = strlen(alc2);
+			freeitem(sectorsize, tablestr + index - pindex + alc2len + (alc2len ? 1 : 0), usedblocks);
 		}
 		else if (!(filesize % sectorsize))
 		{ // Realloc full block as part block
 			alc2len = strlen(alc2);
+			char* last = strrchr(alc2, 44);
+			markfree(sectorsize, std::strtoull(last ? last + 1 : alc2, 0, 10), sectorsize - size % sectorsize, sectorsize, usedblocks);
 			char part[4] = ";0;";
 			for (unsigned long long i = 0; i < 3; i++)
 			{
@@ -578,6 +1324,8 @@ int dealloc(unsigned long sectorsize, char* charmap, char*& tablestr, unsigned l
 				}
 			}
 			unsigned long alc2part = std::strtoul(alc2 + alc2len - alc2partlen + 1, 0, 10);
+			char* last = strrchr(alc2, 44);
+			markfree(sectorsize, std::strtoull(last ? last + 1 : alc2, 0, 10), alc2part - size % sectorsize, alc2part, usedblocks);
 			blockstrlen = strlen(std::to_string(alc2part - size % sectorsize).c_str());
 			for (unsigned long long i = 0; i < blockstrlen; i++)
 			{
@@ -587,53 +1335,15 @@ int dealloc(unsigned long sectorsize, char* charmap, char*& tablestr, unsigned l
 		}
 		unsigned long long off = 0;
 		alc2len = strlen(alc2);
-		for (; off < alc2len; off++)
-		{
-			if (!(alc2[off] & 0xff))
-			{
-				break;
-			}
-			tablestr[index - pindex + off] = alc2[off];
-		}
-		for (unsigned long long i = 0; i < alc1len; i++)
-		{
-			tablestr[index - pindex + off + i] = alc1[i];
-		}
-		index = index - pindex + off;
-		filesize -= size % sectorsize;
-	}
-	for (unsigned long long p = 0; p < size / sectorsize; p++)
-	{ // Dealloc entire block out of alc2
-		tablestrlen = strlen(tablestr);
-		unsigned long long pindex = getpindex(index, tablestr);
-		alc = (char*)realloc(alc2, pindex + 1);
+		alc = (char*)realloc(tablestr, index - pindex + alc2len + alc1len + 1);
 		if (!alc)
 		{
 			free(alc1);
 			free(alc2);
 			return 1;
 		}
-		alc2 = alc;
+		tablestr = alc;
 		alc = NULL;
-		for (unsigned long long i = 0; i < tablestrlen - index; i++)
-		{
-			alc1[i] = tablestr[index + i];
-		}
-		for (unsigned long long i = 0; i < pindex; i++)
-		{
-			alc2[i] = tablestr[index - pindex + i];
-		}
-		for (unsigned long long i = 0; i < pindex + 1; i++)
-		{
-			if ((alc2[pindex - i] & 0xff) == 44)
-			{
-				alc2[pindex - i] = 0;
-				break;
-			}
-			alc2[pindex - i] = 0;
-		}
-		unsigned long long off = 0;
-		alc2len = strlen(alc2);
 		for (; off < alc2len; off++)
 		{
 			if (!(alc2[off] & 0xff))
@@ -647,81 +1357,253 @@ int dealloc(unsigned long sectorsize, char* charmap, char*& tablestr, unsigned l
 			tablestr[index - pindex + off + i] = alc1[i];
 		}
 		index = index - pindex + off;
-		filesize -= sectorsize;
+		filesize -= size % sectorsize;
 	}
 	free(alc1);
 	free(alc2);
-	redetect = true;
 	return 0;
 }
 
-void getfilenameindex(PWSTR filename, char* filenames, unsigned long long filenamecount, unsigned long long& filenameindex, unsigned long long& filenamestrindex)
+void foldfilename(std::string& name)
+{ // Same folding as the _wcsicmp the scan compared names with.
+	for (unsigned long long i = 0; i < name.size(); i++)
+	{
+		name[i] = towlower(name[i] & 0xff) & 0xff;
+	}
+}
+
+void addindexentry(std::unordered_map<std::string, std::map<std::string, std::string>>& index, std::string parent, std::string child, bool add)
 {
-	if ((*filenameindexlist_)[std::wstring(filename)] != 0)
+	std::string key = child;
+	foldfilename(parent);
+	foldfilename(key);
+	if (add)
 	{
-		filenameindex = (*filenameindexlist_)[std::wstring(filename)];
-		filenamestrindex = filenamestrindexlist[std::wstring(filename)];
+		index[parent].emplace(key, child);
 		return;
 	}
-	unsigned long long filenamesize = wcslen(filename);
-	unsigned long long tempnamesize = max(filenamesize, 0xff);
-	wchar_t* file = (wchar_t*)calloc(tempnamesize + 1, sizeof(wchar_t));
-	if (!file)
+	auto it = index.find(parent);
+	if (it == index.end())
 	{
 		return;
 	}
-	wchar_t* name = (wchar_t*)calloc(filenamesize + 1, sizeof(wchar_t));
-	if (!name)
+	it->second.erase(key);
+	if (it->second.empty())
+	{
+		index.erase(it);
+	}
+}
+
+void addnameentry(std::string name, bool add)
+{ // Streams under their file, other / rooted names under their directory the way ReadDirectory lists them.
+	unsigned long long stream = name.find(':');
+	if (stream && stream != std::string::npos)
 	{
-		free(file);
+		addindexentry(streamindex, name.substr(0, stream), name.substr(stream + 1), add);
 		return;
 	}
-	for (unsigned long long i = 0; i < filenamesize; i++)
+	unsigned long long loc = name.rfind('/');
+	if (name.size() < 2 || name[0] != '/' || loc == name.size() - 1 || stream != std::string::npos)
 	{
-		name[i] = filename[i] & 0xff;
+		return;
 	}
-	for (; filenameindex < filenamecount;)
+	addindexentry(dirindex, name.substr(0, max(loc, 1)), name.substr(loc + 1), add);
+}
+
+void addfilename(std::string name, unsigned long long filenameindex, unsigned long long filenamestrindex)
+{
+	unsigned long long serial = filenameserial++;
+	filenameserials.push_back(serial);
+	filenameindexlist.push_back(filenameindex);
+	filenamestrindexlist.push_back(filenamestrindex);
+	if (name.size() && name[0] == 1)
+	{ // Tombstone left by deletefile, free for a name of the same length.
+		freeslots[name.size()].insert(serial);
+		tombstones++;
+		return;
+	}
+	addnameentry(name, true);
+	foldfilename(name);
+	if (!filenamehash.emplace(name, serial).second)
+	{ // First one wins like the scan, deletes and renames rebuild while names repeat.
+		filenamedups = true;
+	}
+}
+
+void buildfilenameindex(char* filenames, unsigned long long filenamecount)
+{ // Every name in filenames, kept up to date by createfile, deletefile and renamefile.
+	filenamehash.clear();
+	filenameserials.clear();
+	filenameindexlist.clear();
+	filenamestrindexlist.clear();
+	dirindex.clear();
+	streamindex.clear();
+	freeslots.clear();
+	tombstones = 0;
+	filenamedups = false;
+	unsigned long long filenameindex = 0;
+	unsigned long long start = 0;
+	for (unsigned long long i = 0; filenameindex < filenamecount && filenames[i]; i++)
 	{
-		for (unsigned long long i = 0; i < tempnamesize; i++)
+		if ((filenames[i] & 0xff) == 255 || (filenames[i] & 0xff) == 42)
 		{
-			if ((filenames[filenamestrindex + i] & 0xff) == 255 || (filenames[filenamestrindex + i] & 0xff) == 42)
-			{
-				file[i] = 0;
-				filenamestrindex += static_cast<unsigned long long>(i) + 1;
-				break;
-			}
-			file[i] = filenames[filenamestrindex + i];
-			if (i > tempnamesize - 2)
+			addfilename(std::string(filenames + start, i - start), filenameindex, i);
+			if ((filenames[i] & 0xff) == 255)
 			{
-				tempnamesize += 0xff;
-				wchar_t* alc = (wchar_t*)realloc(file, (tempnamesize + 1) * sizeof(wchar_t));
-				if (!alc)
-				{
-					free(file);
-					free(name);
-					return;
-				}
-				file = alc;
-				alc = NULL;
+				filenameindex++;
 			}
+			start = i + 1;
+		}
+	}
+	reindex = false;
+}
+
+unsigned long long findfilenameentry(unsigned long long filenamestrindex)
+{
+	unsigned long long lo = 0;
+	unsigned long long hi = filenamestrindexlist.size();
+	while (lo < hi)
+	{
+		unsigned long long mid = (lo + hi) / 2;
+		if (filenamestrindexlist[mid] < filenamestrindex)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	if (lo < filenamestrindexlist.size() && filenamestrindexlist[lo] != filenamestrindex)
+	{
+		return filenamestrindexlist.size();
+	}
+	return lo;
+}
+
+unsigned long long findserialentry(unsigned long long serial)
+{ // Serials only grow along filenames.
+	unsigned long long lo = 0;
+	unsigned long long hi = filenameserials.size();
+	while (lo < hi)
+	{
+		unsigned long long mid = (lo + hi) / 2;
+		if (filenameserials[mid] < serial)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
 		}
-		if (wcslen(file) == filenamesize)
+	}
+	return lo;
+}
+
+void getfilenameindex(PWSTR filename, char* filenames, unsigned long long filenamecount, unsigned long long& filenameindex, unsigned long long& filenamestrindex)
+{ // Misses give filenamecount and the last terminator like the scan did.
+	if (reindex)
+	{
+		buildfilenameindex(filenames, filenamecount);
+	}
+	unsigned long long filenamesize = wcslen(filename);
+	std::string name(filenamesize, 0);
+	for (unsigned long long i = 0; i < filenamesize; i++)
+	{
+		name[i] = filename[i] & 0xff;
+	}
+	foldfilename(name);
+	auto it = filenamehash.find(name);
+	if (it == filenamehash.end())
+	{
+		filenameindex = filenamecount;
+		filenamestrindex = filenamestrindexlist.size() ? filenamestrindexlist.back() : ULLONG_MAX;
+		return;
+	}
+	unsigned long long entry = findserialentry(it->second);
+	filenameindex = filenameindexlist[entry];
+	filenamestrindex = filenamestrindexlist[entry];
+}
+
+unsigned matchpattern(const std::string& pattern, const std::string& name)
+{ // Both folded, * and ? plus the DOS < > " ReadDirectory gets passed, table of pattern suffix against name suffix.
+	unsigned long long patternlen = pattern.size();
+	unsigned long long namelen = name.size();
+	unsigned long long lastdot = name.rfind('.');
+	std::vector<char> match((patternlen + 1) * (namelen + 1), 0);
+	match[patternlen * (namelen + 1) + namelen] = 1;
+	for (unsigned long long i = patternlen; i-- > 0;)
+	{
+		for (unsigned long long j = namelen + 1; j-- > 0;)
 		{
-			if (!_wcsicmp(file, name))
+			char* next = &match[(i + 1) * (namelen + 1) + j];
+			char* more = &match[i * (namelen + 1) + j + 1];
+			bool end = j == namelen;
+			switch (pattern[i])
 			{
+			case '*':
+				match[i * (namelen + 1) + j] = next[0] || (!end && more[0]);
+				break;
+			case '<': // Anything short of the final dot
+				match[i * (namelen + 1) + j] = next[0] || (!end && j != lastdot && more[0]);
+				break;
+			case '>': // One character, nothing at a dot or the end
+				match[i * (namelen + 1) + j] = end || name[j] == '.' ? next[0] : next[1];
+				break;
+			case '"': // A dot, nothing at the end
+				match[i * (namelen + 1) + j] = end ? next[0] : name[j] == '.' && next[1];
+				break;
+			case '?':
+				match[i * (namelen + 1) + j] = !end && next[1];
+				break;
+			default:
+				match[i * (namelen + 1) + j] = !end && name[j] == pattern[i] && next[1];
 				break;
 			}
 		}
-		if ((filenames[filenamestrindex - 1] & 0xff) == 255)
+	}
+	return match[0];
+}
+
+std::map<std::string, std::string>& getindexentry(std::unordered_map<std::string, std::map<std::string, std::string>>& index, PWSTR name, char* filenames, unsigned long long filenamecount)
+{ // Sorted by folded name, empty when there is nothing under name.
+	if (reindex)
+	{
+		buildfilenameindex(filenames, filenamecount);
+	}
+	unsigned long long namesize = wcslen(name);
+	std::string key(namesize, 0);
+	for (unsigned long long i = 0; i < namesize; i++)
+	{
+		key[i] = name[i] & 0xff;
+	}
+	foldfilename(key);
+	static std::map<std::string, std::string> none;
+	auto it = index.find(key);
+	return it == index.end() ? none : it->second;
+}
+
+std::map<std::string, std::string>& getdirindex(PWSTR dirname, char* filenames, unsigned long long filenamecount)
+{
+	return getindexentry(dirindex, dirname, filenames, filenamecount);
+}
+
+std::map<std::string, std::string>& getstreamindex(PWSTR filename, char* filenames, unsigned long long filenamecount)
+{
+	return getindexentry(streamindex, filename, filenames, filenamecount);
+}
+
+void buildtablestrindex(char* tablestr)
+{ // End of every entry, kept up to date by createfile, deletefile and trunfile.
+	tablestrindexlist.clear();
+	unsigned long long tablestrlen = strlen(tablestr);
+	for (unsigned long long i = 0; i < tablestrlen; i++)
+	{
+		if ((tablestr[i] & 0xff) == 46)
 		{
-			filenameindex++;
+			tablestrindexlist.push_back(i);
 		}
 	}
-	filenamestrindex--;
-	(*filenameindexlist_)[std::wstring(filename)] = filenameindex;
-	filenamestrindexlist[std::wstring(filename)] = filenamestrindex;
-	free(file);
-	free(name);
 }
 
 unsigned long long gettablestrindex(PWSTR filename, char* filenames, char* tablestr, unsigned long long filenamecount)
@@ -729,18 +1611,27 @@ unsigned long long gettablestrindex(PWSTR filename, char* filenames, char* table
 	unsigned long long filenameindex = 0;
 	unsigned long long filenamestrindex = 0;
 	getfilenameindex(filename, filenames, filenamecount, filenameindex, filenamestrindex);
-	unsigned long long index = 0;
-	unsigned long long tablestrlen = strlen(tablestr);
-	for (unsigned long long i = 0; i < tablestrlen; i++)
+	if (tablestrindexlist.size() != filenamecount)
 	{
-		if ((tablestr[i] & 0xff) == 46)
-		{
-			if (index == filenameindex)
-			{
-				return i;
-			}
-			index++;
-		}
+		buildtablestrindex(tablestr);
+	}
+	if (filenameindex >= tablestrindexlist.size())
+	{
+		return 0;
+	}
+	return tablestrindexlist[filenameindex];
+}
+
+void shifttablestrindex(unsigned long long filenameindex, unsigned long long index)
+{
+	if (filenameindex >= tablestrindexlist.size())
+	{
+		return;
+	}
+	unsigned long long oldindex = tablestrindexlist[filenameindex];
+	for (unsigned long long i = filenameindex; i < tablestrindexlist.size(); i++)
+	{
+		tablestrindexlist[i] += index - oldindex;
 	}
 }
 
@@ -774,6 +1665,30 @@ int desimp(char* charmap, char*& tablestr)
 	unsigned range = 0;
 	for (unsigned long long i = 0; i < tablelen; i++)
 	{
+		if ((tablestr[i] & 0xff) == 59 && (!i || (tablestr[i - 1] & 0xff) == 46))
+		{
+			unsigned long long end = i;
+			while ((tablestr[end] & 0xff) != 46)
+			{
+				end++;
+			}
+			if (newloc + end - i + 2 > newtablelen)
+			{
+				newtablelen = newloc + end - i + 0xff;
+				alc = (char*)realloc(newtablestr, newtablelen);
+				if (!alc)
+				{
+					free(newtablestr);
+					return 1;
+				}
+				newtablestr = alc;
+				alc = NULL;
+			}
+			memcpy(newtablestr + newloc, tablestr + i, end + 1 - i);
+			newloc += end + 1 - i;
+			i = end;
+			continue;
+		}
 		switch (tablestr[i] & 0xff)
 		{
 		case 59: //;
@@ -1052,6 +1967,30 @@ int simp(char* charmap, char*& tablestr)
 	unsigned step = 0;
 	for (unsigned long long i = 0; i < tablelen; i++)
 	{
+		if ((tablestr[i] & 0xff) == 59 && (!i || (tablestr[i - 1] & 0xff) == 46))
+		{
+			unsigned long long end = i;
+			while ((tablestr[end] & 0xff) != 46)
+			{
+				end++;
+			}
+			if (newloc + end - i + 2 > newtablelen)
+			{
+				newtablelen = newloc + end - i + 0xff;
+				alc = (char*)realloc(newtablestr, newtablelen);
+				if (!alc)
+				{
+					free(newtablestr);
+					return 1;
+				}
+				newtablestr = alc;
+				alc = NULL;
+			}
+			memcpy(newtablestr + newloc, tablestr + i, end + 1 - i);
+			newloc += end + 1 - i;
+			i = end;
+			continue;
+		}
 		switch (tablestr[i] & 0xff)
 		{
 		case 59: //;
@@ -1060,7 +1999,7 @@ int simp(char* charmap, char*& tablestr)
 			break;
 		case 46: //.
 			resetcloc(cloc, cblock, str0, str1, str2, step);
-			if (std::strtoull(rstr.c_str(), 0, 10) + 1 != std::strtoull(str0.c_str(), 0, 10) || rstr == "")
+			if (std::strtoull(rstr.c_str(), 0, 10) + 1 != std::strtoull(str0.c_str(), 0, 10) || rstr == "" || step)
 			{
 				if (newtablestr[newloc] == 45)
 				{
@@ -1391,74 +2330,660 @@ int simp(char* charmap, char*& tablestr)
 	return 0;
 }
 
-int simptable(HANDLE hDisk, unsigned long sectorsize, char* charmap, unsigned long& tablesize, unsigned long long& extratablesize, unsigned long long filenamecount, char*& fileinfo, char*& filenames, char*& tablestr, char*& table)
-{
-	_LARGE_INTEGER seek = { 0 };
-	SetFilePointerEx(hDisk, seek, NULL, 0);
-	unsigned long long tablelen = 0;
+int simpfile(char* charmap, char*& tablestr, unsigned long long& index, unsigned de)
+{ // desimp or simp only the entry ending at index
+	unsigned long long pindex = getpindex(index, tablestr);
+	if (pindex && (tablestr[index - pindex] & 0xff) == 59)
+	{
+		return 0;
+	}
 	unsigned long long tablestrlen = strlen(tablestr);
-	for (unsigned long long i = 0; i < tablestrlen; i++)
+	char* entry = (char*)calloc(pindex + 2, 1);
+	if (!entry)
 	{
-		if ((tablestr[i] & 0xff) == 46)
+		return 1;
+	}
+	memcpy(entry, tablestr + index - pindex, pindex + 1);
+	if (de ? desimp(charmap, entry) : simp(charmap, entry))
+	{
+		free(entry);
+		return 1;
+	}
+	unsigned long long entrylen = strlen(entry);
+	if (entrylen != pindex + 1)
+	{
+		if (entrylen > pindex + 1)
 		{
-			tablelen = i + 1;
+			char* alc = (char*)realloc(tablestr, tablestrlen + entrylen - pindex);
+			if (!alc)
+			{
+				free(entry);
+				return 1;
+			}
+			tablestr = alc;
+			alc = NULL;
 		}
+		memmove(tablestr + index - pindex + entrylen, tablestr + index + 1, tablestrlen - index);
 	}
-	encode(tablestr, tablelen);
-	tablelen /= 2;
-	unsigned long long filenamesizes = 0;
-	unsigned long long filenamestrlen = strlen(filenames);
-	for (unsigned long long i = 0; i < filenamestrlen; i++)
+	memcpy(tablestr + index - pindex, entry, entrylen);
+	index = index - pindex + entrylen - 1;
+	free(entry);
+	return 0;
+}
+
+void settablebytes(char* table, unsigned long long loc, char* bytes, unsigned long long len)
+{ // Only 512 byte units that change get written.
+	while (len)
 	{
-		if ((filenames[i] & 0xff) == 255)
+		unsigned long long n = min(512 - loc % 512, len);
+		if (memcmp(table + loc, bytes, n))
 		{
-			filenamesizes = i + 1;
+			memcpy(table + loc, bytes, n);
+			tableunits[loc / 512] = true;
 		}
-		if ((filenames[i] & 0xff) == 254)
+		loc += n;
+		bytes += n;
+		len -= n;
+	}
+}
+
+int packtable(unsigned long sectorsize, unsigned long& tablesize, unsigned long long& extratablesize, unsigned long long filenamecount, char*& filenames, char*& tablestr, char*& table)
+{ // Brings the in memory table up to date, simptable writes out what changed.
+	if (tablestrindexlist.size() != filenamecount)
+	{
+		buildtablestrindex(tablestr);
+	}
+	unsigned long long tablelen = tablestrindexlist.size() ? tablestrindexlist.back() + 1 : 0;
+	unsigned long long oldtotal = 7 + regionlen[0] + regionlen[1] + regionlen[2];
+	if (dirtyall)
+	{
+		for (unsigned i = 0; i < 4; i++)
 		{
-			break;
+			dirtystart[i] = 0;
+			dirtyend[i] = ULLONG_MAX;
 		}
+		binindexlist.clear();
 	}
-	tablesize = (tablelen + filenamesizes + (35 * filenamecount) + sectorsize - 1) / sectorsize;
-	settablesize(sectorsize, tablesize, extratablesize, table);
-	for (unsigned long long i = 0; i < tablelen; i++)
+	char* bin = NULL;
+	unsigned long long binstart = 0;
+	unsigned long long binlen = 0;
+	unsigned long long newlen = regionlen[0];
+	if (dirtystart[0] < dirtyend[0] && table[0] & 128)
+	{ // Table format v2, re-encode from the first dirty entry on.
+		unsigned long long lo = 0;
+		unsigned long long hi = filenamecount;
+		while (lo < hi)
+		{
+			unsigned long long mid = (lo + hi) / 2;
+			if (tablestrindexlist[mid] < dirtystart[0])
+			{
+				lo = mid + 1;
+			}
+			else
+			{
+				hi = mid;
+			}
+		}
+		unsigned long long k0 = min(lo, binindexlist.size());
+		unsigned long long k1 = filenamecount;
+		if (dirtyend[0] != ULLONG_MAX)
+		{
+			hi = filenamecount;
+			while (lo < hi)
+			{
+				unsigned long long mid = (lo + hi) / 2;
+				if (tablestrindexlist[mid] + 1 < dirtyend[0])
+				{
+					lo = mid + 1;
+				}
+				else
+				{
+					hi = mid;
+				}
+			}
+			k1 = min(lo + 1, filenamecount);
+		}
+		unsigned long long oldend = k1 && k1 <= binindexlist.size() ? binindexlist[k1 - 1] : ULLONG_MAX;
+		unsigned long long entry = k0 ? tablestrindexlist[k0 - 1] + 1 : 0;
+		bin = (char*)calloc((tablelen - entry) * 2 + 32, 1);
+		if (!bin)
+		{
+			return 1;
+		}
+		binstart = k0 ? binindexlist[k0 - 1] : 0;
+		binindexlist.resize(filenamecount);
+		for (unsigned long long k = k0; k < filenamecount; k++)
+		{
+			encodeentry(tablestr, entry, tablestrindexlist[k], bin, binlen);
+			entry = tablestrindexlist[k] + 1;
+			binindexlist[k] = binstart + binlen;
+			if (k + 1 == k1 && binindexlist[k] == oldend)
+			{ // Same length as before, the rest did not move.
+				break;
+			}
+		}
+		newlen = 8 + (filenamecount ? binindexlist.back() : 0);
+		binstart += 8;
+	}
+	else if (dirtystart[0] < dirtyend[0])
+	{ // Table format v1, two chars per byte.
+		binstart = dirtystart[0] / 2;
+		unsigned long long end = min(dirtyend[0], tablelen);
+		if (end % 2 && end < tablelen)
+		{ // Whole pairs only, encode pads an odd tail.
+			end++;
+		}
+		binlen = max(end, binstart * 2) - binstart * 2;
+		bin = (char*)calloc(binlen + 2, 1);
+		if (!bin)
+		{
+			return 1;
+		}
+		memcpy(bin, tablestr + binstart * 2, binlen);
+		encode(bin, binlen);
+		binlen /= 2;
+		newlen = (tablelen + 1) / 2;
+	}
+	unsigned long long filenamesizes = strchr(filenames, 254) - filenames; // Last name always ends right before 254
+	if (newlen != regionlen[0])
+	{ // Everything after the table moved.
+		dirtystart[1] = 0;
+		dirtyend[1] = ULLONG_MAX;
+	}
+	if (newlen != regionlen[0] || filenamesizes != regionlen[1])
+	{
+		dirtystart[2] = 0;
+		dirtyend[2] = ULLONG_MAX;
+	}
+	if (newlen != regionlen[0] || filenamesizes != regionlen[1] || filenamecount * (24 + attrsize) != regionlen[2])
+	{ // Attributes start after the times of every file.
+		dirtystart[3] = 0;
+		dirtyend[3] = ULLONG_MAX;
+	}
+	unsigned long long total = 7 + newlen + filenamesizes + filenamecount * (24 + attrsize);
+	unsigned long oldtablesize = tablesize;
+	tablesize = (total + sectorsize - 1) / sectorsize;
+	if (settablesize(sectorsize, tablesize, extratablesize, table))
 	{
-		table[i + 5] = (unsigned)tablestr[i] & 0xff;
+		free(bin);
+		return 1;
 	}
-	table[tablelen + 5] = 255;
-	for (unsigned long long i = 0; i < filenamesizes; i++)
+	if (dirtyall)
 	{
-		table[tablelen + i + 6] = filenames[i];
+		tableunits.assign((total + 511) / 512, true);
 	}
-	table[tablelen + 6 + filenamesizes] = 254;
-	for (unsigned long long i = 0; i < filenamecount; i++)
+	tableunits.resize((total + 511) / 512);
+	if (tablesize != oldtablesize)
+	{
+		tableunits[0] = true;
+	}
+	for (unsigned long long i = (oldtotal + 511) / 512; i < tableunits.size(); i++)
+	{ // Never written before
+		tableunits[i] = true;
+	}
+	if (table[0] & 128)
+	{
+		char len[8] = { 0 };
+		for (unsigned i = 0; i < 7; i++)
+		{
+			len[i] = (((newlen - 8) >> (7 * i)) & 127) | 128;
+		}
+		len[7] = ((newlen - 8) >> 49) & 127;
+		settablebytes(table, 5, len, 8);
+	}
+	settablebytes(table, 5 + binstart, bin, binlen);
+	char sep = (char)255;
+	settablebytes(table, 5 + newlen, &sep, 1);
+	if (dirtystart[1] < dirtyend[1])
+	{
+		unsigned long long end = min(dirtyend[1], filenamesizes);
+		settablebytes(table, 6 + newlen + dirtystart[1], filenames + dirtystart[1], max(end, dirtystart[1]) - dirtystart[1]);
+	}
+	sep = (char)254;
+	settablebytes(table, 6 + newlen + filenamesizes, &sep, 1);
+	for (unsigned i = 2; i < 4; i++)
+	{ // Only the table has the byte layout, the dirty records are encoded here.
+		unsigned long long end = min(dirtyend[i], filenamecount);
+		if (dirtystart[i] >= end)
+		{
+			continue;
+		}
+		unsigned long long size = i == 2 ? 24 : attrsize;
+		char* info = (char*)calloc((end - dirtystart[i]) * size, 1);
+		if (!info)
+		{
+			free(bin);
+			return 1;
+		}
+		for (unsigned long long k = dirtystart[i]; k < end; k++)
+		{
+			encodeinode(k, i == 2 ? info + (k - dirtystart[i]) * size : NULL, i == 3 ? info + (k - dirtystart[i]) * size : NULL);
+		}
+		settablebytes(table, 7 + newlen + filenamesizes + (i == 3 ? filenamecount * 24 : 0) + dirtystart[i] * size, info, (end - dirtystart[i]) * size);
+		free(info);
+	}
+	free(bin);
+	for (unsigned i = 0; i < 4; i++)
+	{
+		dirtystart[i] = 0;
+		dirtyend[i] = 0;
+	}
+	regionlen[0] = newlen;
+	regionlen[1] = filenamesizes;
+	regionlen[2] = filenamecount * (24 + attrsize);
+	dirtyall = false;
+	return 0;
+}
+
+int simptable(HANDLE hDisk, unsigned long sectorsize, char* charmap, unsigned long& tablesize, unsigned long long& extratablesize, unsigned long long filenamecount, char*& filenames, char*& tablestr, char*& table)
+{
+	if (packtable(sectorsize, tablesize, extratablesize, filenamecount, filenames, tablestr, table))
+	{
+		return 1;
+	}
+	for (unsigned long long i = 0; i < tableunits.size(); i++)
+	{
+		if (!tableunits[i])
+		{
+			continue;
+		}
+		unsigned long long run = 0;
+		while (i + run < tableunits.size() && tableunits[i + run])
+		{
+			run++;
+		}
+		_LARGE_INTEGER seek = { 0 };
+		seek.QuadPart = i * 512;
+		SetFilePointerEx(hDisk, seek, NULL, 0);
+		DWORD w;
+		WriteFile(hDisk, table + i * 512, run * 512, &w, NULL);
+		if (w != run * 512)
+		{
+			return 1;
+		}
+		for (unsigned long long o = i; o < i + run; o++)
+		{
+			tableunits[o] = false;
+		}
+		i += run;
+	}
+	return 0;
+}
+
+void journalvarint(unsigned long long val)
+{
+	char buf[10] = { 0 };
+	unsigned long long pos = 0;
+	putvarint(buf, pos, val);
+	journal.append(buf, pos);
+}
+
+void journalbytes(char* bytes, unsigned long long len)
+{
+	journalvarint(len);
+	journal.append(bytes, len);
+}
+
+void journalmark(unsigned long long filenameindex)
+{
+	if (journaling)
+	{
+		journalinfolist[filenameindex] = true;
+	}
+}
+
+void journalinfo(unsigned long long filenamecount)
+{ // Times and attributes go in as they are now, before deletefile can shift the indexes.
+	for (auto& info : journalinfolist)
+	{
+		if (info.first >= filenamecount)
+		{
+			continue;
+		}
+		char record[43] = { 0 };
+		encodeinode(info.first, record, record + 24);
+		journal += 'I';
+		journalvarint(info.first);
+		journal.append(record, 24 + attrsize);
+	}
+	journalinfolist.clear();
+}
+
+unsigned long journalcheck(char* bytes, unsigned long long len)
+{
+	unsigned long check = 2166136261;
+	for (unsigned long long i = 0; i < len; i++)
+	{
+		check ^= bytes[i] & 0xff;
+		check = (check * 16777619) & 0xffffffff;
+	}
+	return check;
+}
+
+int journalcommit(HANDLE hDisk, unsigned long sectorsize, unsigned long long disksize, char* tablestr, char* filenames, unsigned long long filenamecount)
+{ // Everything since the last commit goes out as one block: gen, length, check, records. Returns 1 when the table should be checkpointed.
+	bool changed = journal.length() || journalinfolist.size();
+	if (!journaling)
+	{
+		changed = dirtyall || std::find(tableunits.begin(), tableunits.end(), true) != tableunits.end();
+		for (unsigned i = 0; i < 4; i++)
+		{
+			changed = changed || dirtystart[i] < dirtyend[i];
+		}
+	}
+	if (changed)
+	{ // Access times ride along, a commit of nothing else would be a metadata write per read.
+		flushatimes(filenamecount);
+	}
+	if (!journaling)
+	{
+		return changed;
+	}
+	journalinfo(filenamecount);
+	if (!journal.length())
+	{
+		return 0;
+	}
+	unsigned long long filenameindex = 0;
+	unsigned long long filenamestrindex = 0;
+	getfilenameindex(PWSTR(L"!"), filenames, filenamecount, filenameindex, filenamestrindex);
+	unsigned long long index = gettablestrindex(PWSTR(L"!"), filenames, tablestr, filenamecount);
+	unsigned long long filesize = 0;
+	getextentfilesize(sectorsize, index, tablestr, filenameindex, filesize);
+	unsigned long long headlen = 0;
+	char head[24] = { 0 };
+	putvarint(head, headlen, journalgen);
+	putvarint(head, headlen, journal.length());
+	unsigned long check = journalcheck((char*)journal.c_str(), journal.length());
+	for (unsigned i = 0; i < 4; i++)
+	{
+		head[headlen + i] = (check >> (24 - i * 8)) & 0xff;
+	}
+	headlen += 4;
+	unsigned long long blocklen = (headlen + journal.length() + 511) / 512 * 512;
+	if (journaltail + blocklen > filesize)
+	{
+		return 1;
+	}
+	char* block = (char*)calloc(blocklen, 1);
+	if (!block)
+	{
+		return 1;
+	}
+	memcpy(block, head, headlen);
+	memcpy(block + headlen, journal.c_str(), journal.length());
+	std::vector<Extent>& extents = getextents(sectorsize, index, tablestr, filenameindex);
+	if (readwriteextents(hDisk, sectorsize, extents, journaltail, blocklen, disksize, block, 1))
+	{
+		free(block);
+		return 1;
+	}
+	free(block);
+	FlushFileBuffers(hDisk);
+	journaltail += blocklen;
+	journal.clear();
+	return journaltail > filesize / 2;
+}
+
+int journalcheckpoint(HANDLE hDisk, unsigned long sectorsize, char* charmap, unsigned long& tablesize, unsigned long long& extratablesize, unsigned long long disksize, unsigned long long& filenamecount, char*& filenames, char*& tablestr, char*& table)
+{ // The table takes in everything journaled so far, then the journal starts over one generation on.
+	if (tombstones * 4 > filenamecount && compactfiles(filenamecount, filenames, tablestr))
+	{ // A quarter of the slots free, compacting now keeps the journal indexes right.
+		return 1;
+	}
+	unsigned long long filenameindex = 0;
+	unsigned long long filenamestrindex = 0;
+	getfilenameindex(PWSTR(L"!"), filenames, filenamecount, filenameindex, filenamestrindex);
+	if (simptable(hDisk, sectorsize, charmap, tablesize, extratablesize, filenamecount, filenames, tablestr, table))
+	{
+		return 1;
+	}
+	FlushFileBuffers(hDisk);
+	if (filenameindex < filenamecount)
+	{ // Only once the rest is down, the creation time of the journal holds the generation the table is at.
+		unsigned long long gen = (journalgen + 1) * 10000000 + 116444736000000000;
+		chtime(filenameindex, gen, 5);
+		if (simptable(hDisk, sectorsize, charmap, tablesize, extratablesize, filenamecount, filenames, tablestr, table))
+		{
+			return 1;
+		}
+		FlushFileBuffers(hDisk);
+	}
+	journal.clear();
+	journalinfolist.clear();
+	if (filenameindex >= filenamecount)
+	{
+		journaling = false;
+		return 0;
+	}
+	unsigned long long index = gettablestrindex(PWSTR(L"!"), filenames, tablestr, filenamecount);
+	std::vector<Extent>& extents = getextents(sectorsize, index, tablestr, filenameindex);
+	char* head = (char*)calloc(512, 1);
+	if (!head)
+	{
+		return 1;
+	}
+	unsigned long long pos = 0;
+	putvarint(head, pos, journalgen + 1);
+	if (readwriteextents(hDisk, sectorsize, extents, 0, 512, disksize, head, 1))
+	{
+		free(head);
+		return 1;
+	}
+	free(head);
+	FlushFileBuffers(hDisk);
+	journalgen++;
+	journaltail = 512;
+	journaling = true;
+	return 0;
+}
+
+int setentry(char*& tablestr, unsigned long long filenamecount, unsigned long long filenameindex, char* entry, unsigned long long len)
+{
+	if (tablestrindexlist.size() != filenamecount)
+	{
+		buildtablestrindex(tablestr);
+	}
+	if (filenameindex >= tablestrindexlist.size())
+	{
+		return 1;
+	}
+	unsigned long long start = filenameindex ? tablestrindexlist[filenameindex - 1] + 1 : 0;
+	unsigned long long end = tablestrindexlist[filenameindex];
+	unsigned long long tablestrlen = strlen(tablestr);
+	if (len > end - start)
+	{
+		char* alc = (char*)realloc(tablestr, tablestrlen + len - (end - start) + 1);
+		if (!alc)
+		{
+			return 1;
+		}
+		tablestr = alc;
+		alc = NULL;
+	}
+	memmove(tablestr + start + len, tablestr + end, tablestrlen - end + 1);
+	memcpy(tablestr + start, entry, len);
+	shifttablestrindex(filenameindex, start + len);
+	markdirty(0, start, ULLONG_MAX);
+	extentlist.erase(filenameindex);
+	inlinelist.erase(filenameindex);
+	reparselist.erase(filenameindex);
+	ealist.erase(filenameindex);
+	unsigned long long id = 0;
+	chsecurity(filenameindex, id, 1);
+	return 0;
+}
+
+int replayjournal(HANDLE hDisk, unsigned long sectorsize, char* charmap, unsigned long long disksize, unsigned long long& filenamecount, char*& filenames, char*& tablestr, unsigned long long& replayed)
+{ // Redo the blocks committed after the last checkpoint, only when the table is at the same generation as the journal.
+	journaling = false;
+	journal.clear();
+	journalinfolist.clear();
+	journaltail = 512;
+	replayed = 0;
+	unsigned long long filenameindex = 0;
+	unsigned long long filenamestrindex = 0;
+	getfilenameindex(PWSTR(L"!"), filenames, filenamecount, filenameindex, filenamestrindex);
+	if (filenameindex >= filenamecount)
+	{
+		return 0;
+	}
+	unsigned long long index = gettablestrindex(PWSTR(L"!"), filenames, tablestr, filenamecount);
+	unsigned long long filesize = 0;
+	getextentfilesize(sectorsize, index, tablestr, filenameindex, filesize);
+	if (filesize < 512)
+	{
+		return 0;
+	}
+	char* buf = (char*)calloc(filesize, 1);
+	if (!buf)
+	{
+		return 1;
+	}
+	if (readwriteextents(hDisk, sectorsize, getextents(sectorsize, index, tablestr, filenameindex), 0, filesize, disksize, buf, 0))
+	{
+		free(buf);
+		return 1;
+	}
+	unsigned long long time = 0;
+	chtime(filenameindex, time, 4);
+	unsigned long long tablegen = time > 116444736000000000 ? (time - 116444736000000000) / 10000000 : 0;
+	unsigned long long pos = 0;
+	unsigned long long gen = getvarint(buf, pos, 512);
+	journalgen = max(tablegen, gen);
+	if (tablegen != gen)
+	{
+		free(buf);
+		return 0;
+	}
+	pos = 512;
+	while (pos < filesize)
 	{
-		for (unsigned j = 0; j < 35; j++)
+		unsigned long long o = pos;
+		if (getvarint(buf, o, filesize) != gen)
+		{
+			break;
+		}
+		unsigned long long len = getvarint(buf, o, filesize);
+		if (o + 4 + len > filesize)
+		{
+			break;
+		}
+		unsigned long check = 0;
+		for (unsigned i = 0; i < 4; i++)
+		{
+			check = check << 8 | (buf[o + i] & 0xff);
+		}
+		o += 4;
+		if (check != journalcheck(buf + o, len))
+		{ // Torn block, nothing after it was committed
+			break;
+		}
+		unsigned long long end = o + len;
+		while (o < end)
 		{
-			table[tablelen + filenamesizes + 7 + (i * 35) + j] = fileinfo[(i * 35) + j];
+			char type = buf[o];
+			o++;
+			switch (type)
+			{
+			case 'C':
+			{
+				unsigned long long namelen = getvarint(buf, o, end);
+				PWSTR name = (PWSTR)calloc(namelen + 1, sizeof(wchar_t));
+				if (!name)
+				{
+					free(buf);
+					return 1;
+				}
+				for (unsigned long long i = 0; i < namelen; i++)
+				{
+					name[i] = buf[o + i] & 0xff;
+				}
+				o += namelen;
+				unsigned long gid = getvarint(buf, o, end);
+				unsigned long uid = getvarint(buf, o, end);
+				unsigned long mode = getvarint(buf, o, end);
+				unsigned long winattrs = getvarint(buf, o, end);
+				createfile(name, gid, uid, mode, winattrs, filenamecount, filenames, charmap, tablestr);
+				free(name);
+				break;
+			}
+			case 'D':
+			{
+				unsigned long long dfilenameindex = getvarint(buf, o, end);
+				unsigned long long dfilenamestrindex = getvarint(buf, o, end);
+				if (tablestrindexlist.size() != filenamecount)
+				{
+					buildtablestrindex(tablestr);
+				}
+				unsigned long long dindex = dfilenameindex < tablestrindexlist.size() ? tablestrindexlist[dfilenameindex] : 0;
+				deletefile(dindex, dfilenameindex, dfilenamestrindex, filenamecount, filenames, tablestr);
+				break;
+			}
+			case 'R':
+			{
+				unsigned long long rfilenamestrindex = getvarint(buf, o, end);
+				PWSTR names[2] = { NULL, NULL };
+				for (unsigned n = 0; n < 2; n++)
+				{
+					unsigned long long namelen = getvarint(buf, o, end);
+					names[n] = (PWSTR)calloc(namelen + 1, sizeof(wchar_t));
+					if (!names[n])
+					{
+						free(names[0]);
+						free(buf);
+						return 1;
+					}
+					for (unsigned long long i = 0; i < namelen; i++)
+					{
+						names[n][i] = buf[o + i] & 0xff;
+					}
+					o += namelen;
+				}
+				renamefile(names[0], names[1], rfilenamestrindex, filenames);
+				free(names[0]);
+				free(names[1]);
+				break;
+			}
+			case 'E':
+			{
+				unsigned long long efilenameindex = getvarint(buf, o, end);
+				unsigned long long entrylen = getvarint(buf, o, end);
+				setentry(tablestr, filenamecount, efilenameindex, buf + o, entrylen);
+				o += entrylen;
+				break;
+			}
+			case 'I':
+			{
+				unsigned long long ifilenameindex = getvarint(buf, o, end);
+				if (ifilenameindex < filenamecount)
+				{
+					decodeinode(ifilenameindex, buf + o, buf + o + 24);
+					markdirty(2, ifilenameindex, ifilenameindex + 1);
+					markdirty(3, ifilenameindex, ifilenameindex + 1);
+				}
+				o += 24 + attrsize;
+				break;
+			}
+			default:
+				o = end;
+				break;
+			}
 		}
+		pos += (end - pos + 511) / 512 * 512;
+		replayed++;
 	}
-	decode(tablestr, tablelen);
-	DWORD w;
-	WriteFile(hDisk, table, ((tablelen + filenamesizes + 7 + (filenamecount * 35) + 511) / 512) * 512, &w, NULL);
-	if (w != ((tablelen + filenamesizes + 7 + (filenamecount * 35) + 511) / 512) * 512)
-	{
-		return 1;
-	}
+	free(buf);
 	return 0;
 }
 
-int createfile(PWSTR filename, unsigned long gid, unsigned long uid, unsigned long mode, unsigned long winattrs, unsigned long long& filenamecount, char*& fileinfo, char*& filenames, char* charmap, char*& tablestr)
-{
-	unsigned long long filenamelen = wcslen(filename);
-	unsigned long long filenameslen = strlen(filenames);
-	char* alc = (char*)realloc(fileinfo, (filenamecount + 1) * 35);
-	if (!alc)
-	{
-		return 1;
+int createfile(PWSTR filename, unsigned long gid, unsigned long uid, unsigned long mode, unsigned long winattrs, unsigned long long& filenamecount, char*& filenames, char* charmap, char*& tablestr)
+{ // A tombstone of the same length is reused in place, otherwise the file goes on the end.
+	if (reindex)
+	{ // Which slot a name takes depends only on filenames, so journal replay picks the same one.
+		buildfilenameindex(filenames, filenamecount);
 	}
-	fileinfo = alc;
-	alc = NULL;
+	unsigned long long filenamelen = wcslen(filename);
 	char* file = (char*)calloc(filenamelen + 1, 1);
 	if (!file)
 	{
@@ -1469,104 +2994,123 @@ int createfile(PWSTR filename, unsigned long gid, unsigned long uid, unsigned lo
 		file[i] = filename[i] & 0xff;
 	}
 	unsigned long long filestrlen = strlen(file);
-	unsigned long long oldlen = 0;
-	for (unsigned long long i = 0; i < filenameslen; i++)
-	{
-		if ((filenames[i] & 0xff) == 255)
+	unsigned long long t = currenttime();
+	winattrs |= 2048;
+	unsigned long long filenameindex = filenamecount;
+	std::map<unsigned long long, std::set<unsigned long long>>::iterator slot = freeslots.find(filestrlen);
+	if (slot != freeslots.end())
+	{ // Lowest slot first like replay would, its serial keeps serials in filenames order.
+		unsigned long long serial = *slot->second.begin();
+		slot->second.erase(slot->second.begin());
+		if (slot->second.empty())
 		{
-			oldlen = i + 1;
+			freeslots.erase(slot);
 		}
-		if ((filenames[i] & 0xff) == 254)
+		tombstones--;
+		unsigned long long entry = findserialentry(serial);
+		filenameindex = filenameindexlist[entry];
+		unsigned long long filenamestrindex = filenamestrindexlist[entry];
+		memcpy(filenames + filenamestrindex - filestrlen, file, filestrlen);
+		markdirty(1, filenamestrindex - filestrlen, filenamestrindex);
+		std::string name(file, filestrlen);
+		addnameentry(name, true);
+		foldfilename(name);
+		if (!filenamehash.emplace(name, serial).second)
 		{
-			break;
+			filenamedups = true;
 		}
 	}
-	alc = (char*)realloc(filenames, oldlen + filestrlen + 3);
-	if (!alc)
-	{
-		free(file);
-		return 1;
-	}
-	filenames = alc;
-	alc = NULL;
-	strcpy_s(filenames + oldlen, filestrlen + 1, file);
-	filenames[oldlen + filestrlen] = 255;
-	filenames[oldlen + filestrlen + 1] = 254;
-	filenames[oldlen + filestrlen + 2] = 0;
-	free(file);
-	unsigned long long tablelen = 0;
-	unsigned long long tablestrlen = strlen(tablestr);
-	for (unsigned long long i = 0; i < tablestrlen; i++)
+	else
 	{
-		if ((tablestr[i] & 0xff) == 46)
+		unsigned long long oldlen = filenamestrindexlist.size() ? filenamestrindexlist.back() + 1 : 0;
+		char* alc = (char*)realloc(filenames, oldlen + filestrlen + 3);
+		if (!alc)
 		{
-			tablelen = i + 1;
+			free(file);
+			return 1;
 		}
+		filenames = alc;
+		alc = NULL;
+		memcpy(filenames + oldlen, file, filestrlen);
+		filenames[oldlen + filestrlen] = 255;
+		filenames[oldlen + filestrlen + 1] = 254;
+		filenames[oldlen + filestrlen + 2] = 0;
+		unsigned long long tablelen = 0;
+		if (tablestrindexlist.size() == filenamecount)
+		{
+			tablelen = filenamecount ? tablestrindexlist.back() + 1 : 0;
+		}
+		else
+		{
+			unsigned long long tablestrlen = strlen(tablestr);
+			for (unsigned long long i = 0; i < tablestrlen; i++)
+			{
+				if ((tablestr[i] & 0xff) == 46)
+				{
+					tablelen = i + 1;
+				}
+			}
+		}
+		alc = (char*)realloc(tablestr, tablelen + 2);
+		if (!alc)
+		{
+			free(file);
+			return 1;
+		}
+		tablestr = alc;
+		alc = NULL;
+		tablestr[tablelen] = 46;
+		tablestr[tablelen + 1] = 0;
+		if (tablestrindexlist.size() == filenamecount)
+		{
+			tablestrindexlist.push_back(tablelen);
+		}
+		resizeinodes(filenamecount + 1);
+		markdirty(0, tablelen, ULLONG_MAX);
+		markdirty(1, oldlen, ULLONG_MAX);
+		addfilename(std::string(file, filestrlen), filenamecount, oldlen + filestrlen);
+		filenamecount++;
 	}
-	alc = (char*)realloc(tablestr, tablelen + 2);
-	if (!alc)
-	{
-		return 1;
-	}
-	tablestr = alc;
-	alc = NULL;
-	tablestr[tablelen] = 46;
-	tablestr[tablelen + 1] = 0;
-	char* gum = (char*)calloc((filenamecount + 1) * 11, 1);
-	if (!gum)
-	{
-		return 1;
-	}
-	memcpy(gum, fileinfo + filenamecount * 24, filenamecount * 11);
-	FILETIME ltime;
-	GetSystemTimeAsFileTime(&ltime);
-	LONGLONG pltime = ((PLARGE_INTEGER)&ltime)->QuadPart;
-	double t = (double)(pltime - 116444736000000000) / 10000000;
-	char ti[8] = { 0 };
-	memcpy(ti, &t, 8);
-	char tim[8] = { 0 };
-	for (unsigned i = 0; i < 8; i++)
-	{
-		tim[i] = ti[7 - i];
-	}
-	memcpy(fileinfo + filenamecount * 24, &tim, 8);
-	memcpy(fileinfo + filenamecount * 24 + 8, &tim, 8);
-	memcpy(fileinfo + filenamecount * 24 + 16, &tim, 8);
-	char guidmodes[11] = { 0 };
-	guidmodes[0] = (gid >> 16) & 0xff;
-	guidmodes[1] = (gid >> 8) & 0xff;
-	guidmodes[2] = gid & 0xff;
-	guidmodes[3] = (uid >> 8) & 0xff;
-	guidmodes[4] = uid & 0xff;
-	guidmodes[5] = (mode >> 8) & 0xff;
-	guidmodes[6] = mode & 0xff;
-	winattrs |= 2048;
-	guidmodes[7] = (winattrs >> 24) & 0xff;
-	guidmodes[8] = (winattrs >> 16) & 0xff;
-	guidmodes[9] = (winattrs >> 8) & 0xff;
-	guidmodes[10] = winattrs & 0xff;
-	for (unsigned i = 0; i < 11; i++)
+	for (unsigned i = 0; i < 3; i++)
 	{
-		gum[filenamecount * 11 + i] = guidmodes[i];
+		inodes.times[i][filenameindex] = t;
 	}
-	for (unsigned long long i = 0; i < (filenamecount + 1) * 11; i++)
+	inodes.gid[filenameindex] = gid & 0xffffff;
+	inodes.uid[filenameindex] = uid & 0xffff;
+	inodes.mode[filenameindex] = mode & 0xffff;
+	inodes.winattrs[filenameindex] = winattrs;
+	inodes.security[filenameindex] = 0;
+	inodes.reparse[filenameindex] = 0;
+	inodes.descriptor[filenameindex] = 0;
+	extentlist.erase(filenameindex); // A size asked for before the file existed
+	inlinelist.erase(filenameindex);
+	reparselist.erase(filenameindex);
+	ealist.erase(filenameindex);
+	markdirty(2, filenameindex, filenameindex + 1);
+	markdirty(3, filenameindex, filenameindex + 1);
+	if (journaling)
 	{
-		fileinfo[(filenamecount + 1) * 24 + i] = gum[i];
+		journal += 'C';
+		journalbytes(file, filestrlen);
+		journalvarint(gid);
+		journalvarint(uid);
+		journalvarint(mode);
+		journalvarint(winattrs);
+		journalinfolist[filenameindex] = true;
 	}
-	(*filenameindexlist_)[filename] = filenamecount;
-	filenamestrindexlist[filename] = oldlen + filestrlen;
-	free(gum);
-	filenamecount++;
+	free(file);
 	return 0;
 }
 
-int deletefile(unsigned long long index, unsigned long long filenameindex, unsigned long long filenamestrindex, unsigned long long& filenamecount, char*& fileinfo, char*& filenames, char*& tablestr)
-{
+int deletefile(unsigned long long index, unsigned long long filenameindex, unsigned long long filenamestrindex, unsigned long long& filenamecount, char*& filenames, char*& tablestr)
+{ // Plain names leave a tombstone for createfile to reuse, streams joined by * and leftover sectors still compact.
+	if (reindex)
+	{
+		buildfilenameindex(filenames, filenamecount);
+	}
 	unsigned start = 0;
 	unsigned filenamelen = 0;
 	unsigned long long end = 0;
-	unsigned long long tablestrlen = strlen(tablestr);
-	unsigned long long filenameslen = strlen(filenames);
 	for (unsigned long long i = 0; i < filenamestrindex; i++)
 	{
 		start = filenames[filenamestrindex - i - 1] & 0xff;
@@ -1576,6 +3120,33 @@ int deletefile(unsigned long long index, unsigned long long filenameindex, unsig
 		}
 		filenamelen++;
 	}
+	flushatimes(filenamecount);
+	if (journaling)
+	{
+		journalinfo(filenamecount);
+		journal += 'D';
+		journalvarint(filenameindex);
+		journalvarint(filenamestrindex);
+	}
+	unsigned long long entry = findfilenameentry(filenamestrindex);
+	if (start == 255 && filenamelen && !filenamedups && entry < filenamestrindexlist.size() && filenameindexlist[entry] == filenameindex && (filenames[filenamestrindex] & 0xff) == 255 && !getpindex(index, tablestr))
+	{ // Same length run of 1s, no real name has control chars. Its table entry and inode stay until compactfiles.
+		std::string name(filenames + filenamestrindex - filenamelen, filenamelen);
+		addnameentry(name, false);
+		foldfilename(name);
+		filenamehash.erase(name);
+		memset(filenames + filenamestrindex - filenamelen, 1, filenamelen);
+		markdirty(1, filenamestrindex - filenamelen, filenamestrindex);
+		freeslots[filenamelen].insert(filenameserials[entry]);
+		tombstones++;
+		extentlist.erase(filenameindex);
+		inlinelist.erase(filenameindex);
+		reparselist.erase(filenameindex);
+		ealist.erase(filenameindex);
+		return 0;
+	}
+	unsigned long long tablestrlen = strlen(tablestr);
+	unsigned long long filenameslen = strlen(filenames);
 	if (start != 42)
 	{
 		for (; end < filenameslen; end++)
@@ -1586,23 +3157,54 @@ int deletefile(unsigned long long index, unsigned long long filenameindex, unsig
 			}
 		}
 		unsigned long long pindex = getpindex(index, tablestr);
-		memcpy(tablestr + index - pindex, tablestr + index + 1, tablestrlen - index - 1);
+		if (pindex)
+		{ // Callers truncate to 0 first, sectors still listed here need a rebuild.
+			redetect = true;
+		}
+		markdirty(0, index - pindex, ULLONG_MAX);
+		markdirty(2, filenameindex, ULLONG_MAX);
+		memmove(tablestr + index - pindex, tablestr + index + 1, tablestrlen - index - 1);
 		tablestr[tablestrlen - pindex - 1] = 0;
-		if (filenamecount > filenameindex)
+		if (tablestrindexlist.size() == filenamecount && filenameindex < filenamecount)
 		{
-			memcpy(fileinfo + filenameindex * 24, fileinfo + (filenameindex + 1) * 24, (filenamecount - filenameindex - 1) * 24 + (filenameindex - 1) * 11);
-			memcpy(fileinfo + (filenamecount - 1) * 24 + filenameindex * 11, fileinfo + filenamecount * 24 + (filenameindex + 1) * 11, (filenamecount - filenameindex - 1) * 11);
+			tablestrindexlist.erase(tablestrindexlist.begin() + filenameindex);
+			for (unsigned long long i = filenameindex; i < tablestrindexlist.size(); i++)
+			{
+				tablestrindexlist[i] -= pindex + 1;
+			}
 		}
-		else
+		for (unsigned long long i = filenameindex + 1; i < filenamecount; i++)
 		{
-			memcpy(fileinfo + (filenamecount - 1) * 24, fileinfo + filenamecount * 24, (filenamecount - 1) * 11);
+			moveinode(i, i - 1);
 		}
-		fileinfo[(filenamecount - 1) * 35] = 0;
+		resizeinodes(filenamecount - 1);
 	}
-	memcpy(filenames + filenamestrindex - filenamelen - 1, filenames + filenamestrindex + end, filenameslen - filenamestrindex - end + 1);
+	if (start != 255 || end || filenamedups || entry >= filenamestrindexlist.size())
+	{ // Streams joined by * and repeated names go through a rebuild.
+		reindex = true;
+	}
+	if (!reindex)
+	{
+		std::string name(filenames + filenamestrindex - filenamelen, filenamelen);
+		addnameentry(name, false);
+		foldfilename(name);
+		filenamehash.erase(name);
+		filenameserials.erase(filenameserials.begin() + entry);
+		filenameindexlist.erase(filenameindexlist.begin() + entry);
+		filenamestrindexlist.erase(filenamestrindexlist.begin() + entry);
+		for (unsigned long long i = entry; i < filenamestrindexlist.size(); i++)
+		{
+			filenameindexlist[i]--;
+			filenamestrindexlist[i] -= filenamelen + 1;
+		}
+	}
+	markdirty(1, filenamestrindex - filenamelen - 1, ULLONG_MAX);
+	memmove(filenames + filenamestrindex - filenamelen - 1, filenames + filenamestrindex + end, filenameslen - filenamestrindex - end + 1);
 	filenamecount--;
-	(*filenameindexlist_).clear();
-	filenamestrindexlist.clear();
+	extentlist.clear();
+	inlinelist.clear();
+	reparselist.clear();
+	ealist.clear();
 	return 0;
 }
 
@@ -1643,6 +3245,13 @@ int renamefile(PWSTR oldfilename, PWSTR newfilename, unsigned long long& filenam
 	}
 	unsigned long long coldfilenamelen = strlen(coldfilename);
 	unsigned long long cnewfilenamelen = strlen(cnewfilename);
+	if (journaling)
+	{
+		journal += 'R';
+		journalvarint(filenamestrindex);
+		journalbytes(coldfilename, coldfilenamelen);
+		journalbytes(cnewfilename, cnewfilenamelen);
+	}
 	memcpy(files, filenames + filenamestrindex, oldlen - filenamestrindex);
 	memcpy(filenames + filenamestrindex - coldfilenamelen, cnewfilename, cnewfilenamelen);
 	unsigned long long afterlen = 0;
@@ -1655,15 +3264,109 @@ int renamefile(PWSTR oldfilename, PWSTR newfilename, unsigned long long& filenam
 		}
 	}
 	memcpy(filenames + filenamestrindex - coldfilenamelen + cnewfilenamelen, files, afterlen + 2);
+	markdirty(1, filenamestrindex - coldfilenamelen, coldfilenamelen == cnewfilenamelen ? filenamestrindex : ULLONG_MAX);
+	unsigned long long entry = findfilenameentry(filenamestrindex);
+	std::string oldname(coldfilename, coldfilenamelen);
+	std::string newname(cnewfilename, cnewfilenamelen);
+	foldfilename(oldname);
+	foldfilename(newname);
+	if (filenamedups || entry >= filenamestrindexlist.size() || filenamehash.find(oldname) == filenamehash.end())
+	{
+		reindex = true;
+	}
+	if (!reindex)
+	{ // Same serial under the new name, names after it move by the length difference.
+		addnameentry(std::string(coldfilename, coldfilenamelen), false);
+		addnameentry(std::string(cnewfilename, cnewfilenamelen), true);
+		filenamehash.erase(oldname);
+		if (!filenamehash.emplace(newname, filenameserials[entry]).second)
+		{
+			reindex = true;
+		}
+		for (unsigned long long i = entry; i < filenamestrindexlist.size(); i++)
+		{
+			filenamestrindexlist[i] += cnewfilenamelen - coldfilenamelen;
+		}
+	}
 	filenamestrindex -= coldfilenamelen - cnewfilenamelen;
-	(*filenameindexlist_).clear();
-	filenamestrindexlist.clear();
 	free(coldfilename);
 	free(cnewfilename);
 	free(files);
 	return 0;
 }
 
+int compactfiles(unsigned long long& filenamecount, char*& filenames, char*& tablestr)
+{ // Drops the tombstones deletefile left, indexes after them move down so only call it right before a checkpoint.
+	if (reindex)
+	{
+		buildfilenameindex(filenames, filenamecount);
+	}
+	if (!tombstones)
+	{
+		return 0;
+	}
+	flushatimes(filenamecount);
+	if (tablestrindexlist.size() != filenamecount)
+	{
+		buildtablestrindex(tablestr);
+	}
+	unsigned long long filenameslen = filenamestrindexlist.size() ? filenamestrindexlist.back() + 1 : 0;
+	unsigned long long tablestrlen = strlen(tablestr);
+	unsigned long long newcount = filenamecount - tombstones;
+	char* newfilenames = (char*)calloc(filenameslen + 2, 1);
+	char* newtablestr = (char*)calloc(tablestrlen + 1, 1);
+	if (!newfilenames || !newtablestr)
+	{
+		free(newfilenames);
+		free(newtablestr);
+		return 1;
+	}
+	unsigned long long filenamespos = 0;
+	unsigned long long tablestrpos = 0;
+	unsigned long long tablestart = 0;
+	unsigned long long start = 0;
+	unsigned long long k = 0;
+	for (unsigned long long entry = 0; entry < filenamestrindexlist.size(); entry++)
+	{
+		unsigned long long end = filenamestrindexlist[entry];
+		unsigned long long filenameindex = filenameindexlist[entry];
+		if (end > start && filenames[start] == 1)
+		{ // Whole slot with an empty table entry
+			tablestart = tablestrindexlist[filenameindex] + 1;
+			start = end + 1;
+			continue;
+		}
+		memcpy(newfilenames + filenamespos, filenames + start, end + 1 - start);
+		filenamespos += end + 1 - start;
+		start = end + 1;
+		if ((filenames[end] & 0xff) != 255)
+		{ // Joined by *, the slot closes with the last name
+			continue;
+		}
+		memcpy(newtablestr + tablestrpos, tablestr + tablestart, tablestrindexlist[filenameindex] + 1 - tablestart);
+		tablestrpos += tablestrindexlist[filenameindex] + 1 - tablestart;
+		tablestart = tablestrindexlist[filenameindex] + 1;
+		moveinode(filenameindex, k);
+		k++;
+	}
+	memcpy(newtablestr + tablestrpos, tablestr + tablestart, tablestrlen - tablestart);
+	newfilenames[filenamespos] = 254;
+	free(filenames);
+	free(tablestr);
+	filenames = newfilenames;
+	tablestr = newtablestr;
+	filenamecount = newcount;
+	resizeinodes(newcount);
+	tablestrindexlist.clear();
+	extentlist.clear();
+	inlinelist.clear();
+	reparselist.clear();
+	ealist.clear();
+	dirtyall = true;
+	reindex = true;
+	return 0;
+}
+
 unsigned readwritedrive(HANDLE hDisk, char*& buf, unsigned long long len, unsigned rw, LARGE_INTEGER loc)
 {
 	DWORD wr;
@@ -1682,6 +3385,7 @@ unsigned readwritedrive(HANDLE hDisk, char*& buf, unsigned long long len, unsign
 	if (start || end || !rw)
 	{
 		SetFilePointerEx(hDisk, loc, NULL, 0);
+		drivecalls++;
 		if (!ReadFile(hDisk, tbuf, start + len + end, &wr, NULL))
 		{
 			if (start || end)
@@ -1698,6 +3402,7 @@ unsigned readwritedrive(HANDLE hDisk, char*& buf, unsigned long long len, unsign
 			memcpy(tbuf + start, buf, len);
 		}
 		SetFilePointerEx(hDisk, loc, NULL, 0);
+		drivecalls++;
 		if (!WriteFile(hDisk, tbuf, start + len + end, &wr, NULL))
 		{
 			if (start || end)
@@ -1723,308 +3428,827 @@ unsigned readwritedrive(HANDLE hDisk, char*& buf, unsigned long long len, unsign
 	}
 }
 
-void readwrite(HANDLE hDisk, unsigned long sectorsize, unsigned long long disksize, unsigned long long start, unsigned step, unsigned range, unsigned long long len, std::string str0, std::string str1, std::string str2, std::string rstr, unsigned long long& rblock, unsigned long long& block, char*& buf, unsigned rw)
+unsigned long long getdrivecalls()
+{
+	return drivecalls;
+}
+
+unsigned long long currenttime()
+{ // Already the coarse clock, it only moves once a tick and reads shared memory instead of asking the kernel.
+	FILETIME ltime;
+	GetSystemTimeAsFileTime(&ltime);
+	return ((PLARGE_INTEGER)&ltime)->QuadPart;
+}
+
+void chtime(unsigned long long filenameindex, unsigned long long& time, unsigned ch)
+{ // Access, write then creation time, odd ch sets
+	if (filenameindex >= inodes.times[0].size())
+	{
+		if (!(ch % 2))
+		{
+			time = 0;
+		}
+		return;
+	}
+	if (!(ch % 2))
+	{
+		time = inodes.times[ch / 2][filenameindex];
+	}
+	else
+	{
+		inodes.times[ch / 2][filenameindex] = time;
+		markdirty(2, filenameindex, filenameindex + 1);
+		journalmark(filenameindex);
+	}
+}
+
+void atimepolicy(unsigned mode, unsigned long long interval)
+{
+	atimemode = mode;
+	atimeinterval = interval;
+}
+
+void inlinepolicy(unsigned long long size)
+{
+	inlinesize = size;
+	inlinelist.clear();
+}
+
+void touchatime(unsigned long long filenameindex, unsigned long long time)
+{ // Relatime only moves it once it is older than the write time or the interval, it waits for flushatimes either way.
+	if (atimemode == 2 || filenameindex >= inodes.times[0].size())
+	{
+		return;
+	}
+	unsigned long long atime = inodes.times[0][filenameindex];
+	if (atimemode == 1 && atime > inodes.times[1][filenameindex] && time < atime + atimeinterval)
+	{
+		return;
+	}
+	inodes.times[0][filenameindex] = time;
+	atimelist.insert(filenameindex);
+}
+
+void flushatimes(unsigned long long filenamecount)
+{
+	for (unsigned long long filenameindex : atimelist)
+	{
+		if (filenameindex < filenamecount)
+		{
+			markdirty(2, filenameindex, filenameindex + 1);
+			journalmark(filenameindex);
+		}
+	}
+	atimelist.clear();
+}
+
+void chsecurity(unsigned long long filenameindex, unsigned long long& id, unsigned ch)
+{ // Descriptor id of a security file, only kept in memory. Any write to the file sets it back to 0.
+	if (filenameindex >= inodes.security.size())
+	{
+		if (!ch)
+		{
+			id = 0;
+		}
+		return;
+	}
+	if (!ch)
+	{
+		id = inodes.security[filenameindex];
+	}
+	else
+	{
+		inodes.security[filenameindex] = id;
+	}
+}
+
+void chreparse(unsigned long long filenameindex, unsigned long& tag, unsigned ch)
+{ // The first 4 bytes of the reparse buffer, only kept in memory without extended records.
+	if (extrecords)
+	{
+		chattr(inodes.reparse, 0xffffffff, filenameindex, tag, ch);
+		return;
+	}
+	if (filenameindex >= inodes.reparse.size())
+	{
+		if (!ch)
+		{
+			tag = 0;
+		}
+		return;
+	}
+	if (!ch)
+	{
+		tag = inodes.reparse[filenameindex];
+	}
+	else
+	{
+		inodes.reparse[filenameindex] = tag;
+	}
+}
+
+void chattr(std::vector<unsigned long>& attr, unsigned long mask, unsigned long long filenameindex, unsigned long& val, unsigned ch)
+{ // Only as many bytes as the table keeps
+	if (filenameindex >= attr.size())
+	{
+		if (!ch)
+		{
+			val = 0;
+		}
+		return;
+	}
+	if (!ch)
+	{
+		val = attr[filenameindex];
+	}
+	else
+	{
+		attr[filenameindex] = val & mask;
+		markdirty(3, filenameindex, filenameindex + 1);
+		journalmark(filenameindex);
+	}
+}
+
+void chgid(unsigned long long filenameindex, unsigned long& gid, unsigned ch)
+{ // Three bytes in the table
+	chattr(inodes.gid, 0xffffff, filenameindex, gid, ch);
+}
+
+void chuid(unsigned long long filenameindex, unsigned long& uid, unsigned ch)
+{ // Two bytes
+	chattr(inodes.uid, 0xffff, filenameindex, uid, ch);
+}
+
+void chmode(unsigned long long filenameindex, unsigned long& mode, unsigned ch)
+{ // Two bytes
+	chattr(inodes.mode, 0xffff, filenameindex, mode, ch);
+}
+
+void chwinattrs(unsigned long long filenameindex, unsigned long& winattrs, unsigned ch)
+{ // Four bytes
+	chattr(inodes.winattrs, 0xffffffff, filenameindex, winattrs, ch);
+}
+
+void chdescriptor(unsigned long long filenameindex, unsigned long& id, unsigned ch)
+{ // Four bytes, only in the table with extended records
+	chattr(inodes.descriptor, 0xffffffff, filenameindex, id, ch);
+}
+
+std::vector<Extent>& getextents(unsigned long long sectorsize, unsigned long long index, char* tablestr, unsigned long long filenameindex)
+{ // Parsed once per file, dropped by trunfile and deletefile.
+	if (extentlist.find(filenameindex) != extentlist.end())
+	{
+		return extentlist[filenameindex];
+	}
+	std::vector<Extent>& extents = extentlist[filenameindex];
+	unsigned long long pindex = getpindex(index, tablestr);
+	if (!pindex)
+	{
+		return extents;
+	}
+	if ((tablestr[index - pindex] & 0xff) == 59)
+	{ // Kept in the table, one extent with no sector
+		Extent extent;
+		extent.offset = 0;
+		extent.sector = ULLONG_MAX;
+		extent.count = 1;
+		extent.start = 0;
+		extent.end = (pindex - 1) / 3;
+		extents.push_back(extent);
+		return extents;
+	}
+	unsigned long long offset = 0;
+	unsigned long long num[4] = { 0 };
+	unsigned range = 0;
+	unsigned step = 0;
+	for (unsigned long long i = index - pindex; i <= index; i++)
+	{
+		switch (tablestr[i] & 0xff)
+		{
+		case 45: //-
+			range = 1;
+			break;
+		case 59: //;
+			step++;
+			break;
+		case 44: //,
+		case 46: //.
+		{
+			Extent extent;
+			extent.offset = offset;
+			extent.sector = num[0];
+			extent.count = range ? num[1] - num[0] + 1 : 1;
+			extent.start = step ? num[2] : 0;
+			extent.end = step ? num[3] : sectorsize;
+			offset += extent.count * (extent.end - extent.start);
+			extents.push_back(extent);
+			num[0] = 0;
+			num[1] = 0;
+			num[2] = 0;
+			num[3] = 0;
+			range = 0;
+			step = 0;
+			break;
+		}
+		default: //0-9
+			num[step ? 1 + step : range] = num[step ? 1 + step : range] * 10 + (tablestr[i] & 0xff) - 48;
+			break;
+		}
+	}
+	return extents;
+}
+
+void getextentfilesize(unsigned long long sectorsize, unsigned long long index, char* tablestr, unsigned long long filenameindex, unsigned long long& filesize)
+{
+	std::vector<Extent>& extents = getextents(sectorsize, index, tablestr, filenameindex);
+	filesize = 0;
+	if (extents.size())
+	{
+		filesize = extents.back().offset + extents.back().count * (extents.back().end - extents.back().start);
+	}
+}
+
+int readwriteextents(HANDLE hDisk, unsigned long long sectorsize, std::vector<Extent>& extents, unsigned long long start, unsigned long long len, unsigned long long disksize, char*& buf, unsigned rw)
 {
+	unsigned long long lo = 0;
+	unsigned long long hi = extents.size();
+	while (lo < hi)
+	{ // First extent that ends after start
+		unsigned long long mid = (lo + hi) / 2;
+		if (extents[mid].offset + extents[mid].count * (extents[mid].end - extents[mid].start) <= start)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	unsigned long long rblock = 0;
 	LARGE_INTEGER loc{};
 	char* tbuf = NULL;
-	if (range)
+	for (unsigned long long i = lo; i < extents.size() && rblock < len; i++)
 	{
-		for (unsigned long long p = std::strtoull(rstr.c_str(), 0, 10); p < std::strtoull(str0.c_str(), 0, 10) + 1; p++)
+		if (extents[i].sector == ULLONG_MAX)
+		{ // Bytes in the table go through readwritefile
+			return 1;
+		}
+		unsigned long long size = extents[i].end - extents[i].start;
+		unsigned long long pos = start + rblock - extents[i].offset;
+		while (pos < extents[i].count * size && rblock < len)
 		{
-			if (start / sectorsize <= block && block < (start + len + sectorsize - 1) / sectorsize)
-			{
-				if (start / sectorsize == block)
-				{ // Start block
-					if (step)
-					{
-						loc.QuadPart = disksize - (p * sectorsize + sectorsize) + start % sectorsize + std::strtoul(str1.c_str(), 0, 10);
-						if (len - start % sectorsize < std::strtoull(str2.c_str(), 0, 10) - std::strtoul(str1.c_str(), 0, 10))
-						{
-							if (readwritedrive(hDisk, buf, len, rw, loc)) return;
-							rblock += len;
-						}
-						else
-						{
-							if (readwritedrive(hDisk, buf, min(std::strtoull(str2.c_str(), 0, 10) - std::strtoul(str1.c_str(), 0, 10) - start % sectorsize, len - rblock), rw, loc)) return;
-							rblock += min(std::strtoull(str2.c_str(), 0, 10) - std::strtoul(str1.c_str(), 0, 10) - start % sectorsize, len - rblock);
-						}
-					}
-					else
-					{
-						loc.QuadPart = disksize - (p * sectorsize + sectorsize) + start % sectorsize;
-						if (readwritedrive(hDisk, buf, min(sectorsize - start % sectorsize, len), rw, loc)) return;
-						rblock += min(sectorsize - start % sectorsize, len);
-					}
+			unsigned long long run = 0;
+			if (size == sectorsize && !(pos % size))
+			{ // Whole sectors in a row, also across extents that carry on from each other
+				run = extents[i].count - pos / size;
+				for (unsigned long long o = i + 1; o < extents.size() && extents[o].end - extents[o].start == sectorsize && extents[o].sector == extents[o - 1].sector + extents[o - 1].count; o++)
+				{
+					run += extents[o].count;
+				}
+				run = min(min(run, (len - rblock) / size), maxtransfer / size);
+			}
+			if (run > 1)
+			{ // Sectors are counted back from the end of the disk, so the run is one transfer with its sectors in reverse.
+				unsigned long long sector = extents[i].sector + pos / size;
+				char* rbuf = (char*)malloc(run * size);
+				if (!rbuf)
+				{
+					return 1;
 				}
-				else if (len - rblock <= sectorsize)
-				{ // End block
-					if (step)
+				if (rw)
+				{
+					for (unsigned long long o = 0; o < run; o++)
 					{
-						loc.QuadPart = disksize - (p * sectorsize + sectorsize) + std::strtoul(str1.c_str(), 0, 10);
+						memcpy(rbuf + (run - 1 - o) * size, buf + rblock + o * size, size);
 					}
-					else
+				}
+				loc.QuadPart = disksize - ((sector + run - 1) * sectorsize + sectorsize);
+				if (readwritedrive(hDisk, rbuf, run * size, rw, loc))
+				{
+					free(rbuf);
+					return 1;
+				}
+				if (!rw)
+				{
+					for (unsigned long long o = 0; o < run; o++)
 					{
-						loc.QuadPart = disksize - (p * sectorsize + sectorsize);
+						memcpy(buf + rblock + o * size, rbuf + (run - 1 - o) * size, size);
 					}
-					tbuf = buf + rblock;
-					if (readwritedrive(hDisk, tbuf, len - rblock, rw, loc)) return;
-					rblock = len;
 				}
-				else
-				{ // In between blocks
-					loc.QuadPart = disksize - (p * sectorsize + sectorsize);
-					tbuf = buf + rblock;
-					if (readwritedrive(hDisk, tbuf, sectorsize, rw, loc)) return;
-					rblock += sectorsize;
+				free(rbuf);
+				rblock += run * size;
+				while (i + 1 < extents.size() && start + rblock >= extents[i + 1].offset)
+				{
+					i++;
 				}
+				size = extents[i].end - extents[i].start;
+				pos = start + rblock - extents[i].offset;
+				continue;
+			}
+			unsigned long long chunk = min(size - pos % size, len - rblock);
+			loc.QuadPart = disksize - ((extents[i].sector + pos / size) * sectorsize + sectorsize) + extents[i].start + pos % size;
+			tbuf = buf + rblock;
+			if (readwritedrive(hDisk, tbuf, chunk, rw, loc))
+			{
+				return 1;
 			}
-			block++;
+			rblock += chunk;
+			pos += chunk;
 		}
-		block--;
-		return;
 	}
-	if (start / sectorsize <= block && block < (start + len + sectorsize - 1) / sectorsize)
-	{
-		if (start / sectorsize == block)
-		{ // Start block
-			if (step)
+	return 0;
+}
+
+int readwritefile(HANDLE hDisk, unsigned long long sectorsize, unsigned long long index, unsigned long long start, unsigned long long len, unsigned long long disksize, char* tablestr, char*& buf, unsigned long long filenameindex, unsigned rw)
+{
+	std::vector<Extent>& extents = getextents(sectorsize, index, tablestr, filenameindex);
+	unsigned long long filesize = 0;
+	getextentfilesize(sectorsize, index, tablestr, filenameindex, filesize);
+	len = start < filesize ? min(len, filesize - start) : 0;
+	if (extents.size() && extents[0].sector == ULLONG_MAX)
+	{ // Kept in the table entry, written out with the table
+		unsigned long long entry = index - getpindex(index, tablestr);
+		char* digits = tablestr + entry + 1 + start * 3;
+		for (unsigned long long i = 0; i < len; i++)
+		{
+			if (rw)
 			{
-				loc.QuadPart = disksize - (std::strtoull(str0.c_str(), 0, 10) * sectorsize + sectorsize) + start % sectorsize + std::strtoul(str1.c_str(), 0, 10);
-				if (len - start % sectorsize < std::strtoull(str2.c_str(), 0, 10) - std::strtoul(str1.c_str(), 0, 10))
-				{
-					if (readwritedrive(hDisk, buf, len, rw, loc)) return;
-					rblock += len;
-				}
-				else
-				{
-					if (readwritedrive(hDisk, buf, min(std::strtoull(str2.c_str(), 0, 10) - std::strtoul(str1.c_str(), 0, 10) - start % sectorsize, len - rblock), rw, loc)) return;
-					rblock += min(std::strtoull(str2.c_str(), 0, 10) - std::strtoul(str1.c_str(), 0, 10) - start % sectorsize, len - rblock);
-				}
+				std::string str = inlinetext(buf + i, 1);
+				memcpy(digits + i * 3, str.c_str() + 1, 3);
 			}
 			else
 			{
-				loc.QuadPart = disksize - (std::strtoull(str0.c_str(), 0, 10) * sectorsize + sectorsize) + start % sectorsize;
-				if (readwritedrive(hDisk, buf, min(sectorsize - start % sectorsize, len), rw, loc)) return;
-				rblock += min(sectorsize - start % sectorsize, len);
+				buf[i] = getinlinebyte(digits + i * 3);
 			}
 		}
-		else if (len - rblock <= sectorsize)
-		{ // End block
-			if (step)
+		if (rw && len)
+		{
+			markdirty(0, entry, index + 1);
+			if (journaling)
 			{
-				loc.QuadPart = disksize - (std::strtoull(str0.c_str(), 0, 10) * sectorsize + sectorsize) + std::strtoul(str1.c_str(), 0, 10);
+				journal += 'E';
+				journalvarint(filenameindex);
+				journalbytes(tablestr + entry, index - entry);
 			}
-			else
+		}
+	}
+	else if (!rw && filesize <= inlinesize)
+	{
+		std::unordered_map<unsigned long long, std::string>::iterator it = inlinelist.find(filenameindex);
+		if (it == inlinelist.end())
+		{
+			if (inlinelist.size() >= inlinelimit)
 			{
-				loc.QuadPart = disksize - (std::strtoull(str0.c_str(), 0, 10) * sectorsize + sectorsize);
+				inlinelist.erase(inlinelist.begin());
 			}
-			tbuf = buf + rblock;
-			if (readwritedrive(hDisk, tbuf, len - rblock, rw, loc)) return;
-			rblock = len;
+			std::string data(filesize, 0);
+			char* tbuf = &data[0];
+			if (readwriteextents(hDisk, sectorsize, extents, 0, filesize, disksize, tbuf, 0))
+			{
+				return 1;
+			}
+			it = inlinelist.emplace(filenameindex, data).first;
 		}
-		else
-		{ // In between blocks
-			loc.QuadPart = disksize - (std::strtoull(str0.c_str(), 0, 10) * sectorsize + sectorsize);
-			tbuf = buf + rblock;
-			if (readwritedrive(hDisk, tbuf, sectorsize, rw, loc)) return;
-			rblock += sectorsize;
+		memcpy(buf, it->second.data() + start, len);
+	}
+	else
+	{
+		if (readwriteextents(hDisk, sectorsize, extents, start, len, disksize, buf, rw))
+		{
+			return 1;
+		}
+		if (rw && inlinelist.find(filenameindex) != inlinelist.end())
+		{ // Written through, trunfile drops it when the size changes
+			memcpy(&inlinelist[filenameindex][start], buf, len);
 		}
 	}
-}
-
-void chtime(char*& fileinfo, unsigned long long filenameindex, double& time, unsigned ch)
-{ // 24 bytes per file
-	unsigned o = 0;
-	if (ch == 2 || ch == 3)
+	unsigned long long ctime = currenttime();
+	if (rw)
 	{
-		o = 8;
+		reparselist.erase(filenameindex);
+		ealist.erase(filenameindex);
+		unsigned long long id = 0;
+		chsecurity(filenameindex, id, 1);
+		chtime(filenameindex, ctime, 3);
 	}
-	else if (ch == 4 || ch == 5)
+	else
 	{
-		o = 16;
+		touchatime(filenameindex, ctime);
 	}
-	if (!(ch % 2))
+	return 0;
+}
+
+int readreparse(HANDLE hDisk, unsigned long long sectorsize, unsigned long long index, unsigned long long disksize, char* tablestr, unsigned long long filenameindex, std::string*& data)
+{ // Whole reparse buffer, read once and kept until the file is written, truncated or deleted.
+	std::unordered_map<unsigned long long, std::string>::iterator it = reparselist.find(filenameindex);
+	if (it == reparselist.end())
 	{
-		char tim[8] = { 0 };
-		memcpy(tim, fileinfo + filenameindex * 24 + o, 8);
-		char ti[8] = { 0 };
-		for (unsigned i = 0; i < 8; i++)
+		if (reparselist.size() >= reparselimit)
 		{
-			ti[i] = tim[7 - i];
+			reparselist.erase(reparselist.begin());
 		}
-		memcpy(&time, ti, 8);
-	}
-	else
-	{
-		char ti[8] = { 0 };
-		memcpy(ti, &time, 8);
-		char tim[8] = { 0 };
-		for (unsigned i = 0; i < 8; i++)
+		unsigned long long filesize = 0;
+		getextentfilesize(sectorsize, index, tablestr, filenameindex, filesize);
+		std::string buf(filesize, 0);
+		char* tbuf = &buf[0];
+		if (readwritefile(hDisk, sectorsize, index, 0, filesize, disksize, tablestr, tbuf, filenameindex, 0))
 		{
-			tim[i] = ti[7 - i];
+			return 1;
 		}
-		memcpy(fileinfo + filenameindex * 24 + o, tim, 8);
+		it = reparselist.emplace(filenameindex, buf).first;
 	}
+	touchatime(filenameindex, currenttime());
+	data = &it->second;
+	return 0;
 }
 
-void chgid(char*& fileinfo, unsigned long long filenamecount, unsigned long long filenameindex, unsigned long& gid, unsigned ch)
-{ // Next three bytes of fileinfo after times
-	if (!ch)
+int indexea(Eas& ea)
+{ // Packed as flags, name length, value length (2 bytes, little endian), name then value for each EA.
+	ea.index.clear();
+	unsigned long long len = ea.block.size();
+	for (unsigned long long o = 0; o < len;)
 	{
-		gid = (fileinfo[filenamecount * 24 + filenameindex * 11] & 0xff) << 16 | (fileinfo[filenamecount * 24 + filenameindex * 11 + 1] & 0xff) << 8 | fileinfo[filenamecount * 24 + filenameindex * 11 + 2] & 0xff;
+		if (len - o < 4)
+		{
+			return 1;
+		}
+		unsigned long long namelen = ea.block[o + 1] & 0xff;
+		unsigned long long valuelen = (ea.block[o + 2] & 0xff) | (ea.block[o + 3] & 0xff) << 8;
+		if (len - o - 4 < namelen + valuelen)
+		{
+			return 1;
+		}
+		ea.index[ea.block.substr(o + 4, namelen)] = o;
+		o += 4 + namelen + valuelen;
 	}
-	else
+	return 0;
+}
+
+int nextea(Eas& ea, unsigned long long& o, unsigned char& flags, std::string& name, std::string& value)
+{ // In the order they were set, o starts at 0 and is moved past the EA returned.
+	if (o >= ea.block.size())
 	{
-		fileinfo[filenamecount * 24 + filenameindex * 11] = (gid >> 16) & 0xff;
-		fileinfo[filenamecount * 24 + filenameindex * 11 + 1] = (gid >> 8) & 0xff;
-		fileinfo[filenamecount * 24 + filenameindex * 11 + 2] = gid & 0xff;
+		return 1;
 	}
+	unsigned long long namelen = ea.block[o + 1] & 0xff;
+	unsigned long long valuelen = (ea.block[o + 2] & 0xff) | (ea.block[o + 3] & 0xff) << 8;
+	flags = ea.block[o] & 0xff;
+	name = ea.block.substr(o + 4, namelen);
+	value = ea.block.substr(o + 4 + namelen, valuelen);
+	o += 4 + namelen + valuelen;
+	return 0;
 }
 
-void chuid(char*& fileinfo, unsigned long long filenamecount, unsigned long long filenameindex, unsigned long& uid, unsigned ch)
-{ // Next two bytes of fileinfo
-	if (!ch)
+int findea(Eas& ea, std::string name, unsigned char& flags, std::string& value)
+{
+	for (unsigned long long i = 0; i < name.size(); i++)
 	{
-		uid = (fileinfo[filenamecount * 24 + filenameindex * 11 + 3] & 0xff) << 8 | fileinfo[filenamecount * 24 + filenameindex * 11 + 4] & 0xff;
+		name[i] = toupper(name[i] & 0xff);
 	}
-	else
+	std::unordered_map<std::string, unsigned long long>::iterator it = ea.index.find(name);
+	if (it == ea.index.end())
 	{
-		fileinfo[filenamecount * 24 + filenameindex * 11 + 3] = (uid >> 8) & 0xff;
-		fileinfo[filenamecount * 24 + filenameindex * 11 + 4] = uid & 0xff;
+		return 1;
 	}
+	unsigned long long o = it->second;
+	return nextea(ea, o, flags, name, value);
 }
 
-void chmode(char*& fileinfo, unsigned long long filenamecount, unsigned long long filenameindex, unsigned long& mode, unsigned ch)
-{ // Next two bytes of fileinfo
-	if (!ch)
+int setea(Eas& ea, std::string name, unsigned char flags, std::string value)
+{ // An empty value removes the EA, names are kept in uppercase like NTFS does.
+	if (name.empty() || name.size() > 255 || value.size() > 65535)
 	{
-		mode = (fileinfo[filenamecount * 24 + filenameindex * 11 + 5] & 0xff) << 8 | fileinfo[filenamecount * 24 + filenameindex * 11 + 6] & 0xff;
+		return 1;
 	}
-	else
+	for (unsigned long long i = 0; i < name.size(); i++)
 	{
-		fileinfo[filenamecount * 24 + filenameindex * 11 + 5] = (mode >> 8) & 0xff;
-		fileinfo[filenamecount * 24 + filenameindex * 11 + 6] = mode & 0xff;
+		name[i] = toupper(name[i] & 0xff);
 	}
-}
-
-void chwinattrs(char*& fileinfo, unsigned long long filenamecount, unsigned long long filenameindex, unsigned long& winattrs, unsigned ch)
-{ // Last four bytes of fileinfo
-	if (!ch)
+	std::unordered_map<std::string, unsigned long long>::iterator it = ea.index.find(name);
+	if (it != ea.index.end())
 	{
-		winattrs = (fileinfo[filenamecount * 24 + filenameindex * 11 + 7] & 0xff) << 24 | (fileinfo[filenamecount * 24 + filenameindex * 11 + 8] & 0xff) << 16 | (fileinfo[filenamecount * 24 + filenameindex * 11 + 9] & 0xff) << 8 | fileinfo[filenamecount * 24 + filenameindex * 11 + 10] & 0xff;
+		unsigned long long o = it->second;
+		unsigned long long valuelen = (ea.block[o + 2] & 0xff) | (ea.block[o + 3] & 0xff) << 8;
+		ea.block.erase(o, 4 + name.size() + valuelen);
+		indexea(ea);
 	}
-	else
+	if (value.empty())
 	{
-		fileinfo[filenamecount * 24 + filenameindex * 11 + 7] = (winattrs >> 24) & 0xff;
-		fileinfo[filenamecount * 24 + filenameindex * 11 + 8] = (winattrs >> 16) & 0xff;
-		fileinfo[filenamecount * 24 + filenameindex * 11 + 9] = (winattrs >> 8) & 0xff;
-		fileinfo[filenamecount * 24 + filenameindex * 11 + 10] = winattrs & 0xff;
+		return 0;
 	}
+	ea.index[name] = ea.block.size();
+	ea.block += (char)flags;
+	ea.block += (char)name.size();
+	ea.block += (char)(value.size() & 0xff);
+	ea.block += (char)(value.size() >> 8);
+	ea.block += name;
+	ea.block += value;
+	return 0;
 }
 
-int readwritefile(HANDLE hDisk, unsigned long long sectorsize, unsigned long long index, unsigned long long start, unsigned long long len, unsigned long long disksize, char* tablestr, char*& buf, char*& fileinfo, unsigned long long filenameindex, unsigned rw)
-{
-	unsigned long long pindex = getpindex(index, tablestr);
-	unsigned long long filesize = 0;
-	getfilesize(sectorsize, index, tablestr, filesize);
-	len = min(len, filesize - start);
-	index++;
-	pindex++;
-	unsigned long long block = 0;
-	unsigned long long rblock = 0;
-	std::string cblock;
-	cblock.reserve(21);
-	unsigned long long cloc = 0;
-	std::string str0;
-	std::string str1;
-	std::string str2;
-	std::string rstr;
-	unsigned step = 0;
-	unsigned range = 0;
-	for (unsigned long long i = 0; i < pindex; i++)
+unsigned long long easize(Eas& ea)
+{ // Packed size as NTFS reports it, 5 bytes with the name and value of each, one more than each takes in block.
+	return ea.block.size() + ea.index.size();
+}
+
+int readea(HANDLE hDisk, unsigned long long sectorsize, unsigned long long index, unsigned long long disksize, char* tablestr, unsigned long long filenameindex, Eas*& ea)
+{ // Whole EA stream, read once and kept until it is written, truncated or deleted.
+	std::unordered_map<unsigned long long, Eas>::iterator it = ealist.find(filenameindex);
+	if (it == ealist.end())
 	{
-		switch (tablestr[index - pindex + i] & 0xff)
+		if (ealist.size() >= ealimit)
 		{
-		case 59: //;
-			resetcloc(cloc, cblock, str0, str1, str2, step);
-			step++;
-			break;
-		case 46: //.
-			resetcloc(cloc, cblock, str0, str1, str2, step);
-			readwrite(hDisk, sectorsize, disksize, start, step, range, len, str0, str1, str2, rstr, rblock, block, buf, rw);
-			step = 0;
-			range = 0;
-			break;
-		case 45: //-
-			resetcloc(cloc, cblock, str0, str1, str2, step);
-			step = 0;
-			range++;
-			rstr = str0;
-			break;
-		case 44: //,
-			resetcloc(cloc, cblock, str0, str1, str2, step);
-			readwrite(hDisk, sectorsize, disksize, start, step, range, len, str0, str1, str2, rstr, rblock, block, buf, rw);
-			step = 0;
-			range = 0;
-			block++;
-			break;
-		default: //0-9
-			cblock.resize(cloc + 1);
-			cblock[cloc] = tablestr[index - pindex + i];
-			cblock[cloc + 1] = 0;
-			cloc++;
-			break;
+			ealist.erase(ealist.begin());
+		}
+		unsigned long long filesize = 0;
+		getextentfilesize(sectorsize, index, tablestr, filenameindex, filesize);
+		Eas block;
+		block.block.resize(filesize);
+		char* tbuf = &block.block[0];
+		if (readwritefile(hDisk, sectorsize, index, 0, filesize, disksize, tablestr, tbuf, filenameindex, 0))
+		{
+			return 1;
 		}
+		if (indexea(block))
+		{
+			return 1;
+		}
+		it = ealist.emplace(filenameindex, block).first;
 	}
-	FILETIME ltime;
-	GetSystemTimeAsFileTime(&ltime);
-	LONGLONG pltime = ((PLARGE_INTEGER)&ltime)->QuadPart;
-	double ctime = (double)(pltime - 116444736000000000) / 10000000;
-	chtime(fileinfo, filenameindex, ctime, rw * 2 + 1);
+	ea = &it->second;
 	return 0;
 }
 
-int trunfile(HANDLE hDisk, unsigned long sectorsize, unsigned long long& index, unsigned long tablesize, unsigned long long disksize, unsigned long long size, unsigned long long newsize, unsigned long long filenameindex, char* charmap, char*& tablestr, char*& fileinfo, unsigned long long& usedblocks, PWSTR filename, char* filenames, unsigned long long filenamecount)
+int trunfile(HANDLE hDisk, unsigned long sectorsize, unsigned long long& index, unsigned long tablesize, unsigned long long disksize, unsigned long long size, unsigned long long newsize, unsigned long long filenameindex, char* charmap, char*& tablestr, unsigned long long& usedblocks, PWSTR filename, char* filenames, unsigned long long filenamecount)
 {
-	desimp(charmap, tablestr);
+	if (size < newsize && newsize - size > disksize - static_cast<unsigned long long>(tablesize + 1) * sectorsize - usedblocks * sectorsize)
+	{
+		return 1;
+	}
 	index = gettablestrindex(filename, filenames, tablestr, filenamecount);
-	if (size < newsize)
+	unsigned long long oldindex = index;
+	unsigned long long entry = filenameindex ? tablestrindexlist[filenameindex - 1] + 1 : 0;
+	std::vector<Extent>& extents = getextents(sectorsize, index, tablestr, filenameindex);
+	bool inlined = extents.size() && extents[0].sector == ULLONG_MAX;
+	bool inlining = extrecords && newsize && newsize <= min(inlinesize, inlinemax);
+	if (inlined && !inlining && newsize > disksize - static_cast<unsigned long long>(tablesize + 1) * sectorsize - usedblocks * sectorsize)
 	{
-		if (newsize - size > disksize - static_cast<unsigned long long>(tablesize + 1) * sectorsize - usedblocks * sectorsize)
+		return 1;
+	}
+	if (inlined || inlining)
+	{
+		std::string data(min(size, newsize), 0);
+		char* buf = &data[0];
+		if (data.size() && readwritefile(hDisk, sectorsize, index, 0, data.size(), disksize, tablestr, buf, filenameindex, 0))
+		{
+			return 1;
+		}
+		if (!inlined && size && trunfile(hDisk, sectorsize, index, tablesize, disksize, size, 0, filenameindex, charmap, tablestr, usedblocks, filename, filenames, filenamecount))
 		{
 			return 1;
 		}
+		std::string str = inlining ? inlinetext(buf, data.size()) + std::string(3 * (newsize - data.size()), 48) : "";
+		unsigned long long tablestrlen = strlen(tablestr);
+		if (str.size() > index - entry)
+		{
+			char* alc = (char*)realloc(tablestr, tablestrlen + str.size() - (index - entry) + 1);
+			if (!alc)
+			{
+				return 1;
+			}
+			tablestr = alc;
+			alc = NULL;
+		}
+		memmove(tablestr + entry + str.size(), tablestr + index, tablestrlen - index + 1);
+		memcpy(tablestr + entry, str.c_str(), str.size());
+		index = entry + str.size();
+		if (!inlining && newsize)
+		{
+			int err = alloc(sectorsize, disksize, tablesize, charmap, tablestr, index, newsize, usedblocks);
+			shifttablestrindex(filenameindex, index);
+			extentlist.erase(filenameindex);
+			inlinelist.erase(filenameindex);
+			buf = &data[0];
+			if (err || readwritefile(hDisk, sectorsize, index, 0, data.size(), disksize, tablestr, buf, filenameindex, 1))
+			{ // data holds the only copy of the bytes
+				unsigned long long allocated = 0;
+				getextentfilesize(sectorsize, index, tablestr, filenameindex, allocated);
+				if (allocated)
+				{
+					trunfile(hDisk, sectorsize, index, tablesize, disksize, allocated, 0, filenameindex, charmap, tablestr, usedblocks, filename, filenames, filenamecount);
+				}
+				str = inlinetext(&data[0], data.size());
+				if (!setentry(tablestr, filenamecount, filenameindex, &str[0], str.size()) && journaling)
+				{
+					journal += 'E';
+					journalvarint(filenameindex);
+					journalbytes(&str[0], str.size());
+				}
+				index = gettablestrindex(filename, filenames, tablestr, filenamecount);
+				return 1;
+			}
+		}
+	}
+	else if (size < newsize)
+	{ // alloc keeps the entry simplified, only shrinking needs it spelled out.
 		if (size % sectorsize)
 		{
 			char* temp = (char*)calloc(size % sectorsize + 1, 1);
-			readwritefile(hDisk, sectorsize, index, size - size % sectorsize, size % sectorsize, disksize, tablestr, temp, fileinfo, filenameindex, 0);
-			dealloc(sectorsize, charmap, tablestr, index, size, size % sectorsize);
+			readwritefile(hDisk, sectorsize, index, size - size % sectorsize, size % sectorsize, disksize, tablestr, temp, filenameindex, 0);
+			dealloc(sectorsize, charmap, tablestr, index, size, size % sectorsize, usedblocks);
 			alloc(sectorsize, disksize, tablesize, charmap, tablestr, index, newsize - (size - size % sectorsize), usedblocks);
-			readwritefile(hDisk, sectorsize, index, size - size % sectorsize, size % sectorsize, disksize, tablestr, temp, fileinfo, filenameindex, 1);
+			extentlist.erase(filenameindex);
+			inlinelist.erase(filenameindex);
+			readwritefile(hDisk, sectorsize, index, size - size % sectorsize, size % sectorsize, disksize, tablestr, temp, filenameindex, 1);
 			free(temp);
 			size += newsize - size;
 		}
 		alloc(sectorsize, disksize, tablesize, charmap, tablestr, index, newsize - size, usedblocks);
 	}
-	if (size > newsize)
+	else if (size > newsize)
 	{
+		simpfile(charmap, tablestr, index, 1);
 		if (size % sectorsize && size - newsize > size % sectorsize)
 		{
-			dealloc(sectorsize, charmap, tablestr, index, size, size % sectorsize);
+			dealloc(sectorsize, charmap, tablestr, index, size, size % sectorsize, usedblocks);
 			size -= size % sectorsize;
 		}
-		dealloc(sectorsize, charmap, tablestr, index, size, size - newsize);
+		dealloc(sectorsize, charmap, tablestr, index, size, size - newsize, usedblocks);
+		simpfile(charmap, tablestr, index, 0);
 	}
-	simp(charmap, tablestr);
-	index = gettablestrindex(filename, filenames, tablestr, filenamecount);
-	FILETIME ltime;
-	GetSystemTimeAsFileTime(&ltime);
-	LONGLONG pltime = ((PLARGE_INTEGER)&ltime)->QuadPart;
-	double ctime = (double)(pltime - 116444736000000000) / 10000000;
-	chtime(fileinfo, filenameindex, ctime, 3);
+	shifttablestrindex(filenameindex, index);
+	markdirty(0, entry, index == oldindex ? index + 1 : ULLONG_MAX);
+	if (journaling)
+	{
+		journal += 'E';
+		journalvarint(filenameindex);
+		journalbytes(tablestr + entry, index - entry);
+	}
+	extentlist.erase(filenameindex); // alloc and dealloc only run from here
+	inlinelist.erase(filenameindex);
+	reparselist.erase(filenameindex);
+	ealist.erase(filenameindex);
+	unsigned long long id = 0;
+	chsecurity(filenameindex, id, 1);
+	unsigned long long ctime = currenttime();
+	chtime(filenameindex, ctime, 3);
+	return 0;
+}
+
+int loaddescriptors(HANDLE hDisk, unsigned long sectorsize, unsigned long long disksize, char* tablestr, char* filenames, unsigned long long filenamecount)
+{ // The store is a 4 byte little endian id and length before each descriptor.
+	descriptors.assign(1, "");
+	descriptorstored.assign(1, true);
+	descriptorids.clear();
+	unsigned long long filenameindex = 0;
+	unsigned long long filenamestrindex = 0;
+	getfilenameindex(PWSTR(L":$"), filenames, filenamecount, filenameindex, filenamestrindex);
+	if (filenameindex >= filenamecount)
+	{
+		return 0;
+	}
+	unsigned long long index = gettablestrindex(PWSTR(L":$"), filenames, tablestr, filenamecount);
+	unsigned long long filesize = 0;
+	getextentfilesize(sectorsize, index, tablestr, filenameindex, filesize);
+	std::string store(filesize + 1, 0);
+	char* buf = &store[0];
+	if (readwritefile(hDisk, sectorsize, index, 0, filesize, disksize, tablestr, buf, filenameindex, 0))
+	{
+		return 1;
+	}
+	for (unsigned long long o = 0; o < filesize;)
+	{
+		if (filesize - o < 8)
+		{
+			return 1;
+		}
+		unsigned long id = (store[o] & 0xff) | (store[o + 1] & 0xff) << 8 | (store[o + 2] & 0xff) << 16 | (unsigned long)(store[o + 3] & 0xff) << 24;
+		unsigned long long len = (store[o + 4] & 0xff) | (store[o + 5] & 0xff) << 8 | (store[o + 6] & 0xff) << 16 | (unsigned long long)(store[o + 7] & 0xff) << 24;
+		if (!id || filesize - o - 8 < len || (id < descriptors.size() && descriptorstored[id]))
+		{
+			return 1;
+		}
+		if (id >= descriptors.size())
+		{
+			descriptors.resize(id + 1);
+			descriptorstored.resize(id + 1);
+		}
+		descriptors[id] = store.substr(o + 8, len);
+		descriptorstored[id] = true;
+		descriptorids.emplace(descriptors[id], id);
+		o += 8 + len;
+	}
+	return 0;
+}
+
+int adddescriptor(HANDLE hDisk, unsigned long sectorsize, unsigned long tablesize, unsigned long long disksize, char* charmap, char*& tablestr, unsigned long long& usedblocks, unsigned long long& filenamecount, char*& filenames, std::string descriptor, unsigned long& id)
+{ // A descriptor not in the store yet goes on its end, the store is made on first use.
+	id = keepdescriptor(descriptor);
+	if (descriptorstored[id])
+	{
+		return 0;
+	}
+	unsigned long long filenameindex = 0;
+	unsigned long long filenamestrindex = 0;
+	getfilenameindex(PWSTR(L":$"), filenames, filenamecount, filenameindex, filenamestrindex);
+	if (filenameindex >= filenamecount)
+	{
+		if (createfile(PWSTR(L":$"), 545, 545, 448, 0, filenamecount, filenames, charmap, tablestr))
+		{
+			return 1;
+		}
+		getfilenameindex(PWSTR(L":$"), filenames, filenamecount, filenameindex, filenamestrindex);
+	}
+	unsigned long long index = gettablestrindex(PWSTR(L":$"), filenames, tablestr, filenamecount);
+	unsigned long long filesize = 0;
+	getextentfilesize(sectorsize, index, tablestr, filenameindex, filesize);
+	std::string record(8, 0);
+	for (unsigned i = 0; i < 4; i++)
+	{
+		record[i] = (id >> (i * 8)) & 0xff;
+		record[4 + i] = (descriptor.size() >> (i * 8)) & 0xff;
+	}
+	record += descriptor;
+	if (trunfile(hDisk, sectorsize, index, tablesize, disksize, filesize, filesize + record.size(), filenameindex, charmap, tablestr, usedblocks, PWSTR(L":$"), filenames, filenamecount))
+	{
+		return 1;
+	}
+	char* buf = &record[0];
+	if (readwritefile(hDisk, sectorsize, index, filesize, record.size(), disksize, tablestr, buf, filenameindex, 1))
+	{
+		return 1;
+	}
+	descriptorstored[id] = true;
 	return 0;
 }
 
+unsigned long keepdescriptor(std::string descriptor)
+{ // Same bytes, same id. Only in memory until adddescriptor stores it.
+	if (descriptor.empty())
+	{
+		return 0;
+	}
+	std::unordered_map<std::string, unsigned long>::iterator it = descriptorids.find(descriptor);
+	if (it != descriptorids.end())
+	{
+		return it->second;
+	}
+	unsigned long id = descriptors.size();
+	descriptors.push_back(descriptor);
+	descriptorstored.push_back(false);
+	descriptorids.emplace(descriptor, id);
+	return id;
+}
+
+std::string& getdescriptor(unsigned long id)
+{
+	return id < descriptors.size() ? descriptors[id] : descriptors[0];
+}
+
+unsigned long long checkreparse(HANDLE hDisk, unsigned long sectorsize, unsigned long long disksize, char* tablestr, unsigned long long filenamecount)
+{ // At mount, the tag of every reparse point from its buffer. Returns how many were set.
+	if (tablestrindexlist.size() != filenamecount)
+	{
+		buildtablestrindex(tablestr);
+	}
+	unsigned long long fixed = 0;
+	for (unsigned long long i = 0; i < filenamecount; i++)
+	{
+		if (!(inodes.winattrs[i] & 1024))
+		{
+			continue;
+		}
+		unsigned long long filesize = 0;
+		getextentfilesize(sectorsize, tablestrindexlist[i], tablestr, i, filesize);
+		if (filesize < 4)
+		{
+			continue;
+		}
+		std::vector<Extent>& extents = getextents(sectorsize, tablestrindexlist[i], tablestr, i);
+		char buf[4] = { 0 };
+		char* tbuf = buf;
+		if (extents[0].sector == ULLONG_MAX)
+		{ // Read straight from the entry, a mount is not an access
+			unsigned long long index = tablestrindexlist[i];
+			for (unsigned o = 0; o < 4; o++)
+			{
+				buf[o] = getinlinebyte(tablestr + index - getpindex(index, tablestr) + 1 + o * 3);
+			}
+		}
+		else if (readwriteextents(hDisk, sectorsize, extents, 0, 4, disksize, tbuf, 0))
+		{
+			continue;
+		}
+		unsigned long tag = (unsigned long)(buf[0] & 0xff) | (buf[1] & 0xff) << 8 | (buf[2] & 0xff) << 16 | (unsigned long)(buf[3] & 0xff) << 24;
+		if (tag != inodes.reparse[i])
+		{
+			chreparse(i, tag, 1);
+			fixed++;
+		}
+	}
+	return fixed;
+}
+
 /*int main(int argc, char* argv[])
 {
 	if (argc == 1)
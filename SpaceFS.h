@@ -4,34 +4,150 @@
 #include <stdio.h>
 #include <iostream>
 #include <unordered_map>
+#include <map>
 #include <time.h>
 #include <string>
+#include <vector>
+#include <climits>
 
-void handmaps(std::unordered_map<unsigned, unsigned> Emap, std::unordered_map<unsigned, unsigned> Dmap, std::unordered_map<std::wstring, unsigned long long>& filenameindexlist);
+struct Extent
+{
+	unsigned long long offset;
+	unsigned long long sector;
+	unsigned long long count;
+	unsigned long long start;
+	unsigned long long end;
+};
+
+struct Inodes
+{ // One of each per filenameindex, the table keeps the times of every file then the attributes of every file.
+	std::vector<unsigned long long> times[3]; // Access, write, creation as FILETIME
+	std::vector<unsigned long> gid;
+	std::vector<unsigned long> uid;
+	std::vector<unsigned long> mode;
+	std::vector<unsigned long> winattrs;
+	std::vector<unsigned long long> security; // Descriptor id of a security file once read, 0 until then, never in the table
+	std::vector<unsigned long> reparse; // Reparse tag, set at mount and by SetReparsePoint. Only in the table with extended records
+	std::vector<unsigned long> descriptor; // Id in the descriptor store, 0 to use the security file. Only in the table with extended records
+};
+
+struct Eas
+{ // Extended attributes of one file as stored in its EA stream, with the offset of each in block by uppercase name
+	std::string block;
+	std::unordered_map<std::string, unsigned long long> index;
+};
+
+struct Part
+{
+	std::vector<unsigned long long> used; // Bit per byte
+	unsigned long long cls = ULLONG_MAX;
+	unsigned long long slot = 0;
+};
+
+void handmaps(std::unordered_map<unsigned, unsigned> Emap, std::unordered_map<unsigned, unsigned> Dmap);
+void markdirty(unsigned region, unsigned long long start, unsigned long long end);
 void encode(char*& str, unsigned long long& len);
 void decode(char*& bytes, unsigned long long len);
+void putvarint(char* buf, unsigned long long& pos, unsigned long long val);
+unsigned long long getvarint(char* buf, unsigned long long& pos, unsigned long long len);
+std::string inlinetext(char* bytes, unsigned long long len);
+char getinlinebyte(char* digits);
+void encodeentry(char* tablestr, unsigned long long entry, unsigned long long end, char* bin, unsigned long long& pos);
+int decodeextents(char* bin, unsigned long long& binlen, char*& tablestr);
 int settablesize(unsigned long sectorsize, unsigned long& tablesize, unsigned long long& extratablesize, char*& table);
+int readtable(HANDLE hDisk, unsigned long& sectorsize, unsigned long& tablesize, unsigned long long& extratablesize, char*& table);
+void nativetimes(char* table);
+void extendedrecords(char* table);
+void resizeinodes(unsigned long long filenamecount);
+void moveinode(unsigned long long from, unsigned long long to);
+void encodeinode(unsigned long long filenameindex, char* times, char* attrs);
+void decodeinode(unsigned long long filenameindex, char* times, char* attrs);
+int loadtable(char* table, char*& tablestr, char*& filenames, unsigned long long& filenamecount);
 void resetcloc(unsigned long long& cloc, std::string& cblock, std::string& str0, std::string& str1, std::string& str2, unsigned step);
 unsigned long long getpindex(unsigned long long index, char* tablestr);
-int getfilesize(unsigned long sectorsize, unsigned long long index, char* tablestr, unsigned long long& filesize);
+unsigned long lowestbit(unsigned long long word);
+void setsector(unsigned long long sector);
+unsigned long long findsector(unsigned long long limit);
+void setsectors(unsigned long long start, unsigned long long end);
+unsigned long long findsectorend(unsigned long long start, unsigned long long end);
+unsigned long nextbit(std::vector<unsigned long long>& words, unsigned long o, unsigned long end, bool set);
+int findrun(std::vector<unsigned long long>& words, unsigned long sectorsize, unsigned long blocksize, unsigned long& offset);
+unsigned long longestrun(std::vector<unsigned long long>& words, unsigned long sectorsize);
+void classifypart(unsigned long long sector, Part& part, unsigned long long cls);
+void markused(unsigned long sectorsize, unsigned long long sector, unsigned long start, unsigned long end, unsigned long long& usedblocks);
+void clearsector(unsigned long long sector);
+void markfree(unsigned long sectorsize, unsigned long long sector, unsigned long start, unsigned long end, unsigned long long& usedblocks);
+void freeitem(unsigned long sectorsize, char* item, unsigned long long& usedblocks);
 void addtopartlist(unsigned long sectorsize, unsigned range, unsigned step, std::string str0, std::string str1, std::string str2, std::string rstr, unsigned long long& usedblocks);
+void detectblocks(unsigned long sectorsize, unsigned long long disksize, char* tablestr, unsigned long long& usedblocks);
 int findblock(unsigned long sectorsize, unsigned long long disksize, unsigned long tablesize, char* tablestr, char*& block, unsigned long long& blockstrlen, unsigned long blocksize, unsigned long long& usedblocks);
+int findblocks(unsigned long sectorsize, unsigned long long disksize, unsigned long tablesize, char* tablestr, unsigned long long count, unsigned long long& start, unsigned long long& end, unsigned long long& usedblocks);
 int alloc(unsigned long sectorsize, unsigned long long disksize, unsigned long tablesize, char* charmap, char*& tablestr, unsigned long long& index, unsigned long long size, unsigned long long& usedblocks);
-int dealloc(unsigned long sectorsize, char* charmap, char*& tablestr, unsigned long long& index, unsigned long long filesize, unsigned long long size);
+int dealloc(unsigned long sectorsize, char* charmap, char*& tablestr, unsigned long long& index, unsigned long long filesize, unsigned long long size, unsigned long long& usedblocks);
+void foldfilename(std::string& name);
+void addindexentry(std::unordered_map<std::string, std::map<std::string, std::string>>& index, std::string parent, std::string child, bool add);
+void addnameentry(std::string name, bool add);
+void addfilename(std::string name, unsigned long long filenameindex, unsigned long long filenamestrindex);
+void buildfilenameindex(char* filenames, unsigned long long filenamecount);
+unsigned long long findfilenameentry(unsigned long long filenamestrindex);
+unsigned long long findserialentry(unsigned long long serial);
 void getfilenameindex(PWSTR filename, char* filenames, unsigned long long filenamecount, unsigned long long& filenameindex, unsigned long long& filenamestrindex);
+unsigned matchpattern(const std::string& pattern, const std::string& name);
+std::map<std::string, std::string>& getindexentry(std::unordered_map<std::string, std::map<std::string, std::string>>& index, PWSTR name, char* filenames, unsigned long long filenamecount);
+std::map<std::string, std::string>& getdirindex(PWSTR dirname, char* filenames, unsigned long long filenamecount);
+std::map<std::string, std::string>& getstreamindex(PWSTR filename, char* filenames, unsigned long long filenamecount);
+void buildtablestrindex(char* tablestr);
 unsigned long long gettablestrindex(PWSTR filename, char* filenames, char* tablestr, unsigned long long filenamecount);
+void shifttablestrindex(unsigned long long filenameindex, unsigned long long index);
 int desimp(char* charmap, char*& tablestr);
 int simp(char* charmap, char*& tablestr);
-int simptable(HANDLE hDisk, unsigned long sectorsize, char* charmap, unsigned long& tablesize, unsigned long long& extratablesize, unsigned long long filenamecount, char*& fileinfo, char*& filenames, char*& tablestr, char*& table);
-int createfile(PWSTR filename, unsigned long gid, unsigned long uid, unsigned long mode, unsigned long winattrs, unsigned long long& filenamecount, char*& fileinfo, char*& filenames, char* charmap, char*& tablestr);
-int deletefile(unsigned long long index, unsigned long long filenameindex, unsigned long long filenamestrindex, unsigned long long& filenamecount, char*& fileinfo, char*& filenames, char*& tablestr);
+int simpfile(char* charmap, char*& tablestr, unsigned long long& index, unsigned de);
+void settablebytes(char* table, unsigned long long loc, char* bytes, unsigned long long len);
+int packtable(unsigned long sectorsize, unsigned long& tablesize, unsigned long long& extratablesize, unsigned long long filenamecount, char*& filenames, char*& tablestr, char*& table);
+int simptable(HANDLE hDisk, unsigned long sectorsize, char* charmap, unsigned long& tablesize, unsigned long long& extratablesize, unsigned long long filenamecount, char*& filenames, char*& tablestr, char*& table);
+int createfile(PWSTR filename, unsigned long gid, unsigned long uid, unsigned long mode, unsigned long winattrs, unsigned long long& filenamecount, char*& filenames, char* charmap, char*& tablestr);
+int deletefile(unsigned long long index, unsigned long long filenameindex, unsigned long long filenamestrindex, unsigned long long& filenamecount, char*& filenames, char*& tablestr);
 int renamefile(PWSTR oldfilename, PWSTR newfilename, unsigned long long& filenamestrindex, char*& filenames);
+int compactfiles(unsigned long long& filenamecount, char*& filenames, char*& tablestr);
 unsigned readwritedrive(HANDLE hDisk, char*& buf, unsigned long long len, unsigned rw, LARGE_INTEGER loc);
-void readwrite(HANDLE hDisk, unsigned long sectorsize, unsigned long long disksize, unsigned long long start, unsigned step, unsigned range, unsigned long long len, std::string str0, std::string str1, std::string str2, std::string rstr, unsigned long long& rblock, unsigned long long& block, char*& buf, unsigned rw);
-void chtime(char*& fileinfo, unsigned long long filenameindex, double& time, unsigned ch);
-void chgid(char*& fileinfo, unsigned long long filenamecount, unsigned long long filenameindex, unsigned long& gid, unsigned ch);
-void chuid(char*& fileinfo, unsigned long long filenamecount, unsigned long long filenameindex, unsigned long& uid, unsigned ch);
-void chmode(char*& fileinfo, unsigned long long filenamecount, unsigned long long filenameindex, unsigned long& mode, unsigned ch);
-void chwinattrs(char*& fileinfo, unsigned long long filenamecount, unsigned long long filenameindex, unsigned long& winattrs, unsigned ch);
-int readwritefile(HANDLE hDisk, unsigned long long sectorsize, unsigned long long index, unsigned long long start, unsigned long long len, unsigned long long disksize, char* tablestr, char*& buf, char*& fileinfo, unsigned long long filenameindex, unsigned rw);
-int trunfile(HANDLE hDisk, unsigned long sectorsize, unsigned long long& index, unsigned long tablesize, unsigned long long disksize, unsigned long long size, unsigned long long newsize, unsigned long long filenameindex, char* charmap, char*& tablestr, char*& fileinfo, unsigned long long& usedblocks, PWSTR filename, char* filenames, unsigned long long filenamecount);
+unsigned long long getdrivecalls();
+unsigned long long currenttime();
+void chtime(unsigned long long filenameindex, unsigned long long& time, unsigned ch);
+void atimepolicy(unsigned mode, unsigned long long interval);
+void inlinepolicy(unsigned long long size);
+void touchatime(unsigned long long filenameindex, unsigned long long time);
+void flushatimes(unsigned long long filenamecount);
+void chsecurity(unsigned long long filenameindex, unsigned long long& id, unsigned ch);
+void chreparse(unsigned long long filenameindex, unsigned long& tag, unsigned ch);
+void chattr(std::vector<unsigned long>& attr, unsigned long mask, unsigned long long filenameindex, unsigned long& val, unsigned ch);
+void chgid(unsigned long long filenameindex, unsigned long& gid, unsigned ch);
+void chuid(unsigned long long filenameindex, unsigned long& uid, unsigned ch);
+void chmode(unsigned long long filenameindex, unsigned long& mode, unsigned ch);
+void chwinattrs(unsigned long long filenameindex, unsigned long& winattrs, unsigned ch);
+void chdescriptor(unsigned long long filenameindex, unsigned long& id, unsigned ch);
+std::vector<Extent>& getextents(unsigned long long sectorsize, unsigned long long index, char* tablestr, unsigned long long filenameindex);
+void getextentfilesize(unsigned long long sectorsize, unsigned long long index, char* tablestr, unsigned long long filenameindex, unsigned long long& filesize);
+int readwriteextents(HANDLE hDisk, unsigned long long sectorsize, std::vector<Extent>& extents, unsigned long long start, unsigned long long len, unsigned long long disksize, char*& buf, unsigned rw);
+int readwritefile(HANDLE hDisk, unsigned long long sectorsize, unsigned long long index, unsigned long long start, unsigned long long len, unsigned long long disksize, char* tablestr, char*& buf, unsigned long long filenameindex, unsigned rw);
+int readreparse(HANDLE hDisk, unsigned long long sectorsize, unsigned long long index, unsigned long long disksize, char* tablestr, unsigned long long filenameindex, std::string*& data);
+int indexea(Eas& ea);
+int nextea(Eas& ea, unsigned long long& o, unsigned char& flags, std::string& name, std::string& value);
+int findea(Eas& ea, std::string name, unsigned char& flags, std::string& value);
+int setea(Eas& ea, std::string name, unsigned char flags, std::string value);
+unsigned long long easize(Eas& ea);
+int readea(HANDLE hDisk, unsigned long long sectorsize, unsigned long long index, unsigned long long disksize, char* tablestr, unsigned long long filenameindex, Eas*& ea);
+int trunfile(HANDLE hDisk, unsigned long sectorsize, unsigned long long& index, unsigned long tablesize, unsigned long long disksize, unsigned long long size, unsigned long long newsize, unsigned long long filenameindex, char* charmap, char*& tablestr, unsigned long long& usedblocks, PWSTR filename, char* filenames, unsigned long long filenamecount);
+void journalvarint(unsigned long long val);
+void journalbytes(char* bytes, unsigned long long len);
+void journalmark(unsigned long long filenameindex);
+void journalinfo(unsigned long long filenamecount);
+unsigned long journalcheck(char* bytes, unsigned long long len);
+int journalcommit(HANDLE hDisk, unsigned long sectorsize, unsigned long long disksize, char* tablestr, char* filenames, unsigned long long filenamecount);
+int journalcheckpoint(HANDLE hDisk, unsigned long sectorsize, char* charmap, unsigned long& tablesize, unsigned long long& extratablesize, unsigned long long disksize, unsigned long long& filenamecount, char*& filenames, char*& tablestr, char*& table);
+int setentry(char*& tablestr, unsigned long long filenamecount, unsigned long long filenameindex, char* entry, unsigned long long len);
+int loaddescriptors(HANDLE hDisk, unsigned long sectorsize, unsigned long long disksize, char* tablestr, char* filenames, unsigned long long filenamecount);
+int adddescriptor(HANDLE hDisk, unsigned long sectorsize, unsigned long tablesize, unsigned long long disksize, char* charmap, char*& tablestr, unsigned long long& usedblocks, unsigned long long& filenamecount, char*& filenames, std::string descriptor, unsigned long& id);
+unsigned long keepdescriptor(std::string descriptor);
+std::string& getdescriptor(unsigned long id);
+unsigned long long checkreparse(HANDLE hDisk, unsigned long sectorsize, unsigned long long disksize, char* tablestr, unsigned long long filenamecount);
+int replayjournal(HANDLE hDisk, unsigned long sectorsize, char* charmap, unsigned long long disksize, unsigned long long& filenamecount, char*& filenames, char*& tablestr, unsigned long long& replayed);
@@ -13,7 +13,7 @@
 char* charmap = (char*)"0123456789-,.; ";
 std::unordered_map<std::wstring, unsigned long long> opened = {};
 std::unordered_map<std::wstring, unsigned long long> allocationsizes = {};
-std::unordered_map<std::wstring, unsigned long long> filenameindexlist = {};
+std::wstring eastream = L":\x1f"; // Stream holding the packed EAs of a file, deletes and renames carry it along
 
 typedef struct
 {
@@ -28,8 +28,9 @@ typedef struct
 	char* TableStr;
 	ULONGLONG FilenameCount;
 	char* Filenames;
-	char* FileInfo;
 	ULONGLONG UsedBlocks;
+	HANDLE JournalThread;
+	HANDLE JournalEvent;
 } SPFS;
 
 typedef struct
@@ -352,57 +353,138 @@ static VOID GetParentName(PWSTR& FileName, PWSTR& Suffix)
 }
 
 static NTSTATUS FindDuplicate(SPFS* SpFs, PWSTR FileName)
-{
-	if (filenameindexlist[std::wstring(FileName)] != 0)
+{ // Case folded hash lookup, names differing only in case collide.
+	unsigned long long FilenameIndex = 0;
+	unsigned long long FilenameSTRIndex = 0;
+	getfilenameindex(FileName, SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
+	if (FilenameIndex < SpFs->FilenameCount)
 	{
 		return STATUS_OBJECT_NAME_COLLISION;
 	}
-	unsigned long long Offset = 0;
-	unsigned long long FileNameLen = wcslen(FileName), FileNameLenT = max(FileNameLen, 0xff);
-	PWSTR ALC = NULL;
-	PWSTR Filename = (PWSTR)calloc(FileNameLenT + 1, sizeof(wchar_t));
-	if (!Filename)
+
+	return STATUS_SUCCESS;
+}
+
+static Eas* FindEa(SPFS* SpFs, PWSTR FileName)
+{ // NULL when the file has no EAs. Use the result before the next write.
+	std::wstring Path = std::wstring(FileName) + eastream;
+	unsigned long long FilenameIndex = 0;
+	unsigned long long FilenameSTRIndex = 0;
+	getfilenameindex((PWSTR)Path.c_str(), SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
+	if (FilenameIndex >= SpFs->FilenameCount)
 	{
-		return STATUS_INSUFFICIENT_RESOURCES;
+		return NULL;
+	}
+	unsigned long long Index = gettablestrindex((PWSTR)Path.c_str(), SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
+	Eas* E = NULL;
+	if (readea(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->DiskSize, SpFs->TableStr, FilenameIndex, E))
+	{
+		return NULL;
 	}
+	return E;
+}
 
-	for (unsigned long long i = 0; i < SpFs->FilenameCount; i++)
+static std::string SddlToDescriptor(const std::string& Sddl)
+{ // Self-relative, empty when the SDDL does not parse.
+	PSECURITY_DESCRIPTOR S = NULL;
+	ULONG Size = 0;
+	std::string Descriptor = "";
+	if (ConvertStringSecurityDescriptorToSecurityDescriptorA(Sddl.c_str(), SDDL_REVISION_1, &S, &Size))
 	{
-		unsigned long long j = 0;
-		for (;; j++)
-		{
-			if (j > FileNameLenT - 3)
-			{
-				FileNameLenT += 0xff;
-				ALC = (PWSTR)realloc(Filename, (FileNameLenT + 1) * sizeof(wchar_t));
-				if (!ALC)
-				{
-					free(Filename);
-					return STATUS_INSUFFICIENT_RESOURCES;
-				}
-				Filename = ALC;
-				ALC = NULL;
-			}
-			if ((SpFs->Filenames[Offset + j] & 0xff) == 255 || (SpFs->Filenames[Offset + j] & 0xff) == 42)
-			{
-				Offset += j + 1;
-				break;
-			}
-			Filename[j] = SpFs->Filenames[Offset + j] & 0xff;
-		}
-		Filename[j] = 0;
+		Descriptor.assign((char*)S, Size);
+		LocalFree(S);
+	}
+	return Descriptor;
+}
 
-		if (!_wcsicmp(Filename, FileName) && wcslen(Filename) == FileNameLen)
+static std::string& FindSecurity(SPFS* SpFs, PWSTR SecurityName)
+{ // A security file is parsed once and keeps its id until it is written. Use the result before the next call.
+	unsigned long long FilenameIndex = 0;
+	unsigned long long FilenameSTRIndex = 0;
+	unsigned long long Id = 0;
+	if (SpFs->Table[0] & 32)
+	{ // Extended records keep the descriptor id with the file, files from before the switch still have a security file.
+		std::wstring Name = L"/" + std::wstring(SecurityName);
+		unsigned long DescriptorId = 0;
+		getfilenameindex((PWSTR)Name.c_str(), SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
+		chdescriptor(FilenameIndex, DescriptorId, 0);
+		if (DescriptorId)
 		{
-			free(Filename);
-			return STATUS_OBJECT_NAME_COLLISION;
+			return getdescriptor(DescriptorId);
 		}
 	}
+	getfilenameindex(SecurityName, SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
+	chsecurity(FilenameIndex, Id, 0);
+	if (Id)
+	{
+		return getdescriptor(Id);
+	}
 
-	free(Filename);
+	unsigned long long Index = gettablestrindex(SecurityName, SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
+	unsigned long long FileSize = 0;
+	getextentfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FilenameIndex, FileSize);
+	char* buf = (char*)calloc(FileSize + 1, 1);
+	if (!buf)
+	{
+		return getdescriptor(0);
+	}
+	readwritefile(SpFs->hDisk, SpFs->SectorSize, Index, 0, FileSize, SpFs->DiskSize, SpFs->TableStr, buf, FilenameIndex, 0);
+	Id = keepdescriptor(SddlToDescriptor(buf));
+	free(buf);
+	chsecurity(FilenameIndex, Id, 1);
+	return getdescriptor(Id);
+}
+
+static NTSTATUS SetDescriptor(SPFS* SpFs, PWSTR FileName, std::string Descriptor)
+{ // Extended records only, stores the descriptor once and points the file at it.
+	unsigned long long FilenameIndex = 0;
+	unsigned long long FilenameSTRIndex = 0;
+	unsigned long DescriptorId = 0;
+	if (adddescriptor(SpFs->hDisk, SpFs->SectorSize, SpFs->TableSize, SpFs->DiskSize, charmap, SpFs->TableStr, SpFs->UsedBlocks, SpFs->FilenameCount, SpFs->Filenames, Descriptor, DescriptorId))
+	{
+		return STATUS_DISK_FULL;
+	}
+	getfilenameindex(FileName, SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
+	chdescriptor(FilenameIndex, DescriptorId, 1);
 	return STATUS_SUCCESS;
 }
 
+static VOID DropSecurity(SPFS* SpFs, PWSTR SecurityName)
+{ // The security file is left over from before extended records, the descriptor id replaces it. The root one stays as the fallback.
+	unsigned long long FilenameIndex = 0;
+	unsigned long long FilenameSTRIndex = 0;
+	getfilenameindex(SecurityName, SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
+	if (!wcslen(SecurityName) || FilenameIndex >= SpFs->FilenameCount)
+	{
+		return;
+	}
+	unsigned long long Index = gettablestrindex(SecurityName, SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
+	unsigned long long FileSize = 0;
+	getextentfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FilenameIndex, FileSize);
+	trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, 0, FilenameIndex, charmap, SpFs->TableStr, SpFs->UsedBlocks, SecurityName, SpFs->Filenames, SpFs->FilenameCount);
+	deletefile(Index, FilenameIndex, FilenameSTRIndex, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr);
+}
+
+static VOID SpFsCommit(SPFS* SpFs)
+{ // Caller holds the operation guard.
+	if (journalcommit(SpFs->hDisk, SpFs->SectorSize, SpFs->DiskSize, SpFs->TableStr, SpFs->Filenames, SpFs->FilenameCount))
+	{
+		journalcheckpoint(SpFs->hDisk, SpFs->SectorSize, charmap, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->DiskSize, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
+	}
+}
+
+static DWORD WINAPI JournalThread(LPVOID Param)
+{ // Group commit, whatever the operations journaled in the last 10ms goes out as one write.
+	SPFS* SpFs = (SPFS*)Param;
+	while (WaitForSingleObject(SpFs->JournalEvent, 10) == WAIT_TIMEOUT)
+	{
+		AcquireSRWLockExclusive(&SpFs->FileSystem->OpGuardLock);
+		SpFsCommit(SpFs);
+		ReleaseSRWLockExclusive(&SpFs->FileSystem->OpGuardLock);
+	}
+	return 0;
+}
+
 static NTSTATUS GetFileInfoInternal(SPFS* SpFs, FSP_FSCTL_FILE_INFO* FileInfo, PWSTR FileName)
 {
 	unsigned long long Index = gettablestrindex(FileName, SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
@@ -410,9 +492,9 @@ static NTSTATUS GetFileInfoInternal(SPFS* SpFs, FSP_FSCTL_FILE_INFO* FileInfo, P
 	unsigned long long FilenameSTRIndex = 0;
 	unsigned long long FileSize = 0;
 	unsigned long winattrs = 0;
-	double LastAccessTime = 0;
-	double LastWriteTime = 0;
-	double CreationTime = 0;
+	unsigned long long LastAccessTime = 0;
+	unsigned long long LastWriteTime = 0;
+	unsigned long long CreationTime = 0;
 
 	unsigned long long FileNameLen = wcslen(FileName);
 	PWSTR NoStreamFileName = (PWSTR)calloc(FileNameLen + 1, sizeof(wchar_t));
@@ -428,31 +510,23 @@ static NTSTATUS GetFileInfoInternal(SPFS* SpFs, FSP_FSCTL_FILE_INFO* FileInfo, P
 	unsigned long long NoStreamFileNameIndex = 0;
 	unsigned long long NoStreamFileNameSTRIndex = 0;
 	getfilenameindex(NoStreamFileName, SpFs->Filenames, SpFs->FilenameCount, NoStreamFileNameIndex, NoStreamFileNameSTRIndex);
+	Eas* E = FindEa(SpFs, NoStreamFileName);
 	free(NoStreamFileName);
 
 	getfilenameindex(FileName, SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
-	chwinattrs(SpFs->FileInfo, SpFs->FilenameCount, FilenameIndex, winattrs, 0);
-	getfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FileSize);
-	chtime(SpFs->FileInfo, NoStreamFileNameIndex, LastAccessTime, 0);
-	chtime(SpFs->FileInfo, NoStreamFileNameIndex, LastWriteTime, 2);
-	chtime(SpFs->FileInfo, NoStreamFileNameIndex, CreationTime, 4);
-
-	UINT64 CTime = CreationTime * 10000000 + 116444736000000000;
-	UINT64 ATime = LastAccessTime * 10000000 + 116444736000000000;
-	UINT64 WTime = LastWriteTime * 10000000 + 116444736000000000;
+	chwinattrs(FilenameIndex, winattrs, 0);
+	getextentfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FilenameIndex, FileSize);
+	chtime(NoStreamFileNameIndex, LastAccessTime, 0);
+	chtime(NoStreamFileNameIndex, LastWriteTime, 2);
+	chtime(NoStreamFileNameIndex, CreationTime, 4);
 
 	ATTRtoattr(winattrs);
 	FileInfo->FileAttributes = winattrs;
 	if (FileInfo->FileAttributes & FILE_ATTRIBUTE_REPARSE_POINT)
 	{
-		char* buf = (char*)calloc(4, sizeof(char));
-		if (!buf)
-		{
-			return STATUS_INSUFFICIENT_RESOURCES;
-		}
-		readwritefile(SpFs->hDisk, SpFs->SectorSize, Index, 0, 4, SpFs->DiskSize, SpFs->TableStr, buf, SpFs->FileInfo, FilenameIndex, 0);
-		FileInfo->ReparseTag = *(unsigned long*)buf;
-		free(buf);
+		unsigned long Tag = 0;
+		chreparse(FilenameIndex, Tag, 0);
+		FileInfo->ReparseTag = Tag;
 	}
 	else
 	{
@@ -467,13 +541,13 @@ static NTSTATUS GetFileInfoInternal(SPFS* SpFs, FSP_FSCTL_FILE_INFO* FileInfo, P
 	{
 		FileInfo->AllocationSize = allocationsizes[Path];
 	}
-	FileInfo->CreationTime = CTime + (static_cast<unsigned long long>(2) * (CTime > 116444736000000000)) + (CTime == 279172874304) + (static_cast<unsigned long long>(3) * (CTime == 287762808896));
-	FileInfo->LastAccessTime = ATime + (static_cast<unsigned long long>(2) * (ATime > 116444736000000000)) + (ATime == 279172874304) + (static_cast<unsigned long long>(3) * (ATime == 287762808896));
-	FileInfo->LastWriteTime = WTime + (static_cast<unsigned long long>(2) * (WTime > 116444736000000000)) + (WTime == 279172874304) + (static_cast<unsigned long long>(3) * (WTime == 287762808896));
+	FileInfo->CreationTime = CreationTime;
+	FileInfo->LastAccessTime = LastAccessTime;
+	FileInfo->LastWriteTime = LastWriteTime;
 	FileInfo->ChangeTime = FileInfo->LastWriteTime;
 	FileInfo->IndexNumber = NoStreamFileNameIndex;
 	FileInfo->HardLinks = 0;
-	FileInfo->EaSize = 0;
+	FileInfo->EaSize = E ? (UINT32)easize(*E) : 0;
 
 	return STATUS_SUCCESS;
 }
@@ -487,9 +561,9 @@ static NTSTATUS GetVolumeInfo(FSP_FILE_SYSTEM* FileSystem, FSP_FSCTL_VOLUME_INFO
 	unsigned long long FilenameSTRIndex = 0;
 	char* buf = (char*)calloc(32, 1);
 
-	getfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FileSize);
 	getfilenameindex(PWSTR(L":"), SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
-	readwritefile(SpFs->hDisk, SpFs->SectorSize, Index, 0, FileSize, SpFs->DiskSize, SpFs->TableStr, buf, SpFs->FileInfo, FilenameIndex, 0);
+	getextentfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FilenameIndex, FileSize);
+	readwritefile(SpFs->hDisk, SpFs->SectorSize, Index, 0, FileSize, SpFs->DiskSize, SpFs->TableStr, buf, FilenameIndex, 0);
 
 	VolumeInfo->TotalSize = SpFs->DiskSize - static_cast<unsigned long long>(SpFs->TableSize) * SpFs->SectorSize - SpFs->SectorSize;
 	VolumeInfo->FreeSize = SpFs->DiskSize - static_cast<unsigned long long>(SpFs->TableSize) * SpFs->SectorSize - SpFs->SectorSize - SpFs->UsedBlocks * SpFs->SectorSize;
@@ -513,8 +587,8 @@ static NTSTATUS SetVolumeLabel_(FSP_FILE_SYSTEM* FileSystem, PWSTR Label, FSP_FS
 	unsigned long long LabelLen = wcslen(Label);
 
 	getfilenameindex(PWSTR(L":"), SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
-	getfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FileSize);
-	if (trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, LabelLen, FilenameIndex, charmap, SpFs->TableStr, SpFs->FileInfo, SpFs->UsedBlocks, PWSTR(L":"), SpFs->Filenames, SpFs->FilenameCount))
+	getextentfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FilenameIndex, FileSize);
+	if (trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, LabelLen, FilenameIndex, charmap, SpFs->TableStr, SpFs->UsedBlocks, PWSTR(L":"), SpFs->Filenames, SpFs->FilenameCount))
 	{
 		return STATUS_DISK_FULL;
 	}
@@ -527,8 +601,8 @@ static NTSTATUS SetVolumeLabel_(FSP_FILE_SYSTEM* FileSystem, PWSTR Label, FSP_FS
 	{
 		buf[i] = Label[i];
 	}
-	readwritefile(SpFs->hDisk, SpFs->SectorSize, Index, 0, LabelLen, SpFs->DiskSize, SpFs->TableStr, buf, SpFs->FileInfo, FilenameIndex, 1);
-	simptable(SpFs->hDisk, SpFs->SectorSize, charmap, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
+	readwritefile(SpFs->hDisk, SpFs->SectorSize, Index, 0, LabelLen, SpFs->DiskSize, SpFs->TableStr, buf, FilenameIndex, 1);
+	packtable(SpFs->SectorSize, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
 
 	VolumeInfo->TotalSize = SpFs->DiskSize - static_cast<unsigned long long>(SpFs->TableSize) * SpFs->SectorSize - SpFs->SectorSize;
 
@@ -537,10 +611,10 @@ static NTSTATUS SetVolumeLabel_(FSP_FILE_SYSTEM* FileSystem, PWSTR Label, FSP_FS
 	FilenameSTRIndex = 0;
 	getfilenameindex(PWSTR(L"/"), SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
 	Index = gettablestrindex(PWSTR(L"/"), SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
-	getfilesize(SpFs->SectorSize, Index, SpFs->TableStr, DirSize);
-	if (!trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, DirSize, DirSize + 1, FilenameIndex, charmap, SpFs->TableStr, SpFs->FileInfo, SpFs->UsedBlocks, PWSTR(L"/"), SpFs->Filenames, SpFs->FilenameCount))
+	getextentfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FilenameIndex, DirSize);
+	if (!trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, DirSize, DirSize + 1, FilenameIndex, charmap, SpFs->TableStr, SpFs->UsedBlocks, PWSTR(L"/"), SpFs->Filenames, SpFs->FilenameCount))
 	{
-		trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, DirSize + 1, DirSize, FilenameIndex, charmap, SpFs->TableStr, SpFs->FileInfo, SpFs->UsedBlocks, PWSTR(L"/"), SpFs->Filenames, SpFs->FilenameCount);
+		trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, DirSize + 1, DirSize, FilenameIndex, charmap, SpFs->TableStr, SpFs->UsedBlocks, PWSTR(L"/"), SpFs->Filenames, SpFs->FilenameCount);
 	}
 
 	VolumeInfo->FreeSize = SpFs->DiskSize - static_cast<unsigned long long>(SpFs->TableSize) * SpFs->SectorSize - SpFs->SectorSize - SpFs->UsedBlocks * SpFs->SectorSize;
@@ -581,29 +655,25 @@ static NTSTATUS GetReparsePoint(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext,
 		}
 		unsigned long long FilenameIndex = 0;
 		unsigned long long FilenameSTRIndex = 0;
-		unsigned long long FileSize = 0;
+		std::string* Data = NULL;
 		getfilenameindex(Filename, SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
 		unsigned long long Index = gettablestrindex(Filename, SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
-		getfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FileSize);
-		if (FileSize > *PSize)
+		if (readreparse(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->DiskSize, SpFs->TableStr, FilenameIndex, Data))
 		{
 			free(Filename);
 			free(FileInfo);
-			return STATUS_BUFFER_TOO_SMALL;
+			return STATUS_UNEXPECTED_IO_ERROR;
 		}
-		char* buf = (char*)calloc(FileSize, 1);
-		if (!buf)
+		if (Data->size() > *PSize)
 		{
 			free(Filename);
 			free(FileInfo);
-			return STATUS_INSUFFICIENT_RESOURCES;
+			return STATUS_BUFFER_TOO_SMALL;
 		}
-		readwritefile(SpFs->hDisk, SpFs->SectorSize, Index, 0, FileSize, SpFs->DiskSize, SpFs->TableStr, buf, SpFs->FileInfo, FilenameIndex, 0);
-		memcpy(Buffer, buf, FileSize);
-		*PSize = FileSize;
-		
+		memcpy(Buffer, Data->data(), Data->size());
+		*PSize = Data->size();
+
 		free(Filename);
-		free(buf);
 		free(FileInfo);
 		return STATUS_SUCCESS;
 	}
@@ -663,7 +733,7 @@ static NTSTATUS GetSecurityByName(FSP_FILE_SYSTEM* FileSystem, PWSTR FileName, P
 	if (PFileAttributes)
 	{
 		getfilenameindex(Filename, SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
-		chwinattrs(SpFs->FileInfo, SpFs->FilenameCount, FilenameIndex, winattrs, 0);
+		chwinattrs(FilenameIndex, winattrs, 0);
 		ATTRtoattr(winattrs);
 		*PFileAttributes = winattrs;
 	}
@@ -680,29 +750,19 @@ static NTSTATUS GetSecurityByName(FSP_FILE_SYSTEM* FileSystem, PWSTR FileName, P
 		RemoveFirst(SecurityName);
 		PWSTR Suffix = NULL;
 		RemoveStream(SecurityName, Suffix);
-		PSECURITY_DESCRIPTOR S;
-		FilenameIndex = 0;
-		FilenameSTRIndex = 0;
-		getfilenameindex(SecurityName, SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
-		unsigned long long Index = gettablestrindex(SecurityName, SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
+		std::string& Descriptor = FindSecurity(SpFs, SecurityName);
 		free(SecurityName);
-		unsigned long long FileSize = 0;
-		getfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FileSize);
-		if (*PSecurityDescriptorSize < FileSize)
+		if (*PSecurityDescriptorSize < Descriptor.size())
 		{
-			*PSecurityDescriptorSize = FileSize;
+			*PSecurityDescriptorSize = Descriptor.size();
 			free(Filename);
 			return STATUS_BUFFER_OVERFLOW;
 		}
-		char* buf = (char*)calloc(FileSize + 1, 1);
-		readwritefile(SpFs->hDisk, SpFs->SectorSize, Index, 0, FileSize, SpFs->DiskSize, SpFs->TableStr, buf, SpFs->FileInfo, FilenameIndex, 0);
-		ConvertStringSecurityDescriptorToSecurityDescriptorA(buf, SDDL_REVISION_1, &S, (PULONG)PSecurityDescriptorSize);
+		*PSecurityDescriptorSize = Descriptor.size();
 		if (SecurityDescriptor)
 		{
-			memcpy(SecurityDescriptor, S, *PSecurityDescriptorSize);
+			memcpy(SecurityDescriptor, Descriptor.data(), Descriptor.size());
 		}
-		free(buf);
-		FspDeleteSecurityDescriptor(S, (NTSTATUS(*)())ConvertStringSecurityDescriptorToSecurityDescriptorA);
 	}
 
 	free(Filename);
@@ -760,8 +820,8 @@ static NTSTATUS Create(FSP_FILE_SYSTEM* FileSystem, PWSTR FileName, UINT32 Creat
 	GetParentName(ParentDirectory, Suffix);
 	unsigned long long ParentIndex = gettablestrindex(ParentDirectory, SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
 	getfilenameindex(ParentDirectory, SpFs->Filenames, SpFs->FilenameCount, ParentDirectoryIndex, ParentDirectorySTRIndex);
-	chgid(SpFs->FileInfo, SpFs->FilenameCount, ParentDirectoryIndex, gid, 0);
-	chuid(SpFs->FileInfo, SpFs->FilenameCount, ParentDirectoryIndex, uid, 0);
+	chgid(ParentDirectoryIndex, gid, 0);
+	chuid(ParentDirectoryIndex, uid, 0);
 	unsigned long long ParentDirectoryLen = wcslen(ParentDirectory);
 	PWSTR SecurityParentName = (PWSTR)calloc(ParentDirectoryLen + 1, sizeof(wchar_t));
 	if (!SecurityParentName)
@@ -772,9 +832,36 @@ static NTSTATUS Create(FSP_FILE_SYSTEM* FileSystem, PWSTR FileName, UINT32 Creat
 	RemoveFirst(SecurityParentName);
 	free(ParentDirectory);
 
-	createfile(Filename, gid, uid, 448 + (FileAttributes & FILE_ATTRIBUTE_DIRECTORY) * 16429, winattrs, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, charmap, SpFs->TableStr);
+	createfile(Filename, gid, uid, 448 + (FileAttributes & FILE_ATTRIBUTE_DIRECTORY) * 16429, winattrs, SpFs->FilenameCount, SpFs->Filenames, charmap, SpFs->TableStr);
 
-	if (std::wstring(Filename).find(L":") == std::string::npos)
+	if (SpFs->Table[0] & 32 && std::wstring(Filename).find(L":") == std::string::npos)
+	{ // No security file, a protected DACL keeps the given descriptor and anything else inherits the parent's.
+		std::string Descriptor = "";
+		LPSTR Sddl = NULL;
+		if (ConvertSecurityDescriptorToStringSecurityDescriptorA(SecurityDescriptor, SDDL_REVISION_1, OWNER_SECURITY_INFORMATION | GROUP_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION, &Sddl, NULL))
+		{
+			if (std::string(Sddl).find("D:P") != std::string::npos)
+			{
+				Descriptor = SddlToDescriptor(Sddl);
+			}
+			LocalFree(Sddl);
+		}
+		if (Descriptor.empty())
+		{
+			Descriptor = FindSecurity(SpFs, SecurityParentName);
+		}
+		if (!NT_SUCCESS(SetDescriptor(SpFs, Filename, Descriptor)))
+		{
+			unsigned long long Index = gettablestrindex(Filename, SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
+			unsigned long long FileIndex = 0;
+			unsigned long long FileSTRIndex = 0;
+			getfilenameindex(Filename, SpFs->Filenames, SpFs->FilenameCount, FileIndex, FileSTRIndex);
+			deletefile(Index, FileIndex, FileSTRIndex, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr);
+			free(SecurityParentName);
+			return STATUS_DISK_FULL;
+		}
+	}
+	else if (std::wstring(Filename).find(L":") == std::string::npos)
 	{
 		PWSTR SecurityName = (PWSTR)calloc(FileNameLen + 1, sizeof(wchar_t));
 		if (!SecurityName)
@@ -801,7 +888,7 @@ static NTSTATUS Create(FSP_FILE_SYSTEM* FileSystem, PWSTR FileName, UINT32 Creat
 			return STATUS_INSUFFICIENT_RESOURCES;
 		}
 
-		createfile(SecurityName, gid, uid, 448, 2048, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, charmap, SpFs->TableStr);
+		createfile(SecurityName, gid, uid, 448, 2048, SpFs->FilenameCount, SpFs->Filenames, charmap, SpFs->TableStr);
 		unsigned long long SecurityIndex = gettablestrindex(SecurityName, SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
 		unsigned long long SecurityFileIndex = 0;
 		unsigned long long SecurityFileSTRIndex = 0;
@@ -815,7 +902,7 @@ static NTSTATUS Create(FSP_FILE_SYSTEM* FileSystem, PWSTR FileName, UINT32 Creat
 			unsigned long long SecurityParentDirectoryIndex = 0;
 			unsigned long long SecurityParentDirectorySTRIndex = 0;
 			getfilenameindex(SecurityParentName, SpFs->Filenames, SpFs->FilenameCount, SecurityParentDirectoryIndex, SecurityParentDirectorySTRIndex);
-			getfilesize(SpFs->SectorSize, SecurityParentIndex, SpFs->TableStr, FileSize);
+			getextentfilesize(SpFs->SectorSize, SecurityParentIndex, SpFs->TableStr, SecurityParentDirectoryIndex, FileSize);
 			if (*BufLen < FileSize)
 			{
 				LPSTR ALC = (LPSTR)realloc(*Buf, FileSize);
@@ -831,32 +918,32 @@ static NTSTATUS Create(FSP_FILE_SYSTEM* FileSystem, PWSTR FileName, UINT32 Creat
 				ALC = NULL;
 			}
 			*BufLen = FileSize;
-			readwritefile(SpFs->hDisk, SpFs->SectorSize, SecurityParentIndex, 0, FileSize, SpFs->DiskSize, SpFs->TableStr, *Buf, SpFs->FileInfo, SecurityParentDirectoryIndex, 0);
+			readwritefile(SpFs->hDisk, SpFs->SectorSize, SecurityParentIndex, 0, FileSize, SpFs->DiskSize, SpFs->TableStr, *Buf, SecurityParentDirectoryIndex, 0);
 		}
-		if (trunfile(SpFs->hDisk, SpFs->SectorSize, SecurityIndex, SpFs->TableSize, SpFs->DiskSize, 0, *BufLen, SecurityFileIndex, charmap, SpFs->TableStr, SpFs->FileInfo, SpFs->UsedBlocks, SecurityName, SpFs->Filenames, SpFs->FilenameCount))
+		if (trunfile(SpFs->hDisk, SpFs->SectorSize, SecurityIndex, SpFs->TableSize, SpFs->DiskSize, 0, *BufLen, SecurityFileIndex, charmap, SpFs->TableStr, SpFs->UsedBlocks, SecurityName, SpFs->Filenames, SpFs->FilenameCount))
 		{
 			unsigned long long Index = gettablestrindex(Filename, SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
 			unsigned long long FileIndex = 0;
 			unsigned long long FileSTRIndex = 0;
 			getfilenameindex(Filename, SpFs->Filenames, SpFs->FilenameCount, FileIndex, FileSTRIndex);
-			getfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FileSize);
-			trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, 0, FileIndex, charmap, SpFs->TableStr, SpFs->FileInfo, SpFs->UsedBlocks, Filename, SpFs->Filenames, SpFs->FilenameCount);
-			deletefile(Index, FileIndex, FileSTRIndex, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr);
-			deletefile(SecurityIndex, SecurityFileIndex, SecurityFileSTRIndex, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr);
+			getextentfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FileIndex, FileSize);
+			trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, 0, FileIndex, charmap, SpFs->TableStr, SpFs->UsedBlocks, Filename, SpFs->Filenames, SpFs->FilenameCount);
+			deletefile(Index, FileIndex, FileSTRIndex, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr);
+			deletefile(SecurityIndex, SecurityFileIndex, SecurityFileSTRIndex, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr);
 			free(SecurityParentName);
 			free(SecurityName);
 			free(BufLen);
 			free(Buf);
 			return STATUS_DISK_FULL;
 		}
-		readwritefile(SpFs->hDisk, SpFs->SectorSize, SecurityIndex, 0, *BufLen, SpFs->DiskSize, SpFs->TableStr, *Buf, SpFs->FileInfo, SecurityFileIndex, 1);
+		readwritefile(SpFs->hDisk, SpFs->SectorSize, SecurityIndex, 0, *BufLen, SpFs->DiskSize, SpFs->TableStr, *Buf, SecurityFileIndex, 1);
 		free(SecurityName);
 		free(BufLen);
 		free(Buf);
 	}
 
 	free(SecurityParentName);
-	simptable(SpFs->hDisk, SpFs->SectorSize, charmap, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
+	packtable(SpFs->SectorSize, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
 
 	std::wstring Path = Filename;
 	opened[Path]++;
@@ -906,20 +993,10 @@ static NTSTATUS Overwrite(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, UINT32
 	getfilenameindex(FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
 	unsigned long long Index = gettablestrindex(FileCtx->Path, SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
 
-	unsigned long long Offset = 0;
-	unsigned long long FileNameLen = wcslen(FileCtx->Path), FileNameLenT = max(FileNameLen, 0xff);
-	PWSTR ALC = NULL;
-	PWSTR TempFilename = (PWSTR)calloc(FileNameLenT + 1, sizeof(wchar_t));
-	if (!TempFilename)
-	{
-		return STATUS_INSUFFICIENT_RESOURCES;
-	}
-
-	unsigned long long O = 0;
-	PWSTR FileNameNoStream = (PWSTR)calloc(FileNameLenT + 1, sizeof(wchar_t));
+	unsigned long long FileNameLen = wcslen(FileCtx->Path);
+	PWSTR FileNameNoStream = (PWSTR)calloc(FileNameLen + 1, sizeof(wchar_t));
 	if (!FileNameNoStream)
 	{
-		free(TempFilename);
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
 
@@ -929,96 +1006,51 @@ static NTSTATUS Overwrite(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, UINT32
 	unsigned long long NoStreamFileNameIndex = 0;
 	unsigned long long NoStreamFileNameSTRIndex = 0;
 	getfilenameindex(FileNameNoStream, SpFs->Filenames, SpFs->FilenameCount, NoStreamFileNameIndex, NoStreamFileNameSTRIndex);
-	std::wstring Path = TempFilename;
+	free(FileNameNoStream);
 	unsigned long long FileSize = 0;
 
-	for (unsigned long long i = 0; i < SpFs->FilenameCount + O; i++)
+	std::map<std::string, std::string> Streams = getstreamindex(FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount); // Copy, the deletes below change it
+	for (auto& Stream : Streams)
 	{
-		unsigned long long j = 0;
-		for (;; j++)
+		std::wstring Path = std::wstring(FileCtx->Path) + L":";
+		for (unsigned long long i = 0; i < Stream.second.size(); i++)
 		{
-			if (j > FileNameLenT - 3)
-			{
-				FileNameLenT += 0xff;
-				ALC = (PWSTR)realloc(TempFilename, (FileNameLenT + 1) * sizeof(wchar_t));
-				if (!ALC)
-				{
-					free(TempFilename);
-					free(FileNameNoStream);
-					return STATUS_INSUFFICIENT_RESOURCES;
-				}
-				TempFilename = ALC;
-				ALC = NULL;
-				ALC = (PWSTR)realloc(FileNameNoStream, (FileNameLenT + 1) * sizeof(wchar_t));
-				if (!ALC)
-				{
-					free(TempFilename);
-					free(FileNameNoStream);
-					return STATUS_INSUFFICIENT_RESOURCES;
-				}
-				FileNameNoStream = ALC;
-				ALC = NULL;
-			}
-			if ((SpFs->Filenames[Offset + j] & 0xff) == 255 || (SpFs->Filenames[Offset + j] & 0xff) == 42)
-			{
-				Offset += j + 1;
-				break;
-			}
-			TempFilename[j] = SpFs->Filenames[Offset + j] & 0xff;
+			Path += (wchar_t)(Stream.second[i] & 0xff);
 		}
-		TempFilename[j] = 0;
-
-		memcpy(FileNameNoStream, TempFilename, (j + 1) * sizeof(wchar_t));
-		RemoveStream(FileNameNoStream, Suffix);
-		if (!_wcsicmp(FileNameNoStream, FileCtx->Path) && wcslen(FileNameNoStream) == FileNameLen)
+		if (!opened[Path])
 		{
-			Path = TempFilename;
-			if (Path.find(L":") != std::string::npos)
-			{
-				if (!opened[Path])
-				{
-					TempFilenameIndex = 0;
-					TempFilenameSTRIndex = 0;
-					getfilenameindex(TempFilename, SpFs->Filenames, SpFs->FilenameCount, TempFilenameIndex, TempFilenameSTRIndex);
-					TempIndex = gettablestrindex(TempFilename, SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
-					getfilesize(SpFs->SectorSize, TempIndex, SpFs->TableStr, FileSize);
-					trunfile(SpFs->hDisk, SpFs->SectorSize, TempIndex, SpFs->TableSize, SpFs->DiskSize, FileSize, 0, TempFilenameIndex, charmap, SpFs->TableStr, SpFs->FileInfo, SpFs->UsedBlocks, TempFilename, SpFs->Filenames, SpFs->FilenameCount);
-					deletefile(TempIndex, TempFilenameIndex, TempFilenameSTRIndex, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr);
-					Offset -= wcslen(TempFilename) + 1;
-					O++;
-				}
-			}
+			TempFilenameIndex = 0;
+			TempFilenameSTRIndex = 0;
+			getfilenameindex((PWSTR)Path.c_str(), SpFs->Filenames, SpFs->FilenameCount, TempFilenameIndex, TempFilenameSTRIndex);
+			TempIndex = gettablestrindex((PWSTR)Path.c_str(), SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
+			getextentfilesize(SpFs->SectorSize, TempIndex, SpFs->TableStr, TempFilenameIndex, FileSize);
+			trunfile(SpFs->hDisk, SpFs->SectorSize, TempIndex, SpFs->TableSize, SpFs->DiskSize, FileSize, 0, TempFilenameIndex, charmap, SpFs->TableStr, SpFs->UsedBlocks, (PWSTR)Path.c_str(), SpFs->Filenames, SpFs->FilenameCount);
+			deletefile(TempIndex, TempFilenameIndex, TempFilenameSTRIndex, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr);
 		}
 	}
 
-	free(TempFilename);
-	free(FileNameNoStream);
-
 	if (ReplaceFileAttributes)
 	{
 		unsigned long winattrs = FileAttributes;
 		attrtoATTR(winattrs);
-		chwinattrs(SpFs->FileInfo, SpFs->FilenameCount, FilenameIndex, winattrs, 1);
+		chwinattrs(FilenameIndex, winattrs, 1);
 	}
 	else
 	{
 		unsigned long winattrs = 0;
-		chwinattrs(SpFs->FileInfo, SpFs->FilenameCount, FilenameIndex, winattrs, 0);
+		chwinattrs(FilenameIndex, winattrs, 0);
 		ATTRtoattr(winattrs);
 		winattrs |= FileAttributes | 32;
 		attrtoATTR(winattrs);
-		chwinattrs(SpFs->FileInfo, SpFs->FilenameCount, FilenameIndex, winattrs, 1);
+		chwinattrs(FilenameIndex, winattrs, 1);
 	}
 
-	FILETIME ltime;
-	GetSystemTimeAsFileTime(&ltime);
-	LONGLONG pltime = ((PLARGE_INTEGER)&ltime)->QuadPart;
-	double LTime = (double)(pltime - 116444736000000000) / 10000000;
-	chtime(SpFs->FileInfo, NoStreamFileNameIndex, LTime, 1);
-	chtime(SpFs->FileInfo, NoStreamFileNameIndex, LTime, 3);
-	chtime(SpFs->FileInfo, NoStreamFileNameIndex, LTime, 5);
+	unsigned long long LTime = currenttime();
+	chtime(NoStreamFileNameIndex, LTime, 1);
+	chtime(NoStreamFileNameIndex, LTime, 3);
+	chtime(NoStreamFileNameIndex, LTime, 5);
 
-	simptable(SpFs->hDisk, SpFs->SectorSize, charmap, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
+	packtable(SpFs->SectorSize, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
 	return GetFileInfoInternal(SpFs, FileInfo, FileCtx->Path);
 }
 
@@ -1126,7 +1158,7 @@ static VOID Cleanup(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, PWSTR FileNa
 	unsigned long winattrs = 0;
 
 	getfilenameindex(FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
-	chwinattrs(SpFs->FileInfo, SpFs->FilenameCount, FilenameIndex, winattrs, 0);
+	chwinattrs(FilenameIndex, winattrs, 0);
 	ATTRtoattr(winattrs);
 
 	unsigned long long FileNameLen = wcslen(FileCtx->Path);
@@ -1149,23 +1181,20 @@ static VOID Cleanup(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, PWSTR FileNa
 		{
 			winattrs |= FILE_ATTRIBUTE_ARCHIVE;
 			attrtoATTR(winattrs);
-			chwinattrs(SpFs->FileInfo, SpFs->FilenameCount, FilenameIndex, winattrs, 1);
+			chwinattrs(FilenameIndex, winattrs, 1);
 		}
 	}
 
-	FILETIME ltime;
-	GetSystemTimeAsFileTime(&ltime);
-	LONGLONG pltime = ((PLARGE_INTEGER)&ltime)->QuadPart;
-	double LTime = (double)(pltime - 116444736000000000) / 10000000;
+	unsigned long long LTime = currenttime();
 
 	if (Flags & FspCleanupSetLastAccessTime)
 	{
-		chtime(SpFs->FileInfo, NoStreamFileNameIndex, LTime, 1);
+		touchatime(NoStreamFileNameIndex, LTime);
 	}
 
 	if (Flags & FspCleanupSetLastWriteTime || Flags & FspCleanupSetChangeTime)
 	{
-		chtime(SpFs->FileInfo, NoStreamFileNameIndex, LTime, 3);
+		chtime(NoStreamFileNameIndex, LTime, 3);
 	}
 
 	if (Flags & FspCleanupDelete)
@@ -1178,9 +1207,9 @@ static VOID Cleanup(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, PWSTR FileNa
 			}
 		}
 		unsigned long long FileSize = 0;
-		getfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FileSize);
-		trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, 0, FilenameIndex, charmap, SpFs->TableStr, SpFs->FileInfo, SpFs->UsedBlocks, FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount);
-		deletefile(Index, FilenameIndex, FilenameSTRIndex, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr);
+		getextentfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FilenameIndex, FileSize);
+		trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, 0, FilenameIndex, charmap, SpFs->TableStr, SpFs->UsedBlocks, FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount);
+		deletefile(Index, FilenameIndex, FilenameSTRIndex, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr);
 		if (std::wstring(FileCtx->Path).find(L":") != std::string::npos)
 		{
 			return;
@@ -1189,88 +1218,34 @@ static VOID Cleanup(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, PWSTR FileNa
 		FilenameIndex = 0;
 		FilenameSTRIndex = 0;
 		getfilenameindex(FileCtx->Path + 1, SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
-		getfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FileSize);
-		trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, 0, FilenameIndex, charmap, SpFs->TableStr, SpFs->FileInfo, SpFs->UsedBlocks, FileCtx->Path + 1, SpFs->Filenames, SpFs->FilenameCount);
-		deletefile(Index, FilenameIndex, FilenameSTRIndex, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr);
+		if (FilenameIndex < SpFs->FilenameCount)
+		{ // Files made with extended records have no security file
+			getextentfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FilenameIndex, FileSize);
+			trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, 0, FilenameIndex, charmap, SpFs->TableStr, SpFs->UsedBlocks, FileCtx->Path + 1, SpFs->Filenames, SpFs->FilenameCount);
+			deletefile(Index, FilenameIndex, FilenameSTRIndex, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr);
+		}
 
 		unsigned long long TempIndex = 0;
 		unsigned long long TempFilenameIndex = 0;
 		unsigned long long TempFilenameSTRIndex = 0;
-		unsigned long long Offset = 0;
-		unsigned long long O = 0;
-		unsigned long long FileNameLen = wcslen(FileCtx->Path), FileNameLenT = max(FileNameLen, 0xff);
-		PWSTR ALC = NULL;
-		PWSTR Filename = (PWSTR)calloc(FileNameLenT + 1, sizeof(wchar_t));
-		if (!Filename)
-		{
-			return;
-		}
-		PWSTR FileNameNoStream = (PWSTR)calloc(FileNameLenT + 1, sizeof(wchar_t));
-		if (!FileNameNoStream)
-		{
-			free(Filename);
-			return;
-		}
-
-		for (unsigned long long i = 0; i < SpFs->FilenameCount + O; i++)
+		std::map<std::string, std::string> Streams = getstreamindex(FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount); // Copy, the deletes below change it
+		for (auto& Stream : Streams)
 		{
-			unsigned long long j = 0;
-			for (;; j++)
-			{
-				if (j > FileNameLenT - 3)
-				{
-					FileNameLenT += 0xff;
-					ALC = (PWSTR)realloc(Filename, (FileNameLenT + 1) * sizeof(wchar_t));
-					if (!ALC)
-					{
-						free(Filename);
-						free(FileNameNoStream);
-						return;
-					}
-					Filename = ALC;
-					ALC = NULL;
-					ALC = (PWSTR)realloc(FileNameNoStream, (FileNameLenT + 1) * sizeof(wchar_t));
-					if (!ALC)
-					{
-						free(Filename);
-						free(FileNameNoStream);
-						return;
-					}
-					FileNameNoStream = ALC;
-					ALC = NULL;
-				}
-				if ((SpFs->Filenames[Offset + j] & 0xff) == 255 || (SpFs->Filenames[Offset + j] & 0xff) == 42)
-				{
-					Offset += j + 1;
-					break;
-				}
-				Filename[j] = SpFs->Filenames[Offset + j] & 0xff;
-			}
-			Filename[j] = 0;
-
-			memcpy(FileNameNoStream, Filename, (j + 1) * sizeof(wchar_t));
-			RemoveStream(FileNameNoStream, Suffix);
-			if (!_wcsicmp(FileNameNoStream, FileCtx->Path) && wcslen(FileNameNoStream) == FileNameLen)
+			std::wstring Filename = std::wstring(FileCtx->Path) + L":";
+			for (unsigned long long i = 0; i < Stream.second.size(); i++)
 			{
-				if (std::wstring(Filename).find(L":") != std::string::npos)
-				{
-					TempFilenameIndex = 0;
-					TempFilenameSTRIndex = 0;
-					getfilenameindex(Filename, SpFs->Filenames, SpFs->FilenameCount, TempFilenameIndex, TempFilenameSTRIndex);
-					TempIndex = gettablestrindex(Filename, SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
-					getfilesize(SpFs->SectorSize, TempIndex, SpFs->TableStr, FileSize);
-					trunfile(SpFs->hDisk, SpFs->SectorSize, TempIndex, SpFs->TableSize, SpFs->DiskSize, FileSize, 0, TempFilenameIndex, charmap, SpFs->TableStr, SpFs->FileInfo, SpFs->UsedBlocks, Filename, SpFs->Filenames, SpFs->FilenameCount);
-					deletefile(TempIndex, TempFilenameIndex, TempFilenameSTRIndex, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr);
-					Offset -= wcslen(Filename) + 1;
-					O++;
-				}
+				Filename += (wchar_t)(Stream.second[i] & 0xff);
 			}
+			TempFilenameIndex = 0;
+			TempFilenameSTRIndex = 0;
+			getfilenameindex((PWSTR)Filename.c_str(), SpFs->Filenames, SpFs->FilenameCount, TempFilenameIndex, TempFilenameSTRIndex);
+			TempIndex = gettablestrindex((PWSTR)Filename.c_str(), SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
+			getextentfilesize(SpFs->SectorSize, TempIndex, SpFs->TableStr, TempFilenameIndex, FileSize);
+			trunfile(SpFs->hDisk, SpFs->SectorSize, TempIndex, SpFs->TableSize, SpFs->DiskSize, FileSize, 0, TempFilenameIndex, charmap, SpFs->TableStr, SpFs->UsedBlocks, (PWSTR)Filename.c_str(), SpFs->Filenames, SpFs->FilenameCount);
+			deletefile(TempIndex, TempFilenameIndex, TempFilenameSTRIndex, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr);
 		}
 
-		free(Filename);
-		free(FileNameNoStream);
-
-		simptable(SpFs->hDisk, SpFs->SectorSize, charmap, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
+		packtable(SpFs->SectorSize, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
 	}
 
 	return;
@@ -1308,15 +1283,15 @@ static NTSTATUS Read(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, PVOID Buffe
 	unsigned long long FileNameIndex = 0;
 	unsigned long long FileNameSTRIndex = 0;
 
-	getfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FileSize);
+	getfilenameindex(FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount, FileNameIndex, FileNameSTRIndex);
+	getextentfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FileNameIndex, FileSize);
 	if (Offset >= FileSize)
 	{
 		return STATUS_END_OF_FILE;
 	}
 	Length = min(Length, FileSize - Offset);
-	getfilenameindex(FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount, FileNameIndex, FileNameSTRIndex);
 	char* Buf = (char*)Buffer;
-	readwritefile(SpFs->hDisk, SpFs->SectorSize, Index, Offset, Length, SpFs->DiskSize, SpFs->TableStr, Buf, SpFs->FileInfo, FileNameIndex, 0);
+	readwritefile(SpFs->hDisk, SpFs->SectorSize, Index, Offset, Length, SpFs->DiskSize, SpFs->TableStr, Buf, FileNameIndex, 0);
 	*PBytesTransffered = Length;
 
 	return STATUS_SUCCESS;
@@ -1334,22 +1309,22 @@ static NTSTATUS Write(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, PVOID Buff
 	unsigned long long FileNameSTRIndex = 0;
 
 	getfilenameindex(FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount, FileNameIndex, FileNameSTRIndex);
-	getfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FileSize);
+	getextentfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FileNameIndex, FileSize);
 	if (WriteToEndOfFile)
 	{
 		Offset = FileSize;
 	}
 	if (Offset + Length > FileSize)
 	{
-		if (trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, Offset + Length, FileNameIndex, charmap, SpFs->TableStr, SpFs->FileInfo, SpFs->UsedBlocks, FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount))
+		if (trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, Offset + Length, FileNameIndex, charmap, SpFs->TableStr, SpFs->UsedBlocks, FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount))
 		{
 			return STATUS_DISK_FULL;
 		}
-		simptable(SpFs->hDisk, SpFs->SectorSize, charmap, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
+		packtable(SpFs->SectorSize, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
 	}
 
 	char* Buf = (char*)Buffer;
-	readwritefile(SpFs->hDisk, SpFs->SectorSize, Index, Offset, Length, SpFs->DiskSize, SpFs->TableStr, Buf, SpFs->FileInfo, FileNameIndex, 1);
+	readwritefile(SpFs->hDisk, SpFs->SectorSize, Index, Offset, Length, SpFs->DiskSize, SpFs->TableStr, Buf, FileNameIndex, 1);
 	*PBytesTransferred = Length;
 	Result = GetFileInfoInternal(SpFs, FileInfo, FileCtx->Path);
 
@@ -1361,6 +1336,13 @@ static NTSTATUS Flush(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, FSP_FSCTL_
 	SPFS* SpFs = (SPFS*)FileSystem->UserContext;
 	SPFS_FILE_CONTEXT* FileCtx = (SPFS_FILE_CONTEXT*)FileContext;
 
+	SpFsCommit(SpFs);
+
+	if (!FileCtx)
+	{ // Volume flush
+		return STATUS_SUCCESS;
+	}
+
 	return GetFileInfoInternal(SpFs, FileInfo, FileCtx->Path);
 }
 
@@ -1399,26 +1381,23 @@ static NTSTATUS SetBasicInfo(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, UIN
 	if (winattrs != INVALID_FILE_ATTRIBUTES)
 	{
 		attrtoATTR(winattrs);
-		chwinattrs(SpFs->FileInfo, SpFs->FilenameCount, FilenameIndex, winattrs, 1);
+		chwinattrs(FilenameIndex, winattrs, 1);
 	}
 
 	if (LastAccessTime)
 	{
-		double ATime = (LastAccessTime - static_cast<double>(116444736000000000)) / 10000000;
-		chtime(SpFs->FileInfo, NoStreamFileNameIndex, ATime, 1);
+		chtime(NoStreamFileNameIndex, LastAccessTime, 1);
 	}
 
 	if (LastWriteTime || ChangeTime)
 	{
 		LastWriteTime = max(LastWriteTime, ChangeTime);
-		double WTime = (LastWriteTime - static_cast<double>(116444736000000000)) / 10000000;
-		chtime(SpFs->FileInfo, NoStreamFileNameIndex, WTime, 3);
+		chtime(NoStreamFileNameIndex, LastWriteTime, 3);
 	}
 
 	if (CreationTime)
 	{
-		double CTime = (CreationTime - static_cast<double>(116444736000000000)) / 10000000;
-		chtime(SpFs->FileInfo, NoStreamFileNameIndex, CTime, 5);
+		chtime(NoStreamFileNameIndex, CreationTime, 5);
 	}
 
 	return GetFileInfoInternal(SpFs, FileInfo, FileCtx->Path);
@@ -1437,12 +1416,12 @@ static NTSTATUS SetFileSize(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, UINT
 		unsigned long long FileNameSTRIndex = 0;
 
 		getfilenameindex(FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount, FileNameIndex, FileNameSTRIndex);
-		getfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FileSize);
-		if (trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, NewSize, FileNameIndex, charmap, SpFs->TableStr, SpFs->FileInfo, SpFs->UsedBlocks, FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount))
+		getextentfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FileNameIndex, FileSize);
+		if (trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, NewSize, FileNameIndex, charmap, SpFs->TableStr, SpFs->UsedBlocks, FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount))
 		{
 			return STATUS_DISK_FULL;
 		}
-		simptable(SpFs->hDisk, SpFs->SectorSize, charmap, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
+		packtable(SpFs->SectorSize, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
 	}
 
 	return GetFileInfoInternal(SpFs, FileInfo, FileCtx->Path);
@@ -1538,7 +1517,10 @@ static NTSTATUS Rename(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, PWSTR Fil
 	memcpy(NewSecurityName, NewFilename, NewFileNameLen * sizeof(wchar_t));
 	RemoveFirst(NewSecurityName);
 	RemoveStream(NewSecurityName, Suffix);
-	renamefile(SecurityName, NewSecurityName, FilenameSTRIndex, SpFs->Filenames);
+	if (FilenameIndex < SpFs->FilenameCount)
+	{ // Files made with extended records have no security file
+		renamefile(SecurityName, NewSecurityName, FilenameSTRIndex, SpFs->Filenames);
+	}
 
 	unsigned long long Offset = 0;
 	unsigned long long FileNameLenT = max(FileNameLen, 0xff);
@@ -1643,7 +1625,10 @@ static NTSTATUS Rename(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, PWSTR Fil
 					TempFilenameIndex = 0;
 					TempFilenameSTRIndex = 0;
 					getfilenameindex(TempFilename + 1, SpFs->Filenames, SpFs->FilenameCount, TempFilenameIndex, TempFilenameSTRIndex);
-					renamefile(TempFilename + 1, (PWSTR)(std::wstring(FileNameParent).replace(0, FileNameLen, NewFilename) + L"/" + FileNameSuffix).c_str() + 1, TempFilenameSTRIndex, SpFs->Filenames);
+					if (TempFilenameIndex < SpFs->FilenameCount)
+					{
+						renamefile(TempFilename + 1, (PWSTR)(std::wstring(FileNameParent).replace(0, FileNameLen, NewFilename) + L"/" + FileNameSuffix).c_str() + 1, TempFilenameSTRIndex, SpFs->Filenames);
+					}
 				}
 				Offset += wcslen(std::wstring(FileNameParent).replace(0, FileNameLen, NewFilename).c_str());
 				Offset -= FileNameLen;
@@ -1723,11 +1708,15 @@ static NTSTATUS Rename(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, PWSTR Fil
 				TempFilenameSTRIndex = 0;
 				getfilenameindex(TempFilename, SpFs->Filenames, SpFs->FilenameCount, TempFilenameIndex, TempFilenameSTRIndex);
 				TempIndex = gettablestrindex(TempFilename, SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
-				getfilesize(SpFs->SectorSize, TempIndex, SpFs->TableStr, FileSize);
-				trunfile(SpFs->hDisk, SpFs->SectorSize, TempIndex, SpFs->TableSize, SpFs->DiskSize, FileSize, 0, TempFilenameIndex, charmap, SpFs->TableStr, SpFs->FileInfo, SpFs->UsedBlocks, TempFilename, SpFs->Filenames, SpFs->FilenameCount);
-				deletefile(TempIndex, TempFilenameIndex, TempFilenameSTRIndex, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr);
-				Offset -= wcslen(TempFilename) + 1;
-				O++;
+				getextentfilesize(SpFs->SectorSize, TempIndex, SpFs->TableStr, TempFilenameIndex, FileSize);
+				trunfile(SpFs->hDisk, SpFs->SectorSize, TempIndex, SpFs->TableSize, SpFs->DiskSize, FileSize, 0, TempFilenameIndex, charmap, SpFs->TableStr, SpFs->UsedBlocks, TempFilename, SpFs->Filenames, SpFs->FilenameCount);
+				unsigned long long Count = SpFs->FilenameCount;
+				deletefile(TempIndex, TempFilenameIndex, TempFilenameSTRIndex, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr);
+				if (SpFs->FilenameCount < Count)
+				{ // Compacted instead of left as a tombstone
+					Offset -= wcslen(TempFilename) + 1;
+					O++;
+				}
 			}
 		}
 	}
@@ -1752,7 +1741,7 @@ static NTSTATUS Rename(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, PWSTR Fil
 	free(NewFilename);
 	free(SecurityName);
 	free(NewSecurityName);
-	simptable(SpFs->hDisk, SpFs->SectorSize, charmap, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
+	packtable(SpFs->SectorSize, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
 
 	return Result;
 }
@@ -1770,30 +1759,18 @@ static NTSTATUS GetSecurity(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, PSEC
 	}
 	memcpy(SecurityName, FileCtx->Path, FileNameLen * sizeof(wchar_t));
 
-	unsigned long long FilenameIndex = 0;
-	unsigned long long FilenameSTRIndex = 0;
-
 	RemoveFirst(SecurityName);
 	RemoveStream(SecurityName, Suffix);
-	PSECURITY_DESCRIPTOR S;
-	getfilenameindex(SecurityName, SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
-
-	unsigned long long Index = gettablestrindex(SecurityName, SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
+	std::string& Descriptor = FindSecurity(SpFs, SecurityName);
 	free(SecurityName);
-	unsigned long long FileSize = 0;
 
-	getfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FileSize);
-	if (*PSecurityDescriptorSize < FileSize)
+	if (*PSecurityDescriptorSize < Descriptor.size())
 	{
-		*PSecurityDescriptorSize = FileSize;
+		*PSecurityDescriptorSize = Descriptor.size();
 		return STATUS_BUFFER_OVERFLOW;
 	}
-	char* buf = (char*)calloc(FileSize + 1, 1);
-	readwritefile(SpFs->hDisk, SpFs->SectorSize, Index, 0, FileSize, SpFs->DiskSize, SpFs->TableStr, (char*&)buf, SpFs->FileInfo, FilenameIndex, 0);
-	ConvertStringSecurityDescriptorToSecurityDescriptorA(buf, SDDL_REVISION_1, &S, (PULONG)PSecurityDescriptorSize);
-	memcpy(SecurityDescriptor, S, *PSecurityDescriptorSize);
-	FspDeleteSecurityDescriptor(S, (NTSTATUS(*)())ConvertStringSecurityDescriptorToSecurityDescriptorA);
-	free(buf);
+	*PSecurityDescriptorSize = Descriptor.size();
+	memcpy(SecurityDescriptor, Descriptor.data(), Descriptor.size());
 
 	return STATUS_SUCCESS;
 }
@@ -1822,17 +1799,14 @@ static NTSTATUS SetSecurity(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, SECU
 		free(SecurityName);
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
-	PSECURITY_DESCRIPTOR S;
+	std::string Descriptor = FindSecurity(SpFs, SecurityName); // Copy, S must not move under the calls below
+	PSECURITY_DESCRIPTOR S = (PSECURITY_DESCRIPTOR)&Descriptor[0];
 	getfilenameindex(SecurityName, SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
 
 	unsigned long long Index = gettablestrindex(SecurityName, SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
 	unsigned long long FileSize = 0;
 
-	getfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FileSize);
-	char* buf = (char*)calloc(FileSize + 1, 1);
-	readwritefile(SpFs->hDisk, SpFs->SectorSize, Index, 0, FileSize, SpFs->DiskSize, SpFs->TableStr, buf, SpFs->FileInfo, FilenameIndex, 0);
-	ConvertStringSecurityDescriptorToSecurityDescriptorA(buf, SDDL_REVISION_1, &S, (PULONG)PSecurityDescriptorSize);
-	free(buf);
+	getextentfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FilenameIndex, FileSize);
 
 	PSECURITY_DESCRIPTOR NewSecurityDescriptor;
 	NTSTATUS Result;
@@ -1855,14 +1829,6 @@ static NTSTATUS SetSecurity(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, SECU
 		free(SecurityName);
 		return Result;
 	}
-	if (SecurityInformation & 1)
-	{
-		FspDeleteSecurityDescriptor(S, (NTSTATUS(*)())SetSecurityDescriptor);
-	}
-	else
-	{
-		FspDeleteSecurityDescriptor(S, (NTSTATUS(*)())FspSetSecurityDescriptor);
-	}
 
 	LPSTR* Buf = (LPSTR*)calloc(1, sizeof(LPSTR*));
 	if (!Buf)
@@ -1874,16 +1840,32 @@ static NTSTATUS SetSecurity(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, SECU
 	ConvertSecurityDescriptorToStringSecurityDescriptorA(NewSecurityDescriptor, SDDL_REVISION_1, OWNER_SECURITY_INFORMATION | GROUP_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION, Buf, (PULONG)PSecurityDescriptorSize);
 	FspDeleteSecurityDescriptor(NewSecurityDescriptor, (NTSTATUS(*)())FspSetSecurityDescriptor);
 
+	if (SpFs->Table[0] & 32)
+	{ // The descriptor id replaces the security file, the root keeps its file as the fallback for files from before the switch.
+		std::wstring Name = L"/" + std::wstring(SecurityName);
+		Result = SetDescriptor(SpFs, (PWSTR)Name.c_str(), SddlToDescriptor(*Buf));
+		if (NT_SUCCESS(Result))
+		{
+			DropSecurity(SpFs, SecurityName);
+		}
+		packtable(SpFs->SectorSize, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
+		LocalFree(*Buf);
+		free(PSecurityDescriptorSize);
+		free(SecurityName);
+		free(Buf);
+		return Result;
+	}
+
 	*PSecurityDescriptorSize = strlen(*Buf);
-	if (trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, *PSecurityDescriptorSize, FilenameIndex, charmap, SpFs->TableStr, SpFs->FileInfo, SpFs->UsedBlocks, SecurityName, SpFs->Filenames, SpFs->FilenameCount))
+	if (trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, *PSecurityDescriptorSize, FilenameIndex, charmap, SpFs->TableStr, SpFs->UsedBlocks, SecurityName, SpFs->Filenames, SpFs->FilenameCount))
 	{
 		free(PSecurityDescriptorSize);
 		free(SecurityName);
 		free(Buf);
 		return STATUS_DISK_FULL;
 	}
-	readwritefile(SpFs->hDisk, SpFs->SectorSize, Index, 0, *PSecurityDescriptorSize, SpFs->DiskSize, SpFs->TableStr, *Buf, SpFs->FileInfo, FilenameIndex, 1);
-	simptable(SpFs->hDisk, SpFs->SectorSize, charmap, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
+	readwritefile(SpFs->hDisk, SpFs->SectorSize, Index, 0, *PSecurityDescriptorSize, SpFs->DiskSize, SpFs->TableStr, *Buf, FilenameIndex, 1);
+	packtable(SpFs->SectorSize, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
 	free(PSecurityDescriptorSize);
 	free(SecurityName);
 	free(Buf);
@@ -1925,9 +1907,22 @@ static NTSTATUS ReadDirectory(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, PW
 	memcpy(ParentDirectoryName, FileCtx->Path, FileNameLen * sizeof(wchar_t));
 	GetParentName(ParentDirectoryName, Suffix);
 
+	std::string Filter = "*";
+	if (Pattern)
+	{
+		unsigned long long PatternLen = wcslen(Pattern);
+		Filter.assign(PatternLen, 0);
+		for (unsigned long long i = 0; i < PatternLen; i++)
+		{
+			Filter[i] = Pattern[i] & 0xff;
+		}
+		foldfilename(Filter);
+	}
+	bool MatchAll = Filter == "*";
+
 	if (FileCtx->Path[1] != L'\0')
 	{
-		if (!Marker)
+		if (!Marker && (MatchAll || matchpattern(Filter, ".")))
 		{
 			if (!AddDirInfo(SpFs, FileCtx->Path, (PWSTR)L".", Buffer, BufferLength, PBytesTransferred))
 			{
@@ -1938,134 +1933,67 @@ static NTSTATUS ReadDirectory(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, PW
 
 		if (!Marker || (Marker[0] == L'.' && Marker[1] == L'\0'))
 		{
-			if (!AddDirInfo(SpFs, ParentDirectoryName, (PWSTR)L"..", Buffer, BufferLength, PBytesTransferred))
+			if ((MatchAll || matchpattern(Filter, "..")) && !AddDirInfo(SpFs, ParentDirectoryName, (PWSTR)L"..", Buffer, BufferLength, PBytesTransferred))
 			{
 				free(ParentDirectoryName);
 				return STATUS_SUCCESS;
 			}
 
-			free(ParentDirectoryName);
+			Marker = 0;
+		}
+		else if (Marker[0] == L'.' && Marker[1] == L'.' && Marker[2] == L'\0')
+		{
 			Marker = 0;
 		}
 	}
-	else
+	free(ParentDirectoryName);
+
+	std::map<std::string, std::string>& Children = getdirindex(FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount);
+	std::wstring DirectoryName = FileCtx->Path;
+	if (FileNameLen > 1)
 	{
-		free(ParentDirectoryName);
+		DirectoryName += L'/';
 	}
-
-	unsigned long long Offset = 0;
-	unsigned long long FileNameLenT = max(FileNameLen, 0xff);
-	PWSTR ALC = NULL;
-	PWSTR FileName = (PWSTR)calloc(FileNameLenT + 1, sizeof(wchar_t));
-	if (!FileName)
-	{
-		return STATUS_INSUFFICIENT_RESOURCES;
-	}
-	PWSTR FileNameParent = (PWSTR)calloc(FileNameLenT + 1, sizeof(wchar_t));
-	if (!FileNameParent)
-	{
-		free(FileName);
-		return STATUS_INSUFFICIENT_RESOURCES;
-	}
-	PWSTR FileNameSuffix = (PWSTR)calloc(FileNameLenT + 1, sizeof(wchar_t));
-	if (!FileNameSuffix)
-	{
-		free(FileName);
-		free(FileNameParent);
-		return STATUS_INSUFFICIENT_RESOURCES;
-	}
-	unsigned HitMarker = !Marker;
-	unsigned long long MarkerLen = 0;
+	auto Child = Children.begin();
 	if (Marker)
-	{
-		MarkerLen = wcslen(Marker);
+	{ // Children are sorted by folded name, resume right after the marker even if it was deleted since.
+		unsigned long long MarkerLen = wcslen(Marker);
+		std::string Key(MarkerLen, 0);
+		for (unsigned long long i = 0; i < MarkerLen; i++)
+		{
+			Key[i] = Marker[i] & 0xff;
+		}
+		foldfilename(Key);
+		Child = Children.upper_bound(Key);
 	}
-	unsigned long long FileNameSuffixLen = 0;
-	for (unsigned long long i = 0; i < SpFs->FilenameCount; i++)
+	std::string Prefix = Filter.substr(0, Filter.find_first_of("*?<>\""));
+	if (Child != Children.end() && Child->first < Prefix)
+	{ // Names matching the literal start of the pattern are next to each other.
+		Child = Children.lower_bound(Prefix);
+	}
+	for (; Child != Children.end(); Child++)
 	{
-		unsigned long long j = 0;
-		for (;; j++)
+		if (Child->first.compare(0, Prefix.size(), Prefix))
 		{
-			if (j > FileNameLenT - 3)
-			{
-				FileNameLenT += 0xff;
-				ALC = (PWSTR)realloc(FileName, (FileNameLenT + 1) * sizeof(wchar_t));
-				if (!ALC)
-				{
-					free(FileName);
-					free(FileNameParent);
-					free(FileNameSuffix);
-					return STATUS_INSUFFICIENT_RESOURCES;
-				}
-				FileName = ALC;
-				ALC = NULL;
-				ALC = (PWSTR)realloc(FileNameParent, (FileNameLenT + 1) * sizeof(wchar_t));
-				if (!ALC)
-				{
-					free(FileName);
-					free(FileNameParent);
-					free(FileNameSuffix);
-					return STATUS_INSUFFICIENT_RESOURCES;
-				}
-				FileNameParent = ALC;
-				ALC = NULL;
-				ALC = (PWSTR)realloc(FileNameSuffix, (FileNameLenT + 1) * sizeof(wchar_t));
-				if (!ALC)
-				{
-					free(FileName);
-					free(FileNameParent);
-					free(FileNameSuffix);
-					return STATUS_INSUFFICIENT_RESOURCES;
-				}
-				FileNameSuffix = ALC;
-				ALC = NULL;
-			}
-			if ((SpFs->Filenames[Offset + j] & 0xff) == 255 || (SpFs->Filenames[Offset + j] & 0xff) == 42)
-			{
-				Offset += j + 1;
-				break;
-			}
-			FileName[j] = SpFs->Filenames[Offset + j] & 0xff;
+			break;
 		}
-		FileName[j] = 0;
-
-		memcpy(FileNameParent, FileName, (j + 1) * sizeof(wchar_t));
-		GetParentName(FileNameParent, FileNameSuffix);
-		if (!_wcsicmp(FileNameParent, FileCtx->Path) && wcslen(FileNameParent) == FileNameLen)
+		if (!MatchAll && !matchpattern(Filter, Child->first))
 		{
-			FileNameSuffixLen = wcslen(FileNameSuffix);
-			if (FileNameSuffixLen)
-			{
-				if (std::wstring(FileNameSuffix).find(L":") == std::string::npos)
-				{
-					if (!HitMarker)
-					{
-						if (!_wcsicmp(FileNameSuffix, Marker) && FileNameSuffixLen == MarkerLen)
-						{
-							HitMarker = 1;
-						}
-					}
-					else
-					{
-						if (!AddDirInfo(SpFs, FileName, FileNameSuffix, Buffer, BufferLength, PBytesTransferred))
-						{
-							free(FileName);
-							free(FileNameParent);
-							free(FileNameSuffix);
-							return STATUS_SUCCESS;
-						}
-					}
-				}
-			}
+			continue;
+		}
+		std::wstring FileNameSuffix(Child->second.size(), 0);
+		for (unsigned long long i = 0; i < Child->second.size(); i++)
+		{
+			FileNameSuffix[i] = Child->second[i] & 0xff;
+		}
+		if (!AddDirInfo(SpFs, (PWSTR)(DirectoryName + FileNameSuffix).c_str(), (PWSTR)FileNameSuffix.c_str(), Buffer, BufferLength, PBytesTransferred))
+		{
+			return STATUS_SUCCESS;
 		}
 	}
 
 	FspFileSystemAddDirInfo(0, Buffer, BufferLength, PBytesTransferred);
 
-	free(FileName);
-	free(FileNameParent);
-	free(FileNameSuffix);
-
 	return STATUS_SUCCESS;
 }
 
@@ -2091,8 +2019,8 @@ static NTSTATUS SetReparsePoint(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext,
 	unsigned long long FileSize = 0;
 	getfilenameindex(FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
 	unsigned long long Index = gettablestrindex(FileCtx->Path, SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
-	getfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FileSize);
-	trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, Size, FilenameIndex, charmap, SpFs->TableStr, SpFs->FileInfo, SpFs->UsedBlocks, FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount);
+	getextentfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FilenameIndex, FileSize);
+	trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, Size, FilenameIndex, charmap, SpFs->TableStr, SpFs->UsedBlocks, FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount);
 	char* buf = (char*)calloc(Size, 1);
 	if (!buf)
 	{
@@ -2100,11 +2028,13 @@ static NTSTATUS SetReparsePoint(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext,
 		return STATUS_INSUFFICIENT_RESOURCES;
 	}
 	memcpy(buf, Buffer, Size);
-	readwritefile(SpFs->hDisk, SpFs->SectorSize, Index, 0, Size, SpFs->DiskSize, SpFs->TableStr, buf, SpFs->FileInfo, FilenameIndex, 1);
+	readwritefile(SpFs->hDisk, SpFs->SectorSize, Index, 0, Size, SpFs->DiskSize, SpFs->TableStr, buf, FilenameIndex, 1);
+	unsigned long Tag = *(unsigned long*)buf;
+	chreparse(FilenameIndex, Tag, 1);
 	unsigned long winattrs = FileInfo->FileAttributes | FILE_ATTRIBUTE_REPARSE_POINT;
 	attrtoATTR(winattrs);
-	chwinattrs(SpFs->FileInfo, SpFs->FilenameCount, FilenameIndex, winattrs, 1);
-	simptable(SpFs->hDisk, SpFs->SectorSize, charmap, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
+	chwinattrs(FilenameIndex, winattrs, 1);
+	packtable(SpFs->SectorSize, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
 
 	free(buf);
 	free(FileInfo);
@@ -2130,12 +2060,14 @@ static NTSTATUS DeleteReparsePoint(FSP_FILE_SYSTEM* FileSystem, PVOID FileContex
 		unsigned long long FileSize = 0;
 		getfilenameindex(FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
 		unsigned long long Index = gettablestrindex(FileCtx->Path, SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
-		getfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FileSize);
-		trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, 0, FilenameIndex, charmap, SpFs->TableStr, SpFs->FileInfo, SpFs->UsedBlocks, FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount);
+		getextentfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FilenameIndex, FileSize);
+		trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, 0, FilenameIndex, charmap, SpFs->TableStr, SpFs->UsedBlocks, FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount);
+		unsigned long Tag = 0;
+		chreparse(FilenameIndex, Tag, 1);
 		unsigned long winattrs = FileInfo->FileAttributes & ~FILE_ATTRIBUTE_REPARSE_POINT;
 		attrtoATTR(winattrs);
-		chwinattrs(SpFs->FileInfo, SpFs->FilenameCount, FilenameIndex, winattrs, 1);
-		simptable(SpFs->hDisk, SpFs->SectorSize, charmap, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
+		chwinattrs(FilenameIndex, winattrs, 1);
+		packtable(SpFs->SectorSize, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
 
 		free(FileInfo);
 		return STATUS_SUCCESS;
@@ -2212,82 +2144,27 @@ static NTSTATUS GetStreamInfo(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, PV
 
 	free(FileInfo);
 
-	unsigned long long Offset = 0;
-	unsigned long long FileNameLenT = max(FileNameLen, 0xff);
-	PWSTR ALC = NULL;
-	PWSTR FileName = (PWSTR)calloc(FileNameLenT + 1, sizeof(wchar_t));
-	if (!FileName)
+	std::map<std::string, std::string>& Streams = getstreamindex(FileNameNoStream, SpFs->Filenames, SpFs->FilenameCount);
+	for (auto& Stream : Streams)
 	{
-		free(FileNameNoStream);
-		return STATUS_INSUFFICIENT_RESOURCES;
-	}
-	PWSTR Filename = (PWSTR)calloc(FileNameLenT + 1, sizeof(wchar_t));
-	if (!Filename)
-	{
-		free(FileName);
-		free(FileNameNoStream);
-		return STATUS_INSUFFICIENT_RESOURCES;
-	}
-
-	for (unsigned long long i = 0; i < SpFs->FilenameCount; i++)
-	{
-		unsigned long long j = 0;
-		for (;; j++)
+		if (L":" + std::wstring(Stream.second.begin(), Stream.second.end()) == eastream)
 		{
-			if (j > FileNameLenT - 3)
-			{
-				FileNameLenT += 0xff;
-				ALC = (PWSTR)realloc(FileName, (FileNameLenT + 1) * sizeof(wchar_t));
-				if (!ALC)
-				{
-					free(Filename);
-					free(FileName);
-					free(FileNameNoStream);
-					return STATUS_INSUFFICIENT_RESOURCES;
-				}
-				FileName = ALC;
-				ALC = NULL;
-				ALC = (PWSTR)realloc(Filename, (FileNameLenT + 1) * sizeof(wchar_t));
-				if (!ALC)
-				{
-					free(Filename);
-					free(FileName);
-					free(FileNameNoStream);
-					return STATUS_INSUFFICIENT_RESOURCES;
-				}
-				Filename = ALC;
-				ALC = NULL;
-			}
-			if ((SpFs->Filenames[Offset + j] & 0xff) == 255 || (SpFs->Filenames[Offset + j] & 0xff) == 42)
-			{
-				Offset += j + 1;
-				break;
-			}
-			FileName[j] = SpFs->Filenames[Offset + j] & 0xff;
+			continue;
 		}
-		FileName[j] = 0;
-
-		memcpy(Filename, FileName, (j + 1) * sizeof(wchar_t));
-		RemoveStream(FileName, Suffix);
-		if (!_wcsicmp(FileName, FileNameNoStream) && wcslen(FileName) == FileNameLen)
+		std::wstring StreamName(Stream.second.size(), 0);
+		for (unsigned long long i = 0; i < Stream.second.size(); i++)
 		{
-			if (std::wstring(Filename).find(L":") != std::wstring::npos)
-			{
-				if (!AddStreamInfo(SpFs, Filename, Suffix, Buffer, Length, PBytesTransferred))
-				{
-					free(Filename);
-					free(FileName);
-					free(FileNameNoStream);
-					return STATUS_SUCCESS;
-				}
-			}
+			StreamName[i] = Stream.second[i] & 0xff;
+		}
+		if (!AddStreamInfo(SpFs, (PWSTR)(std::wstring(FileNameNoStream) + L":" + StreamName).c_str(), (PWSTR)StreamName.c_str(), Buffer, Length, PBytesTransferred))
+		{
+			free(FileNameNoStream);
+			return STATUS_SUCCESS;
 		}
 	}
 
 	FspFileSystemAddStreamInfo(0, Buffer, Length, PBytesTransferred);
 
-	free(Filename);
-	free(FileName);
 	free(FileNameNoStream);
 	return STATUS_SUCCESS;
 }
@@ -2300,28 +2177,36 @@ static NTSTATUS GetDirInfoByName(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext,
 	unsigned long long FileContextLen = wcslen(FileCtx->Path);
 	unsigned long long FileNameLen = wcslen(FileName);
 
-	PWSTR Filename = (PWSTR)calloc(FileContextLen + 1 + FileNameLen + 1, sizeof(wchar_t));
-	if (!Filename)
+	std::string Key(FileNameLen, 0);
+	for (unsigned long long i = 0; i < FileNameLen; i++)
 	{
-		return STATUS_INSUFFICIENT_RESOURCES;
+		Key[i] = FileName[i] & 0xff;
 	}
-
-	memcpy(Filename, FileCtx->Path, FileContextLen * sizeof(wchar_t));
-	Filename[FileContextLen] = L'\\';
-	memcpy(Filename + FileContextLen + 1, FileName, FileNameLen * sizeof(wchar_t));
-
-	if (!NT_SUCCESS(FindDuplicate(SpFs, Filename)))
+	foldfilename(Key);
+	std::map<std::string, std::string>& Children = getdirindex(FileCtx->Path, SpFs->Filenames, SpFs->FilenameCount);
+	auto Child = Children.find(Key);
+	if (Child == Children.end())
 	{
-		DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + FileNameLen * sizeof(wchar_t));
-		GetFileInfoInternal(SpFs, &DirInfo->FileInfo, Filename);
-		memcpy(DirInfo->FileNameBuf, FileName, DirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO));
+		return STATUS_OBJECT_NAME_NOT_FOUND;
+	}
 
-		free(Filename);
-		return STATUS_SUCCESS;
+	std::wstring Filename = FileCtx->Path;
+	if (FileContextLen > 1)
+	{
+		Filename += L'/';
+	}
+	std::wstring FileNameSuffix(Child->second.size(), 0);
+	for (unsigned long long i = 0; i < Child->second.size(); i++)
+	{
+		FileNameSuffix[i] = Child->second[i] & 0xff;
 	}
+	Filename += FileNameSuffix;
 
-	free(Filename);
-	return STATUS_OBJECT_NAME_NOT_FOUND;
+	DirInfo->Size = (UINT16)(sizeof(FSP_FSCTL_DIR_INFO) + FileNameSuffix.size() * sizeof(wchar_t));
+	GetFileInfoInternal(SpFs, &DirInfo->FileInfo, (PWSTR)Filename.c_str());
+	memcpy(DirInfo->FileNameBuf, FileNameSuffix.c_str(), DirInfo->Size - sizeof(FSP_FSCTL_DIR_INFO));
+
+	return STATUS_SUCCESS;
 }
 
 static NTSTATUS Control(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, UINT32 ControlCode, PVOID InputBuffer, ULONG InputBufferLength, PVOID OutputBuffer, ULONG OutputBufferLength, PULONG PBytesTransferred)
@@ -2359,12 +2244,105 @@ static NTSTATUS Control(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, UINT32 C
 
 static NTSTATUS GetEa(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, PFILE_FULL_EA_INFORMATION Ea, ULONG EaLength, PULONG PBytesTransferred)
 {
-	return STATUS_INVALID_DEVICE_REQUEST;
+	SPFS* SpFs = (SPFS*)FileSystem->UserContext;
+	SPFS_FILE_CONTEXT* FileCtx = (SPFS_FILE_CONTEXT*)FileContext;
+	std::wstring FileName = FileCtx->Path;
+	FileName = FileName.substr(0, FileName.find(L":"));
+	Eas* E = FindEa(SpFs, (PWSTR)FileName.c_str());
+
+	unsigned long long O = 0;
+	unsigned char Flags = 0;
+	std::string Name = "";
+	std::string Value = "";
+	while (E && !nextea(*E, O, Flags, Name, Value))
+	{
+		PFILE_FULL_EA_INFORMATION SingleEa = (PFILE_FULL_EA_INFORMATION)calloc(FIELD_OFFSET(FILE_FULL_EA_INFORMATION, EaName) + Name.size() + 1 + Value.size(), 1);
+		if (!SingleEa)
+		{
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+		SingleEa->Flags = Flags;
+		SingleEa->EaNameLength = (UCHAR)Name.size();
+		SingleEa->EaValueLength = (USHORT)Value.size();
+		memcpy(SingleEa->EaName, Name.c_str(), Name.size() + 1);
+		memcpy(SingleEa->EaName + Name.size() + 1, Value.data(), Value.size());
+		if (!FspFileSystemAddEa(SingleEa, Ea, EaLength, PBytesTransferred))
+		{
+			free(SingleEa);
+			return STATUS_SUCCESS;
+		}
+		free(SingleEa);
+	}
+	FspFileSystemAddEa(0, Ea, EaLength, PBytesTransferred);
+
+	return STATUS_SUCCESS;
 }
 
 static NTSTATUS SetEa(FSP_FILE_SYSTEM* FileSystem, PVOID FileContext, PFILE_FULL_EA_INFORMATION Ea, ULONG EaLength, FSP_FSCTL_FILE_INFO* FileInfo)
 {
-	return STATUS_INVALID_DEVICE_REQUEST;
+	SPFS* SpFs = (SPFS*)FileSystem->UserContext;
+	SPFS_FILE_CONTEXT* FileCtx = (SPFS_FILE_CONTEXT*)FileContext;
+	std::wstring FileName = FileCtx->Path;
+	FileName = FileName.substr(0, FileName.find(L":"));
+	std::wstring Path = FileName + eastream;
+	Eas E;
+	Eas* Found = FindEa(SpFs, (PWSTR)FileName.c_str());
+	if (Found)
+	{
+		E = *Found; // Copy, the writes below drop the cached one
+	}
+
+	for (PFILE_FULL_EA_INFORMATION P = Ea, EndP = (PFILE_FULL_EA_INFORMATION)((PUINT8)Ea + EaLength); EndP > P; P = P->NextEntryOffset ? (PFILE_FULL_EA_INFORMATION)((PUINT8)P + P->NextEntryOffset) : EndP)
+	{
+		if (setea(E, std::string(P->EaName, P->EaNameLength), P->Flags, std::string(P->EaName + P->EaNameLength + 1, P->EaValueLength)))
+		{
+			return STATUS_INVALID_EA_NAME;
+		}
+	}
+
+	unsigned long long FilenameIndex = 0;
+	unsigned long long FilenameSTRIndex = 0;
+	getfilenameindex((PWSTR)Path.c_str(), SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
+	if (FilenameIndex >= SpFs->FilenameCount && E.block.size())
+	{
+		unsigned long long MainFilenameIndex = 0;
+		unsigned long long MainFilenameSTRIndex = 0;
+		unsigned long gid = 0;
+		unsigned long uid = 0;
+		getfilenameindex((PWSTR)FileName.c_str(), SpFs->Filenames, SpFs->FilenameCount, MainFilenameIndex, MainFilenameSTRIndex);
+		chgid(MainFilenameIndex, gid, 0);
+		chuid(MainFilenameIndex, uid, 0);
+		if (createfile((PWSTR)Path.c_str(), gid, uid, 448, 2048, SpFs->FilenameCount, SpFs->Filenames, charmap, SpFs->TableStr))
+		{
+			return STATUS_DISK_FULL;
+		}
+		getfilenameindex((PWSTR)Path.c_str(), SpFs->Filenames, SpFs->FilenameCount, FilenameIndex, FilenameSTRIndex);
+	}
+	if (FilenameIndex < SpFs->FilenameCount)
+	{
+		unsigned long long Index = gettablestrindex((PWSTR)Path.c_str(), SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
+		unsigned long long FileSize = 0;
+		getextentfilesize(SpFs->SectorSize, Index, SpFs->TableStr, FilenameIndex, FileSize);
+		if (trunfile(SpFs->hDisk, SpFs->SectorSize, Index, SpFs->TableSize, SpFs->DiskSize, FileSize, E.block.size(), FilenameIndex, charmap, SpFs->TableStr, SpFs->UsedBlocks, (PWSTR)Path.c_str(), SpFs->Filenames, SpFs->FilenameCount))
+		{
+			return STATUS_DISK_FULL;
+		}
+		if (E.block.size())
+		{
+			char* buf = &E.block[0];
+			if (readwritefile(SpFs->hDisk, SpFs->SectorSize, Index, 0, E.block.size(), SpFs->DiskSize, SpFs->TableStr, buf, FilenameIndex, 1))
+			{
+				return STATUS_UNSUCCESSFUL;
+			}
+		}
+		else if (deletefile(Index, FilenameIndex, FilenameSTRIndex, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr))
+		{
+			return STATUS_UNSUCCESSFUL;
+		}
+		packtable(SpFs->SectorSize, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
+	}
+
+	return GetFileInfoInternal(SpFs, FileInfo, FileCtx->Path);
 }
 
 static VOID DispatcherStopped(FSP_FILE_SYSTEM* FileSystem, BOOLEAN Normally)
@@ -2411,13 +2389,29 @@ static FSP_FILE_SYSTEM_INTERFACE SpFsInterface =
 
 static VOID SpFsDelete(SPFS* SpFs)
 {
+	if (SpFs->JournalThread)
+	{
+		SetEvent(SpFs->JournalEvent);
+		WaitForSingleObject(SpFs->JournalThread, INFINITE);
+		CloseHandle(SpFs->JournalThread);
+	}
+
+	if (SpFs->JournalEvent)
+	{
+		CloseHandle(SpFs->JournalEvent);
+	}
+
+	flushatimes(SpFs->FilenameCount);
+
 	unsigned long long index = 0;
 	unsigned long long filenameindex = 0;
 	unsigned long long filenamestrindex = 0;
 	getfilenameindex(PWSTR(L"?"), SpFs->Filenames, SpFs->FilenameCount, filenameindex, filenamestrindex);
 	index = gettablestrindex(PWSTR(L"?"), SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
-	deletefile(index, filenameindex, filenamestrindex, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr);
-	simptable(SpFs->hDisk, SpFs->SectorSize, charmap, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
+	deletefile(index, filenameindex, filenamestrindex, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr);
+	compactfiles(SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr);
+	journalcheckpoint(SpFs->hDisk, SpFs->SectorSize, charmap, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->DiskSize, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
+	FspDebugLog("%S: %llu reads and writes to the disk\n", PROGNAME, getdrivecalls()); // To the debug log, or the debugger without one
 
 	if (SpFs->FileSystem)
 	{
@@ -2449,15 +2443,84 @@ static VOID SpFsDelete(SPFS* SpFs)
 		free(SpFs->Filenames);
 	}
 
-	if (SpFs->FileInfo)
+	free(SpFs);
+}
+
+static VOID BuildMaps()
+{
+	std::unordered_map<unsigned, unsigned> Emap = {};
+	std::unordered_map<unsigned, unsigned> Dmap = {};
+	unsigned p = 0;
+	unsigned c;
+	for (unsigned i = 0; i < 15; i++)
 	{
-		free(SpFs->FileInfo);
+		for (unsigned o = 0; o < 15; o++)
+		{
+			c = charmap[i] << 8 | charmap[o];
+			Emap[c] = p;
+			Dmap[p] = c;
+			p++;
+		}
 	}
 
-	free(SpFs);
+	handmaps(Emap, Dmap);
 }
 
-static NTSTATUS SpFsCreate(PWSTR Path, PWSTR MountPoint, UINT32 SectorSize, UINT32 DebugFlags, SPFS** PSpFs)
+static int SpFsUpgrade(PWSTR Path)
+{
+	HANDLE hDisk = CreateFile(Path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+	if (hDisk == INVALID_HANDLE_VALUE)
+	{
+		std::cout << "Opening Error: " << GetLastError() << std::endl;
+		return 1;
+	}
+
+	unsigned long sectorsize = 0;
+	unsigned long tablesize = 0;
+	unsigned long long extratablesize = 0;
+	char* table = NULL;
+	if (readtable(hDisk, sectorsize, tablesize, extratablesize, table))
+	{
+		std::cout << "Reading table Error: " << GetLastError() << std::endl;
+		CloseHandle(hDisk);
+		return 1;
+	}
+	if (table[0] & 128)
+	{
+		std::cout << "Table is already format v2." << std::endl;
+		free(table);
+		CloseHandle(hDisk);
+		return 0;
+	}
+
+	BuildMaps();
+
+	char* tablestr = NULL;
+	char* filenames = NULL;
+	unsigned long long filenamecount = 0;
+	int err = loadtable(table, tablestr, filenames, filenamecount);
+	if (!err)
+	{
+		table[0] |= 128;
+		err = simptable(hDisk, sectorsize, charmap, tablesize, extratablesize, filenamecount, filenames, tablestr, table);
+	}
+	if (err)
+	{
+		std::cout << "Upgrading table Error: " << GetLastError() << std::endl;
+	}
+	else
+	{
+		std::cout << "Upgraded table to format v2." << std::endl;
+	}
+
+	free(table);
+	free(tablestr);
+	free(filenames);
+	CloseHandle(hDisk);
+	return err;
+}
+
+static NTSTATUS SpFsCreate(PWSTR Path, PWSTR MountPoint, UINT32 SectorSize, UINT32 FileTimes, UINT32 Records, UINT32 DebugFlags, SPFS** PSpFs)
 {
 	FSP_FSCTL_VOLUME_PARAMS VolumeParams;
 	SPFS* SpFs = 0;
@@ -2494,9 +2557,10 @@ static NTSTATUS SpFsCreate(PWSTR Path, PWSTR MountPoint, UINT32 SectorSize, UINT
 		}
 		i -= 9;
 		char bytes[512] = { 0 };
-		bytes[0] = i;
-		bytes[5] = 255;
-		bytes[6] = 254;
+		bytes[0] = i | 128;
+		bytes[5] = 0;
+		bytes[6] = 255;
+		bytes[7] = 254;
 		DWORD w;
 		WriteFile(hDisk, bytes, 512, &w, NULL);
 		if (w != 512)
@@ -2515,106 +2579,32 @@ static NTSTATUS SpFsCreate(PWSTR Path, PWSTR MountPoint, UINT32 SectorSize, UINT
 	}
 	//std::cout << "Disk size: " << disksize.QuadPart << std::endl;
 
-	_LARGE_INTEGER seek = { 0 };
-	SetFilePointerEx(hDisk, seek, &seek, 0);
-	char bytes[512] = { 0 };
-	DWORD r;
-	if (!ReadFile(hDisk, bytes, 512, &r, NULL))
+	unsigned long tablesize = 0;
+	unsigned long long extratablesize = 0;
+	char* table = NULL;
+	switch (readtable(hDisk, sectorsize, tablesize, extratablesize, table))
 	{
+	case 1:
 		std::cout << "Reading Error: " << GetLastError() << std::endl;
 		return STATUS_UNSUCCESSFUL;
-	}
-	if (r != 512)
-	{
-		std::cout << "Reading Error: " << GetLastError() << std::endl;
-		return STATUS_UNSUCCESSFUL;
-	}
-	sectorsize = pow(2, 9 + bytes[0]);
-	//std::cout << "Read disk with sectorsize: " << sectorsize << std::endl;
-
-	unsigned long tablesize = 1 + bytes[4] + (bytes[3] << 8) + (bytes[2] << 16) + (bytes[1] << 24);
-	unsigned long long extratablesize = (static_cast<unsigned long long>(tablesize) * sectorsize) - 512;
-	char* ttable = (char*)calloc(extratablesize, 1);
-	if (!ReadFile(hDisk, ttable, extratablesize, &r, NULL))
-	{
-		std::cout << "Reading table Error: " << GetLastError() << std::endl;
-		return STATUS_UNSUCCESSFUL;
-	}
-	if (r != extratablesize)
-	{
+	case 2:
 		std::cout << "Reading table Error: " << GetLastError() << std::endl;
 		return STATUS_UNSUCCESSFUL;
 	}
+	//std::cout << "Read disk with sectorsize: " << sectorsize << std::endl;
 	//std::cout << "Read table with size: " << tablesize << std::endl;
 
-	char* table = (char*)calloc(512 + static_cast<size_t>(extratablesize), 1);
-	memcpy(table, bytes, 512);
-	memcpy(table + 512, ttable, extratablesize);
-	free(ttable);
-
-	std::unordered_map<unsigned, unsigned> Emap = {};
-	std::unordered_map<unsigned, unsigned> Dmap = {};
-	unsigned p = 0;
-	unsigned c;
-	for (unsigned i = 0; i < 15; i++)
-	{
-		for (unsigned o = 0; o < 15; o++)
-		{
-			c = charmap[i] << 8 | charmap[o];
-			Emap[c] = p;
-			Dmap[p] = c;
-			p++;
-		}
-	}
-
-	handmaps(Emap, Dmap, filenameindexlist);
-
-	unsigned long long pos = 0;
-	while (((unsigned)table[pos] & 0xff) != 255)
-	{
-		pos++;
-	}
-	//std::cout << "Found end of table at: " << pos << std::endl;
-	//std::cout << "Table size: " << pos - 5 << std::endl;
-	char* tablestr = (char*)calloc(pos - 5 + 1, 1);
-	memcpy(tablestr, table + 5, pos - 5);
-	decode(tablestr, pos - 5);
-	//std::cout << "Decoded table: " << std::string(str, (pos - 5) * 2) << std::endl;
+	BuildMaps();
 
-	//simp(charmap, tablestr);
-	//encode(str, (pos - 5) * 2);
-	//std::cout << "Encoded table: ";
-	//for (unsigned long long i = 0; i < pos - 5; i++)
-	//{
-	//	std::cout << ((unsigned)str[i] & 0xff) << " ";
-	//}
-	//std::cout << std::endl;
-
-	unsigned long long filenamepos = pos;
-	while (((unsigned)table[filenamepos] & 0xff) != 254)
-	{
-		filenamepos++;
-	}
-	//std::cout << "Found end of filenames at: " << filenamepos << std::endl;
-	//std::cout << "Filenames size: " << filenamepos - pos << std::endl;
-	char* filenames = (char*)calloc(filenamepos - pos + 1, 1);
-	memcpy(filenames, table + pos + 1, filenamepos - pos - 1);
+	char* tablestr = NULL;
+	char* filenames = NULL;
 	unsigned long long filenamecount = 0;
-	for (unsigned long long i = 0; i < filenamepos - pos - 1; i++)
+	if (loadtable(table, tablestr, filenames, filenamecount))
 	{
-		if (((unsigned)filenames[i] & 0xff) == 255)
-		{
-			filenamecount++;
-		}
+		std::cout << "Loading table Error" << std::endl;
+		return STATUS_UNSUCCESSFUL;
 	}
-	filenames[filenamepos - pos - 1] = 254;
 	//std::cout << "Filename count: " << filenamecount << std::endl;
-	//std::cout << "Filenames: " << std::string(filenames, filenamepos - pos - 1) << std::endl;
-
-	char* fileinfo = (char*)calloc(filenamecount, 35);
-	memcpy(fileinfo, table + filenamepos + 1, filenamecount * 35);
-	//std::cout << "Fileinfo size: " << filenamecount * 35 << std::endl;
-	//std::cout << "Fileinfo: " << std::string(fileinfo, filenamecount * 35) << std::endl;
 
 	unsigned long long usedblocks = 0;
 	unsigned long long index = 0;
@@ -2622,6 +2612,8 @@ static NTSTATUS SpFsCreate(PWSTR Path, PWSTR MountPoint, UINT32 SectorSize, UINT
 	unsigned long long filenamestrindex = 0;
 	unsigned long long filesize = 0;
 	unsigned long winattrs = 0;
+	unsigned long long replayed = 0;
+	unsigned long long fixed = 0;
 
 	// Need to init SpaceFS ^
 
@@ -2645,31 +2637,65 @@ static NTSTATUS SpFsCreate(PWSTR Path, PWSTR MountPoint, UINT32 SectorSize, UINT
 	SpFs->TableStr = tablestr;
 	SpFs->FilenameCount = filenamecount;
 	SpFs->Filenames = filenames;
-	SpFs->FileInfo = fileinfo;
 	SpFs->UsedBlocks = usedblocks;
 
 	// Need to save SpaceFS to SpFs ^
 
+	if (replayjournal(SpFs->hDisk, SpFs->SectorSize, charmap, SpFs->DiskSize, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr, replayed))
+	{
+		std::cout << "Replaying journal Error" << std::endl;
+		Result = STATUS_UNSUCCESSFUL;
+		goto exit;
+	}
+	if (replayed)
+	{
+		std::cout << "Replayed " << replayed << " journal commits." << std::endl;
+	}
+
+	// Redo what was committed since the last checkpoint ^
+
+	if (FileTimes && !(SpFs->Table[0] & 64))
+	{ // After replay so the journal is read as it was written, the checkpoint below rewrites the times.
+		nativetimes(SpFs->Table);
+	}
+
+	if (Records && !(SpFs->Table[0] & 32))
+	{ // Same for the attributes, drivers without extended records refuse the volume from here on.
+		extendedrecords(SpFs->Table);
+	}
+
+	detectblocks(SpFs->SectorSize, SpFs->DiskSize, SpFs->TableStr, SpFs->UsedBlocks);
+
+	// Build free space once, alloc and dealloc keep it up to date ^
+
+	fixed = checkreparse(SpFs->hDisk, SpFs->SectorSize, SpFs->DiskSize, SpFs->TableStr, SpFs->FilenameCount);
+	if (fixed && SpFs->Table[0] & 32)
+	{
+		std::cout << "Set " << fixed << " reparse tags from their buffers." << std::endl;
+	}
+
+	// Reparse tags kept in the table match their buffers ^
+
 	if (NT_SUCCESS(FindDuplicate(SpFs, PWSTR(L""))))
 	{
-		createfile(PWSTR(L""), 545, 545, 448, 0, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, charmap, SpFs->TableStr);
+		createfile(PWSTR(L""), 545, 545, 448, 0, SpFs->FilenameCount, SpFs->Filenames, charmap, SpFs->TableStr);
 	}
 
 	if (NT_SUCCESS(FindDuplicate(SpFs, PWSTR(L"/"))))
 	{
 		winattrs = FILE_ATTRIBUTE_DIRECTORY;
 		attrtoATTR(winattrs);
-		createfile(PWSTR(L"/"), 545, 545, 16877, winattrs, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, charmap, SpFs->TableStr);
+		createfile(PWSTR(L"/"), 545, 545, 16877, winattrs, SpFs->FilenameCount, SpFs->Filenames, charmap, SpFs->TableStr);
 	}
 
 	if (NT_SUCCESS(FindDuplicate(SpFs, PWSTR(L":"))))
 	{
-		createfile(PWSTR(L":"), 545, 545, 448, 0, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, charmap, SpFs->TableStr);
+		createfile(PWSTR(L":"), 545, 545, 448, 0, SpFs->FilenameCount, SpFs->Filenames, charmap, SpFs->TableStr);
 	}
 
 	if (NT_SUCCESS(FindDuplicate(SpFs, PWSTR(L"?"))))
 	{
-		createfile(PWSTR(L"?"), 545, 545, 16877, 0, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, charmap, SpFs->TableStr);
+		createfile(PWSTR(L"?"), 545, 545, 16877, 0, SpFs->FilenameCount, SpFs->Filenames, charmap, SpFs->TableStr);
 	}
 	else
 	{
@@ -2680,7 +2706,7 @@ static NTSTATUS SpFsCreate(PWSTR Path, PWSTR MountPoint, UINT32 SectorSize, UINT
 
 	getfilenameindex(PWSTR(L""), SpFs->Filenames, SpFs->FilenameCount, filenameindex, filenamestrindex);
 	index = gettablestrindex(PWSTR(L""), SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
-	getfilesize(SpFs->SectorSize, index, SpFs->TableStr, filesize);
+	getextentfilesize(SpFs->SectorSize, index, SpFs->TableStr, filenameindex, filesize);
 	if (!filesize)
 	{
 		char* buf = (char*)calloc(23, 1);
@@ -2690,25 +2716,25 @@ static NTSTATUS SpFsCreate(PWSTR Path, PWSTR MountPoint, UINT32 SectorSize, UINT
 			goto exit;
 		}
 		memcpy(buf, "O:WDG:WDD:P(A;;FA;;;WD)", 23);
-		trunfile(SpFs->hDisk, SpFs->SectorSize, index, SpFs->TableSize, SpFs->DiskSize, 0, 23, filenameindex, charmap, SpFs->TableStr, SpFs->FileInfo, SpFs->UsedBlocks, PWSTR(L""), SpFs->Filenames, SpFs->FilenameCount);
-		readwritefile(SpFs->hDisk, SpFs->SectorSize, index, 0, 23, SpFs->DiskSize, SpFs->TableStr, buf, SpFs->FileInfo, filenameindex, 1);
+		trunfile(SpFs->hDisk, SpFs->SectorSize, index, SpFs->TableSize, SpFs->DiskSize, 0, 23, filenameindex, charmap, SpFs->TableStr, SpFs->UsedBlocks, PWSTR(L""), SpFs->Filenames, SpFs->FilenameCount);
+		readwritefile(SpFs->hDisk, SpFs->SectorSize, index, 0, 23, SpFs->DiskSize, SpFs->TableStr, buf, filenameindex, 1);
 	}
 
 	filenameindex = 0;
 	filenamestrindex = 0;
 	getfilenameindex(PWSTR(L"/"), SpFs->Filenames, SpFs->FilenameCount, filenameindex, filenamestrindex);
 	index = gettablestrindex(PWSTR(L"/"), SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
-	getfilesize(SpFs->SectorSize, index, SpFs->TableStr, filesize);
-	if (!trunfile(SpFs->hDisk, SpFs->SectorSize, index, SpFs->TableSize, SpFs->DiskSize, filesize, filesize + 1, filenameindex, charmap, SpFs->TableStr, SpFs->FileInfo, SpFs->UsedBlocks, PWSTR(L"/"), SpFs->Filenames, SpFs->FilenameCount))
+	getextentfilesize(SpFs->SectorSize, index, SpFs->TableStr, filenameindex, filesize);
+	if (!trunfile(SpFs->hDisk, SpFs->SectorSize, index, SpFs->TableSize, SpFs->DiskSize, filesize, filesize + 1, filenameindex, charmap, SpFs->TableStr, SpFs->UsedBlocks, PWSTR(L"/"), SpFs->Filenames, SpFs->FilenameCount))
 	{
-		trunfile(SpFs->hDisk, SpFs->SectorSize, index, SpFs->TableSize, SpFs->DiskSize, filesize + 1, filesize, filenameindex, charmap, SpFs->TableStr, SpFs->FileInfo, SpFs->UsedBlocks, PWSTR(L"/"), SpFs->Filenames, SpFs->FilenameCount);
+		trunfile(SpFs->hDisk, SpFs->SectorSize, index, SpFs->TableSize, SpFs->DiskSize, filesize + 1, filesize, filenameindex, charmap, SpFs->TableStr, SpFs->UsedBlocks, PWSTR(L"/"), SpFs->Filenames, SpFs->FilenameCount);
 	}
 
 	filenameindex = 0;
 	filenamestrindex = 0;
 	getfilenameindex(PWSTR(L":"), SpFs->Filenames, SpFs->FilenameCount, filenameindex, filenamestrindex);
 	index = gettablestrindex(PWSTR(L":"), SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
-	getfilesize(SpFs->SectorSize, index, SpFs->TableStr, filesize);
+	getextentfilesize(SpFs->SectorSize, index, SpFs->TableStr, filenameindex, filesize);
 	if (!filesize)
 	{
 		char* buf = (char*)calloc(8, 1);
@@ -2718,13 +2744,40 @@ static NTSTATUS SpFsCreate(PWSTR Path, PWSTR MountPoint, UINT32 SectorSize, UINT
 			goto exit;
 		}
 		memcpy(buf, "CSpaceFS", 8);
-		trunfile(SpFs->hDisk, SpFs->SectorSize, index, SpFs->TableSize, SpFs->DiskSize, 0, 8, filenameindex, charmap, SpFs->TableStr, SpFs->FileInfo, SpFs->UsedBlocks, PWSTR(L":"), SpFs->Filenames, SpFs->FilenameCount);
-		readwritefile(SpFs->hDisk, SpFs->SectorSize, index, 0, 8, SpFs->DiskSize, SpFs->TableStr, buf, SpFs->FileInfo, filenameindex, 1);
+		trunfile(SpFs->hDisk, SpFs->SectorSize, index, SpFs->TableSize, SpFs->DiskSize, 0, 8, filenameindex, charmap, SpFs->TableStr, SpFs->UsedBlocks, PWSTR(L":"), SpFs->Filenames, SpFs->FilenameCount);
+		readwritefile(SpFs->hDisk, SpFs->SectorSize, index, 0, 8, SpFs->DiskSize, SpFs->TableStr, buf, filenameindex, 1);
 	}
 
-	simptable(SpFs->hDisk, SpFs->SectorSize, charmap, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->FilenameCount, SpFs->FileInfo, SpFs->Filenames, SpFs->TableStr, SpFs->Table);
+	if (NT_SUCCESS(FindDuplicate(SpFs, PWSTR(L"!"))))
+	{
+		createfile(PWSTR(L"!"), 545, 545, 448, 0, SpFs->FilenameCount, SpFs->Filenames, charmap, SpFs->TableStr);
+	}
 
-	// Init the root directory ^
+	filenameindex = 0;
+	filenamestrindex = 0;
+	getfilenameindex(PWSTR(L"!"), SpFs->Filenames, SpFs->FilenameCount, filenameindex, filenamestrindex);
+	index = gettablestrindex(PWSTR(L"!"), SpFs->Filenames, SpFs->TableStr, SpFs->FilenameCount);
+	getextentfilesize(SpFs->SectorSize, index, SpFs->TableStr, filenameindex, filesize);
+	if (!filesize)
+	{ // Fixed size journal, without room for it every commit falls back to a checkpoint.
+		trunfile(SpFs->hDisk, SpFs->SectorSize, index, SpFs->TableSize, SpFs->DiskSize, 0, 1048576, filenameindex, charmap, SpFs->TableStr, SpFs->UsedBlocks, PWSTR(L"!"), SpFs->Filenames, SpFs->FilenameCount);
+	}
+
+	if (journalcheckpoint(SpFs->hDisk, SpFs->SectorSize, charmap, SpFs->TableSize, SpFs->ExtraTableSize, SpFs->DiskSize, SpFs->FilenameCount, SpFs->Filenames, SpFs->TableStr, SpFs->Table))
+	{
+		std::cout << "Writing table Error: " << GetLastError() << std::endl;
+		Result = STATUS_UNSUCCESSFUL;
+		goto exit;
+	}
+
+	if (loaddescriptors(SpFs->hDisk, SpFs->SectorSize, SpFs->DiskSize, SpFs->TableStr, SpFs->Filenames, SpFs->FilenameCount))
+	{
+		std::cout << "Reading descriptors Error" << std::endl;
+		Result = STATUS_UNSUCCESSFUL;
+		goto exit;
+	}
+
+	// Init the root directory and the journal ^
 
 	if (sectorsize / 512 > 32768)
 	{
@@ -2774,6 +2827,19 @@ static NTSTATUS SpFsCreate(PWSTR Path, PWSTR MountPoint, UINT32 SectorSize, UINT
 	}
 	SpFs->FileSystem->UserContext = SpFs;
 
+	SpFs->JournalEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (!SpFs->JournalEvent)
+	{
+		Result = STATUS_INSUFFICIENT_RESOURCES;
+		goto exit;
+	}
+	SpFs->JournalThread = CreateThread(NULL, 0, JournalThread, SpFs, 0, NULL);
+	if (!SpFs->JournalThread)
+	{
+		Result = STATUS_INSUFFICIENT_RESOURCES;
+		goto exit;
+	}
+
 	Result = FspFileSystemSetMountPoint(SpFs->FileSystem, MountPoint);
 	if (!NT_SUCCESS(Result))
 	{
@@ -2848,6 +2914,11 @@ NTSTATUS SvcStart(FSP_SERVICE* Service, ULONG argc, PWSTR* argv)
 	PWSTR Path = 0;
 	PWSTR MountPoint = 0;
 	ULONG SectorSize = 0;
+	ULONG FileTimes = 0;
+	ULONG Records = 0;
+	ULONG AtimeMode = 0;
+	ULONG AtimeInterval = 86400;
+	ULONG InlineSize = 60;
 	ULONG DebugFlags = 0;
 	PWSTR DebugLogFile = 0;
 	HANDLE DebugLogHandle = INVALID_HANDLE_VALUE;
@@ -2879,6 +2950,21 @@ NTSTATUS SvcStart(FSP_SERVICE* Service, ULONG argc, PWSTR* argv)
 		case L's':
 			argtol(SectorSize);
 			break;
+		case L't':
+			argtol(FileTimes);
+			break;
+		case L'x':
+			argtol(Records);
+			break;
+		case L'a':
+			argtol(AtimeMode);
+			break;
+		case L'A':
+			argtol(AtimeInterval);
+			break;
+		case L'i':
+			argtol(InlineSize);
+			break;
 		default:
 			goto usage;
 		}
@@ -2915,7 +3001,10 @@ NTSTATUS SvcStart(FSP_SERVICE* Service, ULONG argc, PWSTR* argv)
 
 	EnableBackupRestorePrivileges();
 
-	Result = SpFsCreate(Path, MountPoint, SectorSize, DebugFlags, &SpFs);
+	atimepolicy(AtimeMode, AtimeInterval * 10000000ULL);
+	inlinepolicy(InlineSize);
+
+	Result = SpFsCreate(Path, MountPoint, SectorSize, FileTimes, Records, DebugFlags, &SpFs);
 	if (!NT_SUCCESS(Result))
 	{
 		fail((PWSTR)L"Was unable to read/write file or drive.");
@@ -2952,9 +3041,16 @@ usage:
 		"    -D DebugLogFile [file path; use - for stderr]\n"
 		"    -p Path         [file or drive to use as file system]\n"
 		"    -m MountPoint   [X:|*|directory]\n"
-		"    -s SectorSize   [used to specify to format and new sectorsize]\n";
+		"    -s SectorSize   [used to specify to format and new sectorsize]\n"
+		"    -t 1            [store times as FILETIME integers from now on]\n"
+		"    -x 1            [keep descriptors, reparse tags and small files in the table from now on, table format v3]\n"
+		"    -a AtimeMode    [0: access time on every read, 1: relatime, 2: noatime]\n"
+		"    -A Seconds      [relatime updates access times older than this, default 86400]\n"
+		"    -i Bytes        [files up to this size are kept in the table with -x 1, or else served from memory once read, default 60]\n"
+		"\n"
+		"or: %s -U Path     [upgrade an unmounted file or drive to table format v2]\n";
 
-	fail(usage, PROGNAME);
+	fail(usage, PROGNAME, PROGNAME);
 	return STATUS_UNSUCCESSFUL;
 
 #undef argtos
@@ -2972,6 +3068,10 @@ NTSTATUS SvcStop(FSP_SERVICE* Service)
 
 int wmain(int argc, wchar_t** argv)
 {
+	if (argc == 3 && !wcscmp(argv[1], L"-U"))
+	{ // Offline upgrade of a v1 table, no WinFsp needed.
+		return SpFsUpgrade(argv[2]);
+	}
 	if (!NT_SUCCESS(FspLoad(0)))
 	{
 		return ERROR_DELAY_LOAD_FAILED;
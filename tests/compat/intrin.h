@@ -0,0 +1,14 @@
+#pragma once
+// __cpuid the way MSVC declares it, from the compiler's cpuid.h.
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+
+static inline void compatcpuid(int* info, int leaf)
+{
+	__cpuid_count(leaf, 0, info[0], info[1], info[2], info[3]);
+}
+
+#undef __cpuid
+#define __cpuid compatcpuid
+#endif
@@ -0,0 +1,109 @@
+#pragma once
+// The part of windows.h SpaceFS.cpp uses, enough to build the core on other systems for the tests.
+// HANDLE is a file descriptor. The C++ headers come first so min and max do not break them.
+
+#include <algorithm>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef void* HANDLE;
+typedef unsigned long DWORD;
+typedef unsigned long ULONG;
+typedef long long LONGLONG;
+typedef int BOOL;
+typedef wchar_t* PWSTR;
+typedef const wchar_t* LPCWSTR;
+
+typedef union _LARGE_INTEGER
+{
+	struct
+	{
+		DWORD LowPart;
+		int32_t HighPart;
+	};
+	LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef struct _FILETIME
+{
+	DWORD dwLowDateTime;
+	DWORD dwHighDateTime;
+} FILETIME;
+
+#define MAX_PATH 260
+
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+
+static inline BOOL SetFilePointerEx(HANDLE hFile, LARGE_INTEGER Distance, PLARGE_INTEGER NewPointer, DWORD MoveMethod)
+{
+	off_t Pos = lseek((int)(intptr_t)hFile, Distance.QuadPart, MoveMethod == 0 ? SEEK_SET : MoveMethod == 1 ? SEEK_CUR : SEEK_END);
+	if (NewPointer)
+	{
+		NewPointer->QuadPart = Pos;
+	}
+	return Pos >= 0;
+}
+
+static inline BOOL ReadFile(HANDLE hFile, void* Buffer, DWORD Length, DWORD* Read, void*)
+{
+	ssize_t Done = read((int)(intptr_t)hFile, Buffer, Length);
+	if (Read)
+	{
+		*Read = Done < 0 ? 0 : (DWORD)Done;
+	}
+	return Done >= 0;
+}
+
+static inline BOOL WriteFile(HANDLE hFile, const void* Buffer, DWORD Length, DWORD* Written, void*)
+{
+	ssize_t Done = write((int)(intptr_t)hFile, Buffer, Length);
+	if (Written)
+	{
+		*Written = Done < 0 ? 0 : (DWORD)Done;
+	}
+	return Done >= 0;
+}
+
+static inline BOOL FlushFileBuffers(HANDLE hFile)
+{
+	return fsync((int)(intptr_t)hFile) == 0;
+}
+
+static inline DWORD GetLastError()
+{
+	return 0;
+}
+
+static inline void GetSystemTimeAsFileTime(FILETIME* Time)
+{
+	struct timespec Now;
+	clock_gettime(CLOCK_REALTIME, &Now);
+	uint64_t T = (uint64_t)Now.tv_sec * 10000000 + Now.tv_nsec / 100 + 116444736000000000ULL;
+	Time->dwLowDateTime = (DWORD)T;
+	Time->dwHighDateTime = (DWORD)(T >> 32);
+}
+
+static inline unsigned char _BitScanForward(unsigned long* Index, unsigned long Mask)
+{
+	if (!(Mask & 0xffffffffUL))
+	{
+		return 0;
+	}
+	*Index = __builtin_ctz((unsigned)Mask);
+	return 1;
+}
@@ -0,0 +1,114 @@
+// dirindex and streamindex against a scan of every name in filenames, through creates, deletes, renames, compaction and rebuilds.
+
+#include "testfs.h"
+
+int main(int argc, char** argv)
+{
+	buildmaps();
+	std::mt19937 rng(argc > 1 ? atoi(argv[1]) : 1);
+	unsigned long long filenamecount = 0;
+	char* filenames = NULL;
+	char* tablestr = NULL;
+	if (newvolume(filenamecount, filenames, tablestr))
+	{
+		return 1;
+	}
+	const char* dirs[] = { "/", "/Docs", "/docs/Old", "/src" };
+	std::vector<std::string> names;
+	auto randomname = [&]()
+	{ // Mixed case so folding matters, some streams and some names outside any directory.
+		std::string dir = dirs[rng() % 4];
+		std::string name = (dir == "/" ? "" : dir) + "/" + (rng() % 2 ? "F" : "f") + std::to_string(rng() % 200);
+		switch (rng() % 6)
+		{
+		case 0:
+			name += rng() % 2 ? ":s" : ":S" + std::to_string(rng() % 3);
+			break;
+		case 1:
+			name = name.substr(1);
+			break;
+		}
+		return name;
+	};
+	int fails = 0;
+	for (unsigned it = 0; it < 20000; it++)
+	{
+		std::string name = randomname();
+		std::wstring wname = widen(name);
+		unsigned long long filenameindex = 0;
+		unsigned long long filenamestrindex = 0;
+		switch (names.size() < 8 ? 0 : rng() % 6)
+		{
+		case 0:
+		case 1:
+			getfilenameindex((PWSTR)wname.c_str(), filenames, filenamecount, filenameindex, filenamestrindex);
+			if (filenameindex == filenamecount)
+			{
+				fails += check(!createfile((PWSTR)wname.c_str(), 0, 0, 448, 0, filenamecount, filenames, charmap, tablestr), "createfile");
+				names.push_back(name);
+			}
+			break;
+		case 2:
+		{
+			unsigned long long k = rng() % names.size();
+			std::wstring old = widen(names[k]);
+			getfilenameindex((PWSTR)old.c_str(), filenames, filenamecount, filenameindex, filenamestrindex);
+			unsigned long long index = gettablestrindex((PWSTR)old.c_str(), filenames, tablestr, filenamecount);
+			fails += check(!deletefile(index, filenameindex, filenamestrindex, filenamecount, filenames, tablestr), "deletefile");
+			names.erase(names.begin() + k);
+			break;
+		}
+		case 3:
+		{
+			getfilenameindex((PWSTR)wname.c_str(), filenames, filenamecount, filenameindex, filenamestrindex);
+			if (filenameindex < filenamecount)
+			{
+				break;
+			}
+			unsigned long long k = rng() % names.size();
+			std::wstring old = widen(names[k]);
+			getfilenameindex((PWSTR)old.c_str(), filenames, filenamecount, filenameindex, filenamestrindex);
+			fails += check(!renamefile((PWSTR)old.c_str(), (PWSTR)wname.c_str(), filenamestrindex, filenames), "renamefile");
+			names[k] = name;
+			break;
+		}
+		case 4:
+			if (rng() % 50 == 0)
+			{
+				fails += check(!compactfiles(filenamecount, filenames, tablestr), "compactfiles");
+			}
+			break;
+		case 5:
+			if (rng() % 20 == 0)
+			{ // What a mount or a journal replay leaves
+				reindex = true;
+			}
+			break;
+		}
+		if (it % 13)
+		{
+			continue;
+		}
+		for (const char* dir : { "/", "/docs", "/DOCS", "/docs/old", "/Src", "/none" })
+		{
+			std::wstring wdir = widen(dir);
+			fails += check(getdirindex((PWSTR)wdir.c_str(), filenames, filenamecount) == scanchildren(filenames, filenamecount, dir, false), dir);
+		}
+		for (unsigned q = 0; q < 8; q++)
+		{
+			std::string file = names[rng() % names.size()];
+			file = file.substr(0, file.find(':'));
+			std::wstring wfile = widen(file);
+			fails += check(getstreamindex((PWSTR)wfile.c_str(), filenames, filenamecount) == scanchildren(filenames, filenamecount, file, true), file.c_str());
+		}
+		if (fails)
+		{
+			printf("iteration %u\n", it);
+			break;
+		}
+	}
+	printf("%zu files, %d failures\n", names.size(), fails);
+	free(filenames);
+	free(tablestr);
+	return fails != 0;
+}
@@ -0,0 +1,99 @@
+// The EA block behind GetEa and SetEa, random sets and removes against a list in the order NTFS keeps them.
+
+#include "testfs.h"
+
+struct Model
+{
+	std::string name;
+	unsigned char flags;
+	std::string value;
+};
+
+static std::string upper(std::string str)
+{
+	for (unsigned long long i = 0; i < str.size(); i++)
+	{
+		str[i] = toupper(str[i] & 0xff);
+	}
+	return str;
+}
+
+static int compare(Eas& ea, std::vector<Model>& model)
+{ // Every EA in order through nextea, each one by name through findea and the reported size.
+	int fails = 0;
+	unsigned long long o = 0;
+	unsigned long long packed = 0;
+	unsigned char flags = 0;
+	std::string name;
+	std::string value;
+	for (Model& m : model)
+	{
+		if (check(!nextea(ea, o, flags, name, value), "nextea ended early") || check(name == m.name && flags == m.flags && value == m.value, "nextea order"))
+		{
+			return 1;
+		}
+		std::string lower = m.name;
+		foldfilename(lower);
+		fails += check(!findea(ea, lower, flags, value) && flags == m.flags && value == m.value, "findea");
+		packed += 5 + m.name.size() + m.value.size();
+	}
+	fails += check(nextea(ea, o, flags, name, value) != 0, "nextea past the end");
+	fails += check(easize(ea) == packed, "easize");
+	fails += check(ea.index.size() == model.size(), "index size");
+	Eas reread;
+	reread.block = ea.block;
+	fails += check(!indexea(reread) && reread.index == ea.index, "indexea");
+	return fails;
+}
+
+int main(int argc, char** argv)
+{
+	std::mt19937 rng(argc > 1 ? atoi(argv[1]) : 1);
+	int fails = 0;
+	Eas ea;
+	fails += check(setea(ea, "", 0, "x") == 1, "empty name");
+	fails += check(setea(ea, std::string(256, 'n'), 0, "x") == 1, "long name");
+	fails += check(setea(ea, "n", 0, std::string(65536, 'v')) == 1, "long value");
+	fails += check(!setea(ea, std::string(255, 'n'), 0, std::string(65535, 'v')) && ea.block.size() == 4 + 255 + 65535, "largest EA");
+	fails += check(!setea(ea, std::string(255, 'N'), 0, "") && ea.block.empty() && ea.index.empty(), "remove largest");
+	fails += check(!setea(ea, "missing", 0, "") && ea.block.empty(), "remove missing");
+	std::vector<Model> model;
+	for (unsigned it = 0; it < 20000 && !fails; it++)
+	{
+		std::string name = (rng() % 2 ? "Ea." : "ea.") + std::to_string(rng() % 40);
+		std::string value(rng() % 4 ? rng() % 300 : rng() % 2 ? 0 : 1000 + rng() % 64536, 0);
+		for (char& c : value)
+		{
+			c = rng() & 0xff;
+		}
+		unsigned char flags = rng() % 2 ? 0x80 : 0;
+		fails += check(!setea(ea, name, flags, value), "setea");
+		for (unsigned long long i = 0; i < model.size(); i++)
+		{
+			if (model[i].name == upper(name))
+			{
+				model.erase(model.begin() + i);
+				break;
+			}
+		}
+		if (value.size())
+		{
+			model.push_back({ upper(name), flags, value });
+		}
+		if (it % 17 == 0)
+		{
+			fails += compare(ea, model);
+		}
+	}
+	fails += compare(ea, model);
+	if (ea.block.size())
+	{ // A block cut short, as a torn write of the stream would leave it
+		Eas torn;
+		torn.block = ea.block.substr(0, ea.block.size() - 1);
+		fails += check(indexea(torn) == 1, "indexea of a torn block");
+		torn.block = ea.block.substr(0, 3);
+		fails += check(indexea(torn) == 1, "indexea of a torn header");
+	}
+	printf("%zu EAs, %d failures\n", model.size(), fails);
+	return fails != 0;
+}
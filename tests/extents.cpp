@@ -0,0 +1,77 @@
+// readwriteextents against the disk image byte by byte, with the number of readwritedrive calls each transfer
+// takes. Whole sectors that carry on from each other go in one call with their sectors in reverse, split at
+// maxtransfer, and anything else keeps its own call per extent or partial sector.
+
+#include "testfs.h"
+
+extern unsigned long long maxtransfer;
+
+static const unsigned long long sectorsize = 512;
+static const unsigned long long disksize = 1 << 20;
+
+static int transfer(HANDLE hDisk, std::vector<Extent> extents, unsigned long long start, unsigned long long len, unsigned long long writes, unsigned long long reads, const char* what)
+{ // Writes random bytes, checks where each one landed, then reads them back.
+	unsigned long long offset = 0;
+	for (Extent& extent : extents)
+	{
+		extent.offset = offset;
+		offset += extent.count * (extent.end - extent.start);
+	}
+	std::string data(len, 0);
+	for (char& c : data)
+	{
+		c = rand() & 0xff;
+	}
+	int fails = 0;
+	char* buf = &data[0];
+	unsigned long long calls = getdrivecalls();
+	fails += check(!readwriteextents(hDisk, sectorsize, extents, start, len, disksize, buf, 1), what);
+	fails += check(getdrivecalls() - calls == writes, what);
+	std::string disk(disksize, 0);
+	fails += check(pread((int)(intptr_t)hDisk, &disk[0], disksize, 0) == (ssize_t)disksize, what);
+	for (unsigned long long i = 0, e = 0; i < len && !fails; i++)
+	{
+		unsigned long long pos = start + i;
+		while (pos >= extents[e].offset + extents[e].count * (extents[e].end - extents[e].start))
+		{
+			e++;
+		}
+		unsigned long long size = extents[e].end - extents[e].start;
+		pos -= extents[e].offset;
+		fails += check(disk[disksize - ((extents[e].sector + pos / size) * sectorsize + sectorsize) + extents[e].start + pos % size] == data[i], what);
+	}
+	std::string back(len, 0);
+	buf = &back[0];
+	calls = getdrivecalls();
+	fails += check(!readwriteextents(hDisk, sectorsize, extents, start, len, disksize, buf, 0), what);
+	fails += check(getdrivecalls() - calls == reads && back == data, what);
+	return fails;
+}
+
+int main()
+{
+	char path[] = "/tmp/spacefsXXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0 || ftruncate(fd, disksize))
+	{
+		return 1;
+	}
+	unlink(path);
+	HANDLE hDisk = (HANDLE)(intptr_t)fd;
+	srand(1);
+	int fails = 0;
+	fails += transfer(hDisk, { { 0, 8, 16, 0, 512 } }, 0, 16 * 512, 1, 1, "one extent");
+	fails += transfer(hDisk, { { 0, 8, 4, 0, 512 }, { 0, 12, 12, 0, 512 } }, 0, 16 * 512, 1, 1, "extents that carry on");
+	fails += transfer(hDisk, { { 0, 8, 4, 0, 512 }, { 0, 30, 12, 0, 512 } }, 0, 16 * 512, 2, 2, "extents with a gap");
+	fails += transfer(hDisk, { { 0, 40, 4, 0, 512 }, { 0, 36, 4, 0, 512 } }, 0, 8 * 512, 2, 2, "extents running backwards");
+	fails += transfer(hDisk, { { 0, 8, 16, 0, 512 } }, 100, 16 * 512 - 100, 3, 2, "unaligned start");
+	fails += transfer(hDisk, { { 0, 8, 16, 0, 512 } }, 0, 16 * 512 - 100, 3, 2, "unaligned end");
+	fails += transfer(hDisk, { { 0, 8, 4, 0, 512 }, { 0, 50, 1, 100, 300 } }, 0, 4 * 512 + 200, 3, 2, "partial sector after a run");
+	fails += transfer(hDisk, { { 0, 8, 1, 0, 512 } }, 0, 512, 1, 1, "one sector");
+	maxtransfer = 4 * 512;
+	fails += transfer(hDisk, { { 0, 8, 16, 0, 512 } }, 0, 16 * 512, 4, 4, "split at maxtransfer");
+	fails += transfer(hDisk, { { 0, 8, 4, 0, 512 }, { 0, 12, 6, 0, 512 } }, 0, 10 * 512, 3, 3, "split across extents");
+	maxtransfer = 1 << 24;
+	printf("%s\n", fails ? "failed" : "ok");
+	return fails != 0;
+}
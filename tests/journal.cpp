@@ -0,0 +1,354 @@
+// The metadata journal against a model. Random creates, resizes, writes, deletes, renames and gid changes go out in
+// commits of varying size, a checkpoint follows whenever a commit asks for one. Now and then the volume crashes with
+// changes not yet committed, the table is read back as last checkpointed and the journal replayed over it.
+
+#include <fcntl.h>
+#include "testfs.h"
+
+extern bool journaling;
+extern unsigned long long journalgen;
+extern unsigned long long journaltail;
+
+struct File
+{
+	std::wstring name;
+	std::string data;
+	unsigned long gid;
+};
+
+struct Volume
+{
+	HANDLE hDisk;
+	unsigned long sectorsize;
+	unsigned long tablesize;
+	unsigned long long extratablesize;
+	unsigned long long disksize;
+	unsigned long long usedblocks;
+	unsigned long long filenamecount;
+	char* table;
+	char* tablestr;
+	char* filenames;
+};
+
+static int checkpoint(Volume& v)
+{
+	return journalcheckpoint(v.hDisk, v.sectorsize, charmap, v.tablesize, v.extratablesize, v.disksize, v.filenamecount, v.filenames, v.tablestr, v.table);
+}
+
+static int mount(Volume& v, unsigned long long& replayed)
+{ // What SpFsCreate does with the image, nothing kept from before the crash but the disk.
+	free(v.table);
+	free(v.tablestr);
+	free(v.filenames);
+	v.table = NULL;
+	v.tablestr = NULL;
+	v.filenames = NULL;
+	if (readtable(v.hDisk, v.sectorsize, v.tablesize, v.extratablesize, v.table) || loadtable(v.table, v.tablestr, v.filenames, v.filenamecount))
+	{
+		return 1;
+	}
+	if (replayjournal(v.hDisk, v.sectorsize, charmap, v.disksize, v.filenamecount, v.filenames, v.tablestr, replayed))
+	{
+		return 1;
+	}
+	detectblocks(v.sectorsize, v.disksize, v.tablestr, v.usedblocks);
+	return 0;
+}
+
+static unsigned long long find(Volume& v, const std::wstring& name, unsigned long long& index)
+{
+	unsigned long long filenameindex = 0;
+	unsigned long long filenamestrindex = 0;
+	getfilenameindex((PWSTR)name.c_str(), v.filenames, v.filenamecount, filenameindex, filenamestrindex);
+	index = filenameindex < v.filenamecount ? gettablestrindex((PWSTR)name.c_str(), v.filenames, v.tablestr, v.filenamecount) : 0;
+	return filenameindex;
+}
+
+static int compare(Volume& v, std::vector<File>& files, std::vector<std::wstring>& gone)
+{ // Every committed file with its size, bytes and gid, none of what was lost in the crash.
+	int fails = 0;
+	for (File& f : files)
+	{
+		unsigned long long index = 0;
+		unsigned long long filenameindex = find(v, f.name, index);
+		if (check(filenameindex < v.filenamecount, "file missing"))
+		{
+			return 1;
+		}
+		unsigned long long filesize = 0;
+		getextentfilesize(v.sectorsize, index, v.tablestr, filenameindex, filesize);
+		if (check(filesize == f.data.size(), "file size"))
+		{
+			return 1;
+		}
+		std::string data(filesize + 1, 0);
+		char* buf = &data[0];
+		fails += check(!readwritefile(v.hDisk, v.sectorsize, index, 0, filesize, v.disksize, v.tablestr, buf, filenameindex, 0) && !memcmp(buf, f.data.data(), filesize), "file data");
+		unsigned long gid = 0;
+		chgid(filenameindex, gid, 0);
+		fails += check(gid == f.gid, "gid");
+	}
+	for (std::wstring& name : gone)
+	{
+		unsigned long long index = 0;
+		fails += check(find(v, name, index) >= v.filenamecount, "uncommitted file");
+	}
+	return fails;
+}
+
+static int format(Volume& v, int& fd, unsigned long long journalsize)
+{ // Empty volume with a journal, checkpointed once like a first mount.
+	v = {};
+	v.sectorsize = 512;
+	v.tablesize = 1;
+	v.extratablesize = 512;
+	v.disksize = 8 << 20;
+	char path[] = "/tmp/spacefsXXXXXX";
+	fd = mkstemp(path);
+	if (fd < 0 || ftruncate(fd, v.disksize))
+	{
+		return 1;
+	}
+	unlink(path);
+	v.hDisk = (HANDLE)(intptr_t)fd;
+	v.table = (char*)calloc(512, 1);
+	v.table[0] = (char)128;
+	v.table[6] = (char)255;
+	v.table[7] = (char)254;
+	journaling = false;
+	journalgen = 0;
+	if (newvolume(v.filenamecount, v.filenames, v.tablestr) || createfile(PWSTR(L"!"), 545, 545, 448, 0, v.filenamecount, v.filenames, charmap, v.tablestr))
+	{
+		return 1;
+	}
+	unsigned long long index = 0;
+	unsigned long long filenameindex = find(v, L"!", index);
+	if (trunfile(v.hDisk, v.sectorsize, index, v.tablesize, v.disksize, 0, journalsize, filenameindex, charmap, v.tablestr, v.usedblocks, PWSTR(L"!"), v.filenames, v.filenamecount))
+	{
+		return 1;
+	}
+	return checkpoint(v) || !journaling;
+}
+
+static int run(std::mt19937& rng)
+{
+	Volume v;
+	int fd = -1;
+	if (check(!format(v, fd, 16384), "format"))
+	{
+		return 1;
+	}
+	std::vector<File> files;
+	std::vector<File> committed;
+	unsigned long long commits = 0;
+	unsigned long long checkpoints = 0;
+	unsigned long long full = 0;
+	unsigned long long crashes = 0;
+	unsigned long long replays = 0;
+	unsigned long long batch = 1;
+	int fails = 0;
+	for (unsigned it = 0; it < 4000 && !fails; it++)
+	{
+		unsigned op = rng() % 10;
+		if (files.empty() || op <= 1)
+		{
+			std::wstring name = L"/f" + std::to_wstring(rng() % 100000);
+			unsigned long long index = 0;
+			if (find(v, name, index) < v.filenamecount)
+			{
+				continue;
+			}
+			fails += check(!createfile((PWSTR)name.c_str(), 0, 0, 448, 0, v.filenamecount, v.filenames, charmap, v.tablestr), "createfile");
+			files.push_back({ name, "", 0 });
+		}
+		else
+		{
+			File& f = files[rng() % files.size()];
+			PWSTR name = (PWSTR)f.name.c_str();
+			unsigned long long index = 0;
+			unsigned long long filenameindex = find(v, f.name, index);
+			unsigned long long filenamestrindex = 0;
+			getfilenameindex(name, v.filenames, v.filenamecount, filenameindex, filenamestrindex);
+			unsigned long long size = f.data.size();
+			if (op <= 4)
+			{
+				unsigned long long newsize = rng() % 4 ? rng() % 1000 : rng() % 8000;
+				if (trunfile(v.hDisk, v.sectorsize, index, v.tablesize, v.disksize, size, newsize, filenameindex, charmap, v.tablestr, v.usedblocks, name, v.filenames, v.filenamecount))
+				{
+					continue;
+				}
+				f.data.resize(newsize);
+				for (unsigned long long i = size; i < newsize; i++)
+				{
+					f.data[i] = rng() & 0xff;
+				}
+				if (newsize > size)
+				{
+					char* buf = &f.data[size];
+					fails += check(!readwritefile(v.hDisk, v.sectorsize, index, size, newsize - size, v.disksize, v.tablestr, buf, filenameindex, 1), "write grown");
+				}
+			}
+			else if (op == 5 && size)
+			{
+				unsigned long long start = rng() % size;
+				std::string data(1 + rng() % (size - start), 0);
+				for (char& c : data)
+				{
+					c = rng() & 0xff;
+				}
+				char* buf = &data[0];
+				fails += check(!readwritefile(v.hDisk, v.sectorsize, index, start, data.size(), v.disksize, v.tablestr, buf, filenameindex, 1), "write");
+				f.data.replace(start, data.size(), data);
+			}
+			else if (op == 6)
+			{
+				fails += check(!trunfile(v.hDisk, v.sectorsize, index, v.tablesize, v.disksize, size, 0, filenameindex, charmap, v.tablestr, v.usedblocks, name, v.filenames, v.filenamecount), "truncate before delete");
+				deletefile(index, filenameindex, filenamestrindex, v.filenamecount, v.filenames, v.tablestr);
+				files.erase(files.begin() + (&f - &files[0]));
+			}
+			else if (op == 7)
+			{
+				std::wstring newname = L"/r" + std::to_wstring(rng() % 100000);
+				unsigned long long newindex = 0;
+				if (find(v, newname, newindex) < v.filenamecount)
+				{
+					continue;
+				}
+				fails += check(!renamefile(name, (PWSTR)newname.c_str(), filenamestrindex, v.filenames), "renamefile");
+				f.name = newname;
+			}
+			else
+			{
+				f.gid = rng() & 0xffffff;
+				chgid(filenameindex, f.gid, 1);
+			}
+		}
+		if (it % batch)
+		{
+			continue;
+		}
+		unsigned long long tail = journaltail;
+		unsigned long long gen = journalgen;
+		if (journalcommit(v.hDisk, v.sectorsize, v.disksize, v.tablestr, v.filenames, v.filenamecount))
+		{ // Half full, or this commit did not fit at all
+			full += journaltail == tail;
+			fails += check(!checkpoint(v) && journalgen == gen + 1, "checkpoint");
+			checkpoints++;
+		}
+		commits++;
+		committed = files;
+		batch = rng() % 16 ? 1 + rng() % 8 : 200 + rng() % 200;
+		if (rng() % 20)
+		{
+			continue;
+		}
+		std::vector<std::wstring> gone;
+		for (unsigned i = rng() % 6; i; i--)
+		{ // Lost in the crash, only changes that do not touch the data of committed files
+			std::wstring name = L"/u" + std::to_wstring(rng() % 100000);
+			unsigned long long index = 0;
+			if (find(v, name, index) >= v.filenamecount && !createfile((PWSTR)name.c_str(), 0, 0, 448, 0, v.filenamecount, v.filenames, charmap, v.tablestr))
+			{
+				gone.push_back(name);
+			}
+			if (files.size())
+			{
+				File& f = files[rng() % files.size()];
+				unsigned long long filenameindex = find(v, f.name, index);
+				unsigned long gid = f.gid ^ 1;
+				chgid(filenameindex, gid, 1);
+			}
+		}
+		unsigned long long replayed = 0;
+		fails += check(!mount(v, replayed), "mount");
+		crashes++;
+		replays += replayed;
+		files = committed;
+		fails += compare(v, files, gone);
+		fails += check(!checkpoint(v), "checkpoint after replay");
+	}
+	fails += check(checkpoints && crashes && replays, "checkpoints, crashes and replays");
+	printf("%llu commits, %llu checkpoints, %llu of them full, %llu crashes, %llu commits replayed, %d failures\n", commits, checkpoints, full, crashes, replays, fails);
+	close(fd);
+	free(v.table);
+	free(v.tablestr);
+	free(v.filenames);
+	return fails;
+}
+
+static int torn()
+{ // Two commits then a crash with the second one only partly written, only the first is replayed.
+	Volume v;
+	int fd = -1;
+	if (check(!format(v, fd, 16384), "format"))
+	{
+		return 1;
+	}
+	int fails = 0;
+	fails += check(!createfile(PWSTR(L"/first"), 1, 0, 448, 0, v.filenamecount, v.filenames, charmap, v.tablestr), "createfile");
+	fails += check(!journalcommit(v.hDisk, v.sectorsize, v.disksize, v.tablestr, v.filenames, v.filenamecount), "commit");
+	unsigned long long tail = journaltail;
+	fails += check(!createfile(PWSTR(L"/second"), 2, 0, 448, 0, v.filenamecount, v.filenames, charmap, v.tablestr), "createfile");
+	fails += check(!journalcommit(v.hDisk, v.sectorsize, v.disksize, v.tablestr, v.filenames, v.filenamecount), "commit");
+	unsigned long long index = 0;
+	unsigned long long filenameindex = find(v, L"!", index);
+	std::vector<Extent>& extents = getextents(v.sectorsize, index, v.tablestr, filenameindex);
+	std::string block(512, 0);
+	char* buf = &block[0];
+	fails += check(!readwriteextents(v.hDisk, v.sectorsize, extents, tail, 512, v.disksize, buf, 0), "read block");
+	block[20] ^= 1;
+	fails += check(!readwriteextents(v.hDisk, v.sectorsize, extents, tail, 512, v.disksize, buf, 1), "tear block");
+	unsigned long long replayed = 0;
+	fails += check(!mount(v, replayed), "mount");
+	fails += check(replayed == 1, "replayed up to the torn block");
+	fails += check(find(v, L"/first", index) < v.filenamecount && find(v, L"/second", index) >= v.filenamecount, "files after replay");
+	printf("torn commit: %llu replayed, %d failures\n", replayed, fails);
+	close(fd);
+	free(v.table);
+	free(v.tablestr);
+	free(v.filenames);
+	return fails;
+}
+
+static int overflow()
+{ // More than the journal holds in one commit, it is not written and the checkpoint takes it all.
+	Volume v;
+	int fd = -1;
+	if (check(!format(v, fd, 4096), "format"))
+	{
+		return 1;
+	}
+	int fails = 0;
+	std::vector<File> files;
+	for (unsigned i = 0; i < 200; i++)
+	{
+		std::wstring name = L"/f" + std::to_wstring(i);
+		fails += check(!createfile((PWSTR)name.c_str(), i, 0, 448, 0, v.filenamecount, v.filenames, charmap, v.tablestr), "createfile");
+		files.push_back({ name, "", i });
+	}
+	unsigned long long tail = journaltail;
+	unsigned long long gen = journalgen;
+	fails += check(journalcommit(v.hDisk, v.sectorsize, v.disksize, v.tablestr, v.filenames, v.filenamecount) && journaltail == tail, "commit too large for the journal");
+	fails += check(!checkpoint(v) && journalgen == gen + 1, "checkpoint");
+	unsigned long long replayed = 0;
+	std::vector<std::wstring> gone;
+	fails += check(!mount(v, replayed), "mount");
+	fails += check(!replayed, "nothing to replay");
+	fails += compare(v, files, gone);
+	printf("full journal: %llu replayed, %d failures\n", replayed, fails);
+	close(fd);
+	free(v.table);
+	free(v.tablestr);
+	free(v.filenames);
+	return fails;
+}
+
+int main(int argc, char** argv)
+{
+	std::mt19937 rng(argc > 1 ? atoi(argv[1]) : 1);
+	buildmaps();
+	int fails = run(rng);
+	fails += torn();
+	fails += overflow();
+	return fails != 0;
+}
@@ -0,0 +1,54 @@
+// Listing one directory out of 10k, 100k and 1M files, the index against the scan ReadDirectory did before it.
+
+#include "testfs.h"
+
+int main(int argc, char** argv)
+{
+	buildmaps();
+	unsigned long long maxcount = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+	printf("%10s %12s %14s %14s\n", "files", "rebuild ms", "index us/list", "scan us/list");
+	for (unsigned long long count = 10000; count <= maxcount; count *= 10)
+	{ // A thousand directories under the root, the files spread across them.
+		std::string blob;
+		for (unsigned long long i = 0; i < count; i++)
+		{
+			blob += i < 1000 ? "/Dir" + std::to_string(i) : "/dir" + std::to_string(i % 1000) + "/File" + std::to_string(i);
+			blob += (char)255;
+		}
+		blob += (char)254;
+		char* filenames = (char*)calloc(blob.size() + 1, 1);
+		if (!filenames)
+		{
+			return 1;
+		}
+		memcpy(filenames, blob.data(), blob.size());
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		buildfilenameindex(filenames, count);
+		double rebuild = seconds(start);
+		unsigned lists = 1000;
+		unsigned long long found = 0;
+		start = std::chrono::steady_clock::now();
+		for (unsigned i = 0; i < lists; i++)
+		{
+			std::wstring dir = widen("/DIR" + std::to_string(i * 7 % 1000));
+			found += getdirindex((PWSTR)dir.c_str(), filenames, count).size();
+		}
+		double index = seconds(start) / lists;
+		unsigned scans = count < 1000000 ? 20 : 3;
+		unsigned long long scanned = 0;
+		start = std::chrono::steady_clock::now();
+		for (unsigned i = 0; i < scans; i++)
+		{
+			scanned += scanchildren(filenames, count, "/dir" + std::to_string(i * 7 % 1000), false).size();
+		}
+		double scan = seconds(start) / scans;
+		if (found / lists != scanned / scans)
+		{
+			printf("FAIL %llu files, index listed %llu, scan %llu\n", count, found / lists, scanned / scans);
+			return 1;
+		}
+		printf("%10llu %12.1f %14.2f %14.2f\n", count, rebuild * 1e3, index * 1e6, scan * 1e6);
+		free(filenames);
+	}
+	return 0;
+}
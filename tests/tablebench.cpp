@@ -0,0 +1,82 @@
+// Finding a file's table entry among 1k to 1M files, the end offsets against counting dots like gettablestrindex used to.
+
+#include "testfs.h"
+
+static unsigned long long scanentry(char* tablestr, unsigned long long filenameindex)
+{ // Offset of the dot ending entry filenameindex
+	unsigned long long dots = 0;
+	for (unsigned long long i = 0; tablestr[i]; i++)
+	{
+		if ((tablestr[i] & 0xff) == 46 && dots++ == filenameindex)
+		{
+			return i;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char** argv)
+{
+	buildmaps();
+	std::mt19937 rng(1);
+	unsigned long long maxcount = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+	printf("%10s %14s %14s\n", "files", "index ns/find", "scan ns/find");
+	for (unsigned long long count = 1000; count <= maxcount; count *= 10)
+	{ // One or two sectors each, the size of the entries matters as much as their number to the scan.
+		std::string blob;
+		std::string entries;
+		for (unsigned long long i = 0; i < count; i++)
+		{
+			blob += "/File" + std::to_string(i);
+			blob += (char)255;
+			entries += i % 2 ? std::to_string(i * 2) + "-" + std::to_string(i * 2 + 1) + "." : std::to_string(i * 2) + ".";
+		}
+		blob += (char)254;
+		char* filenames = (char*)calloc(blob.size() + 1, 1);
+		char* tablestr = (char*)calloc(entries.size() + 1, 1);
+		if (!filenames || !tablestr)
+		{
+			return 1;
+		}
+		memcpy(filenames, blob.data(), blob.size());
+		memcpy(tablestr, entries.data(), entries.size());
+		reindex = true;
+		buildtablestrindex(tablestr);
+		std::vector<std::wstring> names;
+		std::vector<unsigned long long> indexes;
+		for (unsigned i = 0; i < 100000; i++)
+		{
+			indexes.push_back(rng() % count);
+			names.push_back(widen("/FILE" + std::to_string(indexes.back())));
+		}
+		gettablestrindex((PWSTR)names[0].c_str(), filenames, tablestr, count);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (unsigned i = 0; i < names.size(); i++)
+		{
+			gettablestrindex((PWSTR)names[i].c_str(), filenames, tablestr, count);
+		}
+		double index = seconds(start) / names.size();
+		unsigned scans = count < 1000000 ? 1000 : 20;
+		unsigned long long scanned = 0;
+		unsigned long long want = 0;
+		start = std::chrono::steady_clock::now();
+		for (unsigned i = 0; i < scans; i++)
+		{
+			scanned += scanentry(tablestr, indexes[i]);
+		}
+		double scan = seconds(start) / scans;
+		for (unsigned i = 0; i < scans; i++)
+		{
+			want += gettablestrindex((PWSTR)names[i].c_str(), filenames, tablestr, count);
+		}
+		if (scanned != want)
+		{
+			printf("FAIL %llu files, index found %llu, scan %llu\n", count, want, scanned);
+			return 1;
+		}
+		printf("%10llu %14.1f %14.1f\n", count, index * 1e9, scan * 1e9);
+		free(filenames);
+		free(tablestr);
+	}
+	return 0;
+}
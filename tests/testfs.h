@@ -0,0 +1,117 @@
+#pragma once
+// Shared by the tests, an empty in memory volume with the same maps and special files a mount sets up.
+
+#include <chrono>
+#include <random>
+#include "SpaceFS.h"
+
+extern bool reindex;
+
+static char* charmap = (char*)"0123456789-,.; ";
+
+static void buildmaps()
+{ // Same pairs as BuildMaps in WinFspTran.cpp
+	std::unordered_map<unsigned, unsigned> Emap = {};
+	std::unordered_map<unsigned, unsigned> Dmap = {};
+	unsigned p = 0;
+	for (unsigned i = 0; i < 15; i++)
+	{
+		for (unsigned o = 0; o < 15; o++)
+		{
+			unsigned c = charmap[i] << 8 | charmap[o];
+			Emap[c] = p;
+			Dmap[p] = c;
+			p++;
+		}
+	}
+	handmaps(Emap, Dmap);
+}
+
+static int newvolume(unsigned long long& filenamecount, char*& filenames, char*& tablestr)
+{ // Root security, root, volume label and mount marker like a fresh format.
+	filenamecount = 0;
+	tablestr = (char*)calloc(1, 1);
+	filenames = (char*)calloc(2, 1);
+	if (!tablestr || !filenames)
+	{
+		return 1;
+	}
+	filenames[0] = 254;
+	reindex = true;
+	for (const wchar_t* name : { L"", L"/", L":", L"?" })
+	{
+		if (createfile((PWSTR)name, 0, 0, 448, 0, filenamecount, filenames, charmap, tablestr))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static std::wstring widen(const std::string& str)
+{
+	return std::wstring(str.begin(), str.end());
+}
+
+static std::string folded(std::string str)
+{
+	foldfilename(str);
+	return str;
+}
+
+static double seconds(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static std::map<std::string, std::string> scanchildren(char* filenames, unsigned long long filenamecount, const std::string& parent, bool streams)
+{ // What ReadDirectory and GetStreamInfo found before the index, every name in filenames checked against parent.
+	std::map<std::string, std::string> children;
+	unsigned long long filenameindex = 0;
+	unsigned long long start = 0;
+	for (unsigned long long i = 0; filenameindex < filenamecount && filenames[i]; i++)
+	{
+		if ((filenames[i] & 0xff) != 255 && (filenames[i] & 0xff) != 42)
+		{
+			continue;
+		}
+		std::string name(filenames + start, i - start);
+		if ((filenames[i] & 0xff) == 255)
+		{
+			filenameindex++;
+		}
+		start = i + 1;
+		if (name.empty() || name[0] == 1)
+		{
+			continue;
+		}
+		unsigned long long stream = name.find(':');
+		if (streams)
+		{
+			if (stream && stream != std::string::npos && folded(name.substr(0, stream)) == folded(parent))
+			{
+				children.emplace(folded(name.substr(stream + 1)), name.substr(stream + 1));
+			}
+			continue;
+		}
+		unsigned long long loc = name.rfind('/');
+		if (name.size() < 2 || name[0] != '/' || loc == name.size() - 1 || stream != std::string::npos)
+		{
+			continue;
+		}
+		if (folded(name.substr(0, loc ? loc : 1)) == folded(parent))
+		{
+			children.emplace(folded(name.substr(loc + 1)), name.substr(loc + 1));
+		}
+	}
+	return children;
+}
+
+static int check(bool ok, const char* what)
+{
+	if (!ok)
+	{
+		printf("FAIL %s\n", what);
+	}
+	return !ok;
+}
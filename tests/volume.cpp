@@ -0,0 +1,324 @@
+// Files on a volume image against a model, random creates, resizes, writes, deletes and renames. The table is
+// written out and read back every few steps and the volume goes on from what was read, once per table format.
+// With extended records small files move into their table entries and back out as they are resized, and reparse
+// tags are checked against their buffers after each reload.
+
+#include <fcntl.h>
+#include "testfs.h"
+
+extern std::vector<std::string> descriptors;
+
+struct File
+{
+	std::wstring name;
+	std::string data;
+	unsigned long gid;
+	std::string descriptor;
+	unsigned long tag;
+};
+
+struct Volume
+{
+	HANDLE hDisk;
+	unsigned long sectorsize;
+	unsigned long tablesize;
+	unsigned long long extratablesize;
+	unsigned long long disksize;
+	unsigned long long usedblocks;
+	unsigned long long filenamecount;
+	char* table;
+	char* tablestr;
+	char* filenames;
+};
+
+static int reload(Volume& v)
+{ // Out to the image and back in, as an unmount and mount would.
+	flushatimes(v.filenamecount);
+	if (simptable(v.hDisk, v.sectorsize, charmap, v.tablesize, v.extratablesize, v.filenamecount, v.filenames, v.tablestr, v.table))
+	{
+		return 1;
+	}
+	free(v.table);
+	free(v.tablestr);
+	free(v.filenames);
+	v.table = NULL;
+	v.tablestr = NULL;
+	v.filenames = NULL;
+	if (readtable(v.hDisk, v.sectorsize, v.tablesize, v.extratablesize, v.table) || loadtable(v.table, v.tablestr, v.filenames, v.filenamecount))
+	{
+		return 1;
+	}
+	if (loaddescriptors(v.hDisk, v.sectorsize, v.disksize, v.tablestr, v.filenames, v.filenamecount))
+	{
+		return 1;
+	}
+	unsigned long long usedblocks = v.usedblocks;
+	detectblocks(v.sectorsize, v.disksize, v.tablestr, v.usedblocks);
+	return check(usedblocks == v.usedblocks, "used sectors") + check(!checkreparse(v.hDisk, v.sectorsize, v.disksize, v.tablestr, v.filenamecount), "reparse tags");
+}
+
+static int compare(Volume& v, std::vector<File>& files, unsigned long long& inlined)
+{ // Every file by name, its size, bytes, gid and descriptor.
+	int fails = 0;
+	inlined = 0;
+	for (File& f : files)
+	{
+		PWSTR name = (PWSTR)f.name.c_str();
+		unsigned long long filenameindex = 0;
+		unsigned long long filenamestrindex = 0;
+		getfilenameindex(name, v.filenames, v.filenamecount, filenameindex, filenamestrindex);
+		if (check(filenameindex < v.filenamecount, "file missing"))
+		{
+			return 1;
+		}
+		unsigned long long index = gettablestrindex(name, v.filenames, v.tablestr, v.filenamecount);
+		unsigned long long filesize = 0;
+		getextentfilesize(v.sectorsize, index, v.tablestr, filenameindex, filesize);
+		if (check(filesize == f.data.size(), "file size"))
+		{
+			return 1;
+		}
+		if (filesize && getextents(v.sectorsize, index, v.tablestr, filenameindex)[0].sector == ULLONG_MAX)
+		{
+			fails += check(v.table[0] & 32 && filesize <= 60, "kept in the table");
+			inlined++;
+		}
+		std::string data(filesize + 1, 0);
+		char* buf = &data[0];
+		fails += check(!readwritefile(v.hDisk, v.sectorsize, index, 0, filesize, v.disksize, v.tablestr, buf, filenameindex, 0) && !memcmp(buf, f.data.data(), filesize), "file data");
+		unsigned long gid = 0;
+		chgid(filenameindex, gid, 0);
+		fails += check(gid == f.gid, "gid");
+		unsigned long id = 0;
+		chdescriptor(filenameindex, id, 0);
+		fails += check(getdescriptor(id) == f.descriptor, "descriptor");
+		unsigned long tag = 0;
+		chreparse(filenameindex, tag, 0);
+		fails += check(tag == f.tag, "reparse tag");
+	}
+	return fails;
+}
+
+static int run(std::mt19937& rng, bool extended)
+{
+	Volume v = {};
+	v.sectorsize = 512;
+	v.tablesize = 1;
+	v.extratablesize = 512;
+	v.disksize = 8 << 20;
+	char path[] = "/tmp/spacefsXXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0 || ftruncate(fd, v.disksize))
+	{
+		return 1;
+	}
+	unlink(path);
+	v.hDisk = (HANDLE)(intptr_t)fd;
+	v.table = (char*)calloc(512, 1);
+	v.table[0] = (char)128;
+	v.table[6] = (char)255;
+	v.table[7] = (char)254;
+	if (newvolume(v.filenamecount, v.filenames, v.tablestr) || loaddescriptors(v.hDisk, v.sectorsize, v.disksize, v.tablestr, v.filenames, v.filenamecount))
+	{
+		return 1;
+	}
+
+	std::vector<std::string> pool;
+	for (unsigned i = 0; i < 8; i++)
+	{
+		pool.push_back(std::string(20 + rng() % 100, 0));
+		for (char& c : pool.back())
+		{
+			c = rng() & 0xff;
+		}
+	}
+	std::vector<File> files;
+	unsigned long long inlined = 0;
+	int fails = 0;
+	for (unsigned it = 0; it < 3000 && !fails; it++)
+	{
+		if (extended && it == 500)
+		{ // Switched on a volume in use, like mounting with -x 1
+			extendedrecords(v.table);
+		}
+		unsigned op = rng() % 12;
+		if (files.empty() || op <= 1)
+		{
+			std::wstring name = L"/f" + std::to_wstring(rng() % 100000);
+			unsigned long long filenameindex = 0;
+			unsigned long long filenamestrindex = 0;
+			getfilenameindex((PWSTR)name.c_str(), v.filenames, v.filenamecount, filenameindex, filenamestrindex);
+			if (filenameindex < v.filenamecount)
+			{
+				continue;
+			}
+			fails += check(!createfile((PWSTR)name.c_str(), 0, 0, 448, 0, v.filenamecount, v.filenames, charmap, v.tablestr), "createfile");
+			getfilenameindex((PWSTR)name.c_str(), v.filenames, v.filenamecount, filenameindex, filenamestrindex);
+			unsigned long gid = rng() & 0xffffff;
+			chgid(filenameindex, gid, 1);
+			files.push_back({ name, "", gid, "", 0 });
+			continue;
+		}
+		File& f = files[rng() % files.size()];
+		PWSTR name = (PWSTR)f.name.c_str();
+		unsigned long long filenameindex = 0;
+		unsigned long long filenamestrindex = 0;
+		getfilenameindex(name, v.filenames, v.filenamecount, filenameindex, filenamestrindex);
+		unsigned long long index = gettablestrindex(name, v.filenames, v.tablestr, v.filenamecount);
+		unsigned long long size = f.data.size();
+		if (f.tag && op <= 7)
+		{ // Its data changes, so it stops being a reparse point as DeleteReparsePoint would do
+			unsigned long winattrs = 0;
+			chwinattrs(filenameindex, winattrs, 1);
+			chreparse(filenameindex, f.tag = 0, 1);
+		}
+		if (op <= 5)
+		{ // Mostly small files, now and then a few sectors
+			unsigned long long newsize = rng() % 4 ? rng() % 200 : rng() % 5000;
+			if (trunfile(v.hDisk, v.sectorsize, index, v.tablesize, v.disksize, size, newsize, filenameindex, charmap, v.tablestr, v.usedblocks, name, v.filenames, v.filenamecount))
+			{
+				continue;
+			}
+			f.data.resize(newsize);
+			if (newsize > size)
+			{ // Grown bytes are undefined until written
+				char* buf = &f.data[size];
+				for (unsigned long long i = size; i < newsize; i++)
+				{
+					f.data[i] = rng() & 0xff;
+				}
+				fails += check(!readwritefile(v.hDisk, v.sectorsize, index, size, newsize - size, v.disksize, v.tablestr, buf, filenameindex, 1), "write grown");
+			}
+		}
+		else if (op <= 7 && size)
+		{
+			unsigned long long start = rng() % size;
+			std::string data(1 + rng() % (size - start), 0);
+			for (char& c : data)
+			{
+				c = rng() & 0xff;
+			}
+			char* buf = &data[0];
+			fails += check(!readwritefile(v.hDisk, v.sectorsize, index, start, data.size(), v.disksize, v.tablestr, buf, filenameindex, 1), "write");
+			f.data.replace(start, data.size(), data);
+		}
+		else if (op == 8)
+		{
+			fails += check(!trunfile(v.hDisk, v.sectorsize, index, v.tablesize, v.disksize, size, 0, filenameindex, charmap, v.tablestr, v.usedblocks, name, v.filenames, v.filenamecount), "truncate before delete");
+			deletefile(index, filenameindex, filenamestrindex, v.filenamecount, v.filenames, v.tablestr);
+			files.erase(files.begin() + (&f - &files[0]));
+		}
+		else if (op == 9)
+		{
+			std::wstring newname = L"/r" + std::to_wstring(rng() % 100000);
+			unsigned long long newindex = 0;
+			unsigned long long newstrindex = 0;
+			getfilenameindex((PWSTR)newname.c_str(), v.filenames, v.filenamecount, newindex, newstrindex);
+			if (newindex < v.filenamecount)
+			{
+				continue;
+			}
+			fails += check(!renamefile(name, (PWSTR)newname.c_str(), filenamestrindex, v.filenames), "renamefile");
+			f.name = newname;
+		}
+		else if (v.table[0] & 32 && op == 11)
+		{ // A reparse buffer written the way SetReparsePoint does it
+			std::string data(4 + rng() % 60, 0);
+			for (char& c : data)
+			{
+				c = rng() & 0xff;
+			}
+			if (trunfile(v.hDisk, v.sectorsize, index, v.tablesize, v.disksize, size, data.size(), filenameindex, charmap, v.tablestr, v.usedblocks, name, v.filenames, v.filenamecount))
+			{
+				continue;
+			}
+			char* buf = &data[0];
+			fails += check(!readwritefile(v.hDisk, v.sectorsize, index, 0, data.size(), v.disksize, v.tablestr, buf, filenameindex, 1), "write reparse buffer");
+			unsigned long winattrs = 1024;
+			chwinattrs(filenameindex, winattrs, 1);
+			f.tag = (unsigned long)(data[0] & 0xff) | (data[1] & 0xff) << 8 | (data[2] & 0xff) << 16 | (unsigned long)(data[3] & 0xff) << 24;
+			chreparse(filenameindex, f.tag, 1);
+			f.data = data;
+		}
+		else if (v.table[0] & 32)
+		{ // Few distinct descriptors across many files, as on a real volume
+			std::string descriptor = pool[rng() % pool.size()];
+			if (rng() % 2)
+			{ // Read from a security file first, or one that is never stored, before the id goes in the table
+				std::string kept = rng() % 2 ? descriptor : "security file " + std::to_string(rng() % 8);
+				fails += check(getdescriptor(keepdescriptor(kept)) == kept, "kept descriptor");
+			}
+			unsigned long id = 0;
+			fails += check(!adddescriptor(v.hDisk, v.sectorsize, v.tablesize, v.disksize, charmap, v.tablestr, v.usedblocks, v.filenamecount, v.filenames, descriptor, id), "adddescriptor");
+			getfilenameindex(name, v.filenames, v.filenamecount, filenameindex, filenamestrindex);
+			chdescriptor(filenameindex, id, 1);
+			f.descriptor = descriptor;
+		}
+		if (it % 50 == 49)
+		{
+			fails += check(!reload(v), "reload");
+			fails += compare(v, files, inlined);
+		}
+	}
+	fails += check(!reload(v), "reload");
+	fails += compare(v, files, inlined);
+	for (File& f : files)
+	{ // Growing out of the table entry fails on a full disk and on a failed write, the bytes stay in the entry
+		PWSTR name = (PWSTR)f.name.c_str();
+		unsigned long long filenameindex = 0;
+		unsigned long long filenamestrindex = 0;
+		getfilenameindex(name, v.filenames, v.filenamecount, filenameindex, filenamestrindex);
+		unsigned long long index = gettablestrindex(name, v.filenames, v.tablestr, v.filenamecount);
+		if (f.data.empty() || getextents(v.sectorsize, index, v.tablestr, filenameindex)[0].sector != ULLONG_MAX)
+		{
+			continue;
+		}
+		unsigned long long usedblocks = v.usedblocks;
+		fails += check(trunfile(v.hDisk, v.sectorsize, index, v.tablesize, v.disksize, f.data.size(), v.disksize, filenameindex, charmap, v.tablestr, v.usedblocks, name, v.filenames, v.filenamecount), "grown past a full disk");
+		char path[32];
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+		int rfd = open(path, O_RDONLY);
+		v.hDisk = (HANDLE)(intptr_t)rfd;
+		fails += check(rfd >= 0 && trunfile(v.hDisk, v.sectorsize, index, v.tablesize, v.disksize, f.data.size(), 3000, filenameindex, charmap, v.tablestr, v.usedblocks, name, v.filenames, v.filenamecount), "grown with a failed write");
+		v.hDisk = (HANDLE)(intptr_t)fd;
+		close(rfd);
+		fails += check(usedblocks == v.usedblocks, "sectors given back");
+		fails += check(!reload(v), "reload");
+		fails += compare(v, files, inlined);
+		break;
+	}
+	for (File& f : files)
+	{ // A tag that disagrees with its buffer is set again from the buffer
+		if (f.tag)
+		{
+			unsigned long long filenameindex = 0;
+			unsigned long long filenamestrindex = 0;
+			getfilenameindex((PWSTR)f.name.c_str(), v.filenames, v.filenamecount, filenameindex, filenamestrindex);
+			unsigned long tag = f.tag ^ 1;
+			chreparse(filenameindex, tag, 1);
+			fails += check(checkreparse(v.hDisk, v.sectorsize, v.disksize, v.tablestr, v.filenamecount) == 1, "reparse tag set again");
+			chreparse(filenameindex, tag, 0);
+			fails += check(tag == f.tag, "reparse tag from its buffer");
+			break;
+		}
+	}
+	fails += check(!extended || files.end() != std::find_if(files.begin(), files.end(), [](File& f) { return f.tag; }), "reparse points kept");
+	unsigned long long stored = std::count_if(descriptors.begin(), descriptors.end(), [](std::string& d) { return !d.empty(); });
+	fails += check(stored <= pool.size(), "descriptors stored once");
+	fails += check(!extended || inlined, "small files kept in the table");
+	printf("%s: %zu files, %llu in the table, %llu descriptors, %d failures\n", extended ? "extended records" : "format v2", files.size(), inlined, stored, fails);
+	close(fd);
+	free(v.table);
+	free(v.tablestr);
+	free(v.filenames);
+	return fails;
+}
+
+int main(int argc, char** argv)
+{
+	std::mt19937 rng(argc > 1 ? atoi(argv[1]) : 1);
+	buildmaps();
+	int fails = run(rng, false);
+	fails += run(rng, true);
+	return fails != 0;
+}